@@ -0,0 +1,453 @@
+//
+// es_vm
+//
+// Benchmarks, hand assembled byte code workloads
+//   es_vm_bench [-csv] [-jit] [-reps n] [-scale f] [workload ...]
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "vm.h"
+#include "vm_builtins.h"
+
+#define E_BENCH_CODE_SIZE	((uint32_t)65536)
+#define E_BENCH_REPS		((uint32_t)5)
+
+// Byte code emitter
+typedef struct {
+	uint8_t bytes[E_BENCH_CODE_SIZE];
+	uint32_t len;
+} e_bench_code;
+
+typedef struct {
+	const char* name;
+	const char* description;
+	void (*build)(e_bench_code* c, double n);
+	double n;                   /* Iterations of the workload's loop */
+} e_bench_workload;
+
+typedef struct {
+	uint64_t instructions;
+	uint64_t ns;                /* Best of all repetitions */
+	uint64_t memory;            /* Bytes used by the vm after the run */
+	e_vm_status status;
+} e_bench_result;
+
+// Callbacks
+uint8_t e_read_byte(uint32_t offset) {
+	(void)offset;
+	return 0;
+}
+
+void e_fail(const char* msg) {
+	fprintf(stderr, "%s\n", msg);
+}
+
+void e_print(const char* msg) {
+	(void)msg;
+}
+
+uint8_t e_check_locked(void) {
+	return 0;
+}
+
+// Emitter
+static void e_bench_op(e_bench_code* c, e_opcode op);
+static uint32_t e_bench_opd(e_bench_code* c, e_opcode op, double d);
+static void e_bench_patch(e_bench_code* c, uint32_t at, double d);
+static void e_bench_pushs(e_bench_code* c, const char* s);
+static uint32_t e_bench_loop_begin(e_bench_code* c, uint32_t counter, double n, uint32_t* jz);
+static void e_bench_loop_end(e_bench_code* c, uint32_t counter, uint32_t loop, uint32_t jz);
+
+void
+e_bench_op(e_bench_code* c, e_opcode op) {
+	if(c->len < E_BENCH_CODE_SIZE) c->bytes[c->len++] = (uint8_t)op;
+}
+
+uint32_t
+e_bench_opd(e_bench_code* c, e_opcode op, double d) {
+	e_bench_op(c, op);
+	uint32_t at = c->len;
+	e_bench_patch(c, at, d);
+	c->len += 8;
+	return at;
+}
+
+void
+e_bench_patch(e_bench_code* c, uint32_t at, double d) {
+	/* Operands are big endian doubles */
+	if(at + 8 > E_BENCH_CODE_SIZE) return;
+	uint64_t b;
+	memcpy(&b, &d, sizeof(b));
+	for(uint32_t i = 0; i < 8; i++) {
+		c->bytes[at + i] = (uint8_t)(b >> ((7 - i) * 8));
+	}
+}
+
+void
+e_bench_pushs(e_bench_code* c, const char* s) {
+	uint32_t slen = strlen(s);
+	e_bench_opd(c, E_OP_PUSHS, slen);
+	if(c->len + slen > E_BENCH_CODE_SIZE) return;
+	memcpy(&c->bytes[c->len], s, slen);
+	c->len += slen;
+}
+
+uint32_t
+e_bench_loop_begin(e_bench_code* c, uint32_t counter, double n, uint32_t* jz) {
+	/* for(g[counter] = 0; g[counter] < n; g[counter]++) */
+	e_bench_opd(c, E_OP_PUSH, 0);
+	e_bench_opd(c, E_OP_PUSHG, counter);
+	uint32_t loop = c->len;
+	e_bench_opd(c, E_OP_POPG, counter);
+	e_bench_opd(c, E_OP_PUSH, n);
+	e_bench_op(c, E_OP_LT);
+	*jz = e_bench_opd(c, E_OP_JZ, 0);
+	return loop;
+}
+
+void
+e_bench_loop_end(e_bench_code* c, uint32_t counter, uint32_t loop, uint32_t jz) {
+	e_bench_opd(c, E_OP_POPG, counter);
+	e_bench_opd(c, E_OP_PUSH, 1);
+	e_bench_op(c, E_OP_ADD);
+	e_bench_opd(c, E_OP_PUSHG, counter);
+	e_bench_opd(c, E_OP_JMP, loop);
+	e_bench_patch(c, jz, c->len);
+}
+
+// Workloads, g1 is the loop counter
+static void
+e_bench_arith(e_bench_code* c, double n) {
+	/* g0 = (g0 + i * 3 - 1) / 2 */
+	uint32_t jz;
+	e_bench_opd(c, E_OP_PUSH, 0);
+	e_bench_opd(c, E_OP_PUSHG, 0);
+	uint32_t loop = e_bench_loop_begin(c, 1, n, &jz);
+	e_bench_opd(c, E_OP_POPG, 0);
+	e_bench_opd(c, E_OP_POPG, 1);
+	e_bench_opd(c, E_OP_PUSH, 3);
+	e_bench_op(c, E_OP_MUL);
+	e_bench_op(c, E_OP_ADD);
+	e_bench_opd(c, E_OP_PUSH, 1);
+	e_bench_op(c, E_OP_SUB);
+	e_bench_opd(c, E_OP_PUSH, 2);
+	e_bench_op(c, E_OP_DIV);
+	e_bench_opd(c, E_OP_PUSHG, 0);
+	e_bench_loop_end(c, 1, loop, jz);
+	e_bench_op(c, E_OP_NOP);
+}
+
+static void
+e_bench_vars(e_bench_code* c, double n) {
+	/* l0 = l0 + i; l1 = l0 - l1; g2 = l1; g3 = g2 */
+	uint32_t jz;
+	e_bench_opd(c, E_OP_PUSH, 0);
+	e_bench_opd(c, E_OP_PUSHL, 0);
+	e_bench_opd(c, E_OP_PUSH, 0);
+	e_bench_opd(c, E_OP_PUSHL, 1);
+	uint32_t loop = e_bench_loop_begin(c, 1, n, &jz);
+	e_bench_opd(c, E_OP_POPL, 0);
+	e_bench_opd(c, E_OP_POPG, 1);
+	e_bench_op(c, E_OP_ADD);
+	e_bench_opd(c, E_OP_PUSHL, 0);
+	e_bench_opd(c, E_OP_POPL, 0);
+	e_bench_opd(c, E_OP_POPL, 1);
+	e_bench_op(c, E_OP_SUB);
+	e_bench_opd(c, E_OP_PUSHL, 1);
+	e_bench_opd(c, E_OP_POPL, 1);
+	e_bench_opd(c, E_OP_PUSHG, 2);
+	e_bench_opd(c, E_OP_POPG, 2);
+	e_bench_opd(c, E_OP_PUSHG, 3);
+	e_bench_loop_end(c, 1, loop, jz);
+	e_bench_op(c, E_OP_NOP);
+}
+
+static void
+e_bench_concat(e_bench_code* c, double n) {
+	/* g2 = "item" . i; g3 = g2 . g2 */
+	uint32_t jz;
+	uint32_t loop = e_bench_loop_begin(c, 1, n, &jz);
+	e_bench_pushs(c, "item");
+	e_bench_opd(c, E_OP_POPG, 1);
+	e_bench_opd(c, E_OP_CONCAT, 0);
+	e_bench_opd(c, E_OP_PUSHG, 2);
+	e_bench_opd(c, E_OP_POPG, 2);
+	e_bench_opd(c, E_OP_POPG, 2);
+	e_bench_opd(c, E_OP_CONCAT, 0);
+	e_bench_opd(c, E_OP_PUSHG, 3);
+	e_bench_loop_end(c, 1, loop, jz);
+	e_bench_op(c, E_OP_NOP);
+}
+
+static void
+e_bench_array(e_bench_code* c, double n) {
+	/* g2 = array(256); g3 = g3 + g2[i % 256]; g2[i % 256] = i */
+	uint32_t jz;
+	e_bench_opd(c, E_OP_PUSH, 256);
+	e_bench_op(c, E_OP_ARRAY);
+	e_bench_opd(c, E_OP_PUSHG, 2);
+	e_bench_opd(c, E_OP_PUSH, 0);
+	e_bench_opd(c, E_OP_PUSHG, 3);
+	uint32_t loop = e_bench_loop_begin(c, 1, n, &jz);
+	e_bench_opd(c, E_OP_POPG, 3);
+	e_bench_opd(c, E_OP_POPG, 1);
+	e_bench_opd(c, E_OP_PUSH, 256);
+	e_bench_op(c, E_OP_MOD);
+	e_bench_op(c, E_OP_PUSHAS);
+	e_bench_opd(c, E_OP_POPG, 2);
+	e_bench_op(c, E_OP_ADD);
+	e_bench_opd(c, E_OP_PUSHG, 3);
+	e_bench_opd(c, E_OP_POPG, 1);
+	e_bench_opd(c, E_OP_POPG, 1);
+	e_bench_opd(c, E_OP_PUSH, 256);
+	e_bench_op(c, E_OP_MOD);
+	e_bench_op(c, E_OP_PUSHAS);
+	e_bench_opd(c, E_OP_PUSHG, 2);
+	e_bench_loop_end(c, 1, loop, jz);
+	e_bench_op(c, E_OP_NOP);
+}
+
+static void
+e_bench_sort(e_bench_code* c, double n) {
+	/* g2 = 48 numbers; g3 = __sort(g2), the array is refilled and sorted in place every iteration */
+	uint32_t jz;
+	uint32_t loop = e_bench_loop_begin(c, 1, n, &jz);
+	for(uint32_t i = 0; i < 48; i++) {
+		e_bench_opd(c, E_OP_PUSH, (i * 37) % 101);
+	}
+	e_bench_opd(c, E_OP_DATA, 48);
+	e_bench_opd(c, E_OP_PUSHG, 2);
+	e_bench_opd(c, E_OP_POPG, 2);
+	e_bench_pushs(c, "__sort");
+	e_bench_opd(c, E_OP_CALL, 1);
+	e_bench_opd(c, E_OP_PUSHG, 3);
+	e_bench_loop_end(c, 1, loop, jz);
+	e_bench_op(c, E_OP_NOP);
+}
+
+static void
+e_bench_reduce(e_bench_code* c, double n) {
+	/* g2 = array(1024); g2[k] = k for k < 1024 (counter g4); g3 = __sum(g2) */
+	uint32_t jz;
+	e_bench_opd(c, E_OP_PUSH, 1024);
+	e_bench_op(c, E_OP_ARRAY);
+	e_bench_opd(c, E_OP_PUSHG, 2);
+	uint32_t fill = e_bench_loop_begin(c, 4, 1024, &jz);
+	e_bench_opd(c, E_OP_POPG, 4);
+	e_bench_opd(c, E_OP_POPG, 4);
+	e_bench_op(c, E_OP_PUSHAS);
+	e_bench_opd(c, E_OP_PUSHG, 2);
+	e_bench_loop_end(c, 4, fill, jz);
+	uint32_t loop = e_bench_loop_begin(c, 1, n, &jz);
+	e_bench_opd(c, E_OP_POPG, 2);
+	e_bench_pushs(c, "__sum");
+	e_bench_opd(c, E_OP_CALL, 1);
+	e_bench_opd(c, E_OP_PUSHG, 3);
+	e_bench_loop_end(c, 1, loop, jz);
+	e_bench_op(c, E_OP_NOP);
+}
+
+static void
+e_bench_calls(e_bench_code* c, double n) {
+	/* g0 = f(g0), f(x) = x + 1 */
+	uint32_t jz;
+	e_bench_opd(c, E_OP_PUSH, 0);
+	e_bench_opd(c, E_OP_PUSHG, 0);
+	uint32_t loop = e_bench_loop_begin(c, 1, n, &jz);
+	e_bench_opd(c, E_OP_POPG, 0);
+	uint32_t ret = e_bench_opd(c, E_OP_PUSH, 0);
+	uint32_t call = e_bench_opd(c, E_OP_JMPFUN, 0);
+	e_bench_patch(c, ret, c->len);
+	e_bench_opd(c, E_OP_PUSHG, 0);
+	e_bench_opd(c, E_OP_POPG, 1);
+	e_bench_opd(c, E_OP_PUSH, 1);
+	e_bench_op(c, E_OP_ADD);
+	e_bench_opd(c, E_OP_PUSHG, 1);
+	e_bench_opd(c, E_OP_JMP, loop);
+
+	e_bench_patch(c, call, c->len);
+	e_bench_opd(c, E_OP_PUSHL, 0);
+	e_bench_opd(c, E_OP_POPL, 0);
+	e_bench_opd(c, E_OP_PUSH, 1);
+	e_bench_op(c, E_OP_ADD);
+	e_bench_opd(c, E_OP_JFS, 0);
+
+	e_bench_patch(c, jz, c->len);
+	e_bench_op(c, E_OP_NOP);
+}
+
+static uint32_t
+e_bench_add(e_vm* vm, uint32_t arglen) {
+	if(arglen == 2) {
+		e_stack_status_ret a = e_api_stack_pop(&vm->stack);
+		e_stack_status_ret b = e_api_stack_pop(&vm->stack);
+		if(a.status == E_STATUS_OK && b.status == E_STATUS_OK) {
+			e_api_stack_push(&vm->stack, e_create_number(a.val.val + b.val.val));
+			return E_API_CALL_RETURN_OK(1);
+		}
+	}
+	return E_API_CALL_RETURN_ERROR;
+}
+
+static void
+e_bench_hostcalls(e_bench_code* c, double n) {
+	/* g0 = add(g0, i) */
+	uint32_t jz;
+	e_bench_opd(c, E_OP_PUSH, 0);
+	e_bench_opd(c, E_OP_PUSHG, 0);
+	uint32_t loop = e_bench_loop_begin(c, 1, n, &jz);
+	e_bench_opd(c, E_OP_POPG, 0);
+	e_bench_opd(c, E_OP_POPG, 1);
+	e_bench_pushs(c, "add");
+	e_bench_opd(c, E_OP_CALL, 2);
+	e_bench_opd(c, E_OP_PUSHG, 0);
+	e_bench_loop_end(c, 1, loop, jz);
+	e_bench_op(c, E_OP_NOP);
+}
+
+static const e_bench_workload e_bench_workloads[] = {
+	{ "arith", "arithmetic loop on globals", &e_bench_arith, 2000000 },
+	{ "vars", "global / local loads and stores", &e_bench_vars, 1000000 },
+	{ "concat", "number to string and string concatenation", &e_bench_concat, 300000 },
+	{ "array", "indexed array loads and stores", &e_bench_array, 1000000 },
+	{ "sort", "__sort of a 48 element array", &e_bench_sort, 20000 },
+	{ "reduce", "__sum of a 1024 element array", &e_bench_reduce, 200000 },
+	{ "calls", "script function calls (JMPFUN / JFS)", &e_bench_calls, 1000000 },
+	{ "hostcalls", "C function calls", &e_bench_hostcalls, 1000000 },
+};
+
+// Runner
+static uint8_t e_bench_run(const e_bench_workload* w, double scale, uint32_t reps, e_registry* reg, uint8_t jit, e_bench_result* r);
+static uint64_t e_bench_memory(const e_vm* vm);
+
+uint64_t
+e_bench_memory(const e_vm* vm) {
+	/* The vm itself, its storage (see e_vm_alloc), its decoded program, arrays and live strings */
+	uint64_t bytes = sizeof(e_vm);
+	if(vm->stack.entries != NULL) {
+		bytes += sizeof(e_value) * ((uint64_t)vm->config.stack_size + vm->config.globals + vm->config.locals)
+				 + sizeof(e_callframe) * vm->config.callframes;
+	}
+	if(vm->frame_slots != NULL) bytes += sizeof(e_value) * (uint64_t)vm->config.frame_slots;
+	if(vm->prog != NULL) {
+		bytes += (uint64_t)(vm->prog->count + 1) * sizeof(e_dinstr) + (uint64_t)vm->prog->lcount * sizeof(e_value);
+	}
+	bytes += vm->arena.bytes;
+	bytes += vm->strings.bytes + (uint64_t)vm->strings.live * sizeof(e_str_type);
+	return bytes;
+}
+
+uint8_t
+e_bench_run(const e_bench_workload* w, double scale, uint32_t reps, e_registry* reg, uint8_t jit, e_bench_result* r) {
+	static e_bench_code code;
+	*r = (e_bench_result) { .ns = UINT64_MAX, .status = E_VM_STATUS_ERROR };
+	code.len = 0;
+	w->build(&code, w->n * scale);
+	if(code.len >= E_BENCH_CODE_SIZE) {
+		e_fail("Workload too large");
+		return 0;
+	}
+
+	e_vm* vm = E_MALLOC(sizeof(e_vm));
+	if(vm == NULL) return 0;
+	e_vm_init(vm);
+	e_vm_set_registry(vm, reg);
+	if(e_vm_load_buffer(vm, code.bytes, code.len) != E_VM_STATUS_OK) {
+		e_vm_destroy(vm);
+		E_FREE(vm);
+		return 0;
+	}
+
+	/* Code compiled by the jit is kept between repetitions */
+	e_jit j;
+	e_jit_init(&j);
+	if(jit) e_vm_set_jit(vm, &j);
+
+	for(uint32_t i = 0; i < reps; i++) {
+		e_vm_reset(vm);
+		uint64_t start = e_vm_clock_ns();
+		r->status = e_vm_run(vm, &vm->program);
+		uint64_t ns = e_vm_clock_ns() - start;
+
+		if(ns < r->ns) r->ns = ns;
+		r->instructions = vm->executed;
+		r->memory = e_bench_memory(vm);
+		if(r->status != E_VM_STATUS_OK) break;
+	}
+
+	e_vm_destroy(vm);
+	E_FREE(vm);
+	e_jit_free(&j);
+	return r->status == E_VM_STATUS_OK;
+}
+
+int main(int argc, char** argv) {
+	uint8_t csv = 0;
+	uint8_t jit = 0;
+	uint32_t reps = E_BENCH_REPS;
+	double scale = 1;
+	int filters = 0;
+	const char* filter[64];
+
+	for(int a = 1; a < argc; a++) {
+		if(strcmp(argv[a], "-csv") == 0) {
+			csv = 1;
+		} else if(strcmp(argv[a], "-jit") == 0) {
+			jit = 1;
+		} else if(strcmp(argv[a], "-reps") == 0 && a + 1 < argc) {
+			reps = (uint32_t)strtoul(argv[++a], NULL, 10);
+			if(reps == 0) reps = 1;
+		} else if(strcmp(argv[a], "-scale") == 0 && a + 1 < argc) {
+			scale = strtod(argv[++a], NULL);
+			if(scale <= 0) scale = 1;
+		} else if(filters < 64) {
+			filter[filters++] = argv[a];
+		}
+	}
+
+	e_registry reg;
+	e_registry_init(&reg);
+	e_registry_add(&reg, "__sort", &e_builtin_sort);
+	e_registry_add(&reg, "__sum", &e_builtin_sum);
+	e_registry_add(&reg, "add", &e_bench_add);
+
+	if(csv) {
+		printf("workload,iterations,instructions,ns,instr_per_s,ns_per_instr,ns_per_iteration,vm_bytes\n");
+	} else {
+		printf("%-10s %10s %12s %10s %12s %10s %12s %10s\n", "workload", "iterations", "instructions", "ms", "Minstr/s", "ns/instr",
+			   "ns/iter", "vm KiB");
+	}
+
+	int failed = 0;
+	for(uint32_t i = 0; i < sizeof(e_bench_workloads) / sizeof(e_bench_workloads[0]); i++) {
+		const e_bench_workload* w = &e_bench_workloads[i];
+		if(filters > 0) {
+			int match = 0;
+			for(int f = 0; f < filters; f++) {
+				if(strcmp(filter[f], w->name) == 0) match = 1;
+			}
+			if(!match) continue;
+		}
+
+		e_bench_result r;
+		if(!e_bench_run(w, scale, reps, &reg, jit, &r)) {
+			fprintf(stderr, "%s: failed (status %d)\n", w->name, r.status);
+			failed = 1;
+			continue;
+		}
+
+		double iterations = (double)(uint64_t)(w->n * scale);
+		double ns = r.ns > 0 ? (double)r.ns : 1;
+		double ns_instr = ns / (double)r.instructions;
+		if(csv) {
+			printf("%s,%.0f,%llu,%llu,%.0f,%.3f,%.3f,%llu\n", w->name, iterations, (unsigned long long)r.instructions,
+				   (unsigned long long)r.ns, 1e9 / ns_instr, ns_instr, ns / iterations, (unsigned long long)r.memory);
+		} else {
+			printf("%-10s %10.0f %12llu %10.2f %12.1f %10.2f %12.2f %10.1f\n", w->name, iterations,
+				   (unsigned long long)r.instructions, ns / 1e6, 1e3 / ns_instr, ns_instr, ns / iterations, r.memory / 1024.0);
+		}
+	}
+	return failed;
+}
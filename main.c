@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -7,10 +8,27 @@
 e_vm context;
 #define MAX_BUF_SIZE	((uint32_t)2500)
 
-int main(int argc, char** argv) {
-	uint8_t bytes_in[MAX_BUF_SIZE];
-	uint32_t bCnt = 0;
+static uint8_t bytes_in[MAX_BUF_SIZE];
+static uint32_t bCnt = 0;
+
+// Callbacks
+uint8_t e_read_byte(uint32_t offset) {
+	return offset < bCnt ? bytes_in[offset] : 0;
+}
+
+void e_fail(const char* msg) {
+	fprintf(stderr, "%s\n", msg);
+}
+
+void e_print(const char* msg) {
+	printf("%s\n", msg);
+}
 
+uint8_t e_check_locked(void) {
+	return 0;
+}
+
+int main(int argc, char** argv) {
 	bool bytes_mode = false;
 	for(int a = 0; a < argc; a++) {
 		if(!bytes_mode) {
@@ -28,8 +46,16 @@ int main(int argc, char** argv) {
 
 	e_vm_init(&context);
 	e_api_register_sub("__sort", &e_builtin_sort);
+	e_api_register_sub("__sum", &e_builtin_sum);
+	e_api_register_sub("__min", &e_builtin_min);
+	e_api_register_sub("__max", &e_builtin_max);
+	e_api_register_sub("__mean", &e_builtin_mean);
+	e_api_register_sub("__dot", &e_builtin_dot);
+	e_api_register_sub("__scale", &e_builtin_scale);
+	e_api_register_sub("__clamp", &e_builtin_clamp);
 
-	e_vm_parse_bytes(&context, /*script_offset*/0, /*blen*/0);
+	e_vm_status s = e_vm_parse_buffer(&context, bytes_in, bCnt);
+	e_vm_destroy(&context);
 
-	return 0;
-}
\ No newline at end of file
+	return s == E_VM_STATUS_ERROR ? 1 : 0;
+}
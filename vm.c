@@ -2,8 +2,15 @@
 // es_vm
 //
 
+#if defined(__unix__) || defined(__APPLE__)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
 #include "vm.h"
 #include "vm_builtins.h"
 
@@ -15,803 +22,1355 @@ char dbg_s[E_MAX_STRLEN];
 
 #define E_USE_LOCK 0
 
-e_external_mapping e_external_map[E_MAX_EXTIDENTIFIERS];
+#if defined(__unix__) || defined(__APPLE__)
+#define E_USE_CLOCK_GETTIME 1
+#else
+#define E_USE_CLOCK_GETTIME 0
+#endif
+
+// Room for the string form of an array
+#define E_ARRSTR_SIZE	((uint32_t)48)
+
+#ifndef E_USE_SUPERINSTRUCTIONS
+#define E_USE_SUPERINSTRUCTIONS 1
+#endif
+
+#ifndef E_USE_REGISTERS
+#define E_USE_REGISTERS 1
+#endif
+
+#ifndef E_USE_QUICKENING
+#define E_USE_QUICKENING 1
+#endif
+
+// Dispatch, direct threaded dispatch requires the labels as values extension (GCC, Clang)
+#ifndef E_THREADED_DISPATCH
+#define E_THREADED_DISPATCH 0
+#endif
+#if E_THREADED_DISPATCH && !defined(__GNUC__)
+#undef E_THREADED_DISPATCH
+#define E_THREADED_DISPATCH 0
+#endif
+
+// Baseline JIT, compiled in with E_JIT and enabled per vm with e_vm_set_jit
+#ifndef E_JIT
+#define E_JIT 0
+#endif
+
+// Profiler, compiled in with E_PROFILE and enabled per vm with e_vm_set_profile
+#ifndef E_PROFILE
+#define E_PROFILE 0
+#endif
+
+#if E_PROFILE
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define E_PROFILE_CYCLES()	((uint64_t)__rdtsc())
+#elif defined(__GNUC__) && defined(__aarch64__)
+static inline uint64_t e_profile_cycles(void) { uint64_t t; __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t)); return t; }
+#define E_PROFILE_CYCLES()	e_profile_cycles()
+#else
+#define E_PROFILE_CYCLES()	e_vm_clock_ns()
+#endif
+
+// Every instruction is counted, the cycles of every E_PROFILE_PERIOD-th instruction are measured (until the next fetch)
+#define E_PROFILE_FETCH()	do { \
+								if(prof != NULL) { \
+									prof->ops[code[vm->ip].OP].count++; \
+									prof->ips[vm->ip].hits++; \
+									if(--prof->countdown == 0) e_profile_sample(prof, code[vm->ip].OP); \
+								} \
+							} while(0)
+#define E_PROFILE_CALL(t)	do { \
+								if(prof != NULL) { \
+									prof->frames[vm->cfcnt - 1] = (e_profile_frame) { .target = (t), .start = E_PROFILE_CYCLES() - prof->paused }; \
+									prof->ips[(t)].calls++; \
+								} \
+							} while(0)
+#define E_PROFILE_RETURN()	do { \
+								if(prof != NULL && prof->frames[vm->cfcnt - 1].target < prof->ip_count) { \
+									e_profile_frame* f_ = &prof->frames[vm->cfcnt - 1]; \
+									prof->ips[f_->target].cycles += E_PROFILE_CYCLES() - prof->paused - f_->start; \
+									f_->target = E_TARGET_INVALID; \
+								} \
+							} while(0)
+#define E_PROFILE_PAUSE()	do { if(prof != NULL) prof->paused_at = E_PROFILE_CYCLES(); } while(0)
+#else
+#define E_PROFILE_FETCH()	do { } while(0)
+#define E_PROFILE_PAUSE()	do { } while(0)
+#define E_PROFILE_CALL(t)	do { } while(0)
+#define E_PROFILE_RETURN()	do { } while(0)
+#endif
+
+#if E_DEBUG
+#define E_TRACE()		do { \
+							snprintf(dbg_s, E_MAX_STRLEN, "** IP: %d ** [0x%02X] (0x%02X, 0x%02X)", \
+									 code[vm->ip].addr, code[vm->ip].OP, code[vm->ip].op1, code[vm->ip].op2); \
+							e_print(dbg_s); \
+						} while(0)
+#else
+#define E_TRACE()		do { } while(0)
+#endif
+
+// Every fetch takes a step from the budget, the vm suspends before the instruction it has no step left for
+#if E_USE_LOCK
+#define E_FETCH()		do { if(steps-- == 0) goto suspend; while(e_check_locked()); E_TRACE(); E_PROFILE_FETCH(); instr = &code[vm->ip++]; } while(0)
+#else
+#define E_FETCH()		do { if(steps-- == 0) goto suspend; E_TRACE(); E_PROFILE_FETCH(); instr = &code[vm->ip++]; } while(0)
+#endif
+
+// Quickening: the first execution of an arithmetic or compare instruction rewrites it to the variant for the types
+// of its operands, the variant checks the types and runs the generic instruction if they differ.
+// A program shared by vms on other threads (prog->shared, see e_runner_prepare) is never rewritten
+#define E_NUMBERS(a, b)		((a).argtype == E_NUMBER && (b).argtype == E_NUMBER)
+#define E_STRINGS(a, b)		((a).argtype == E_STRING && (b).argtype == E_STRING)
+#if E_USE_QUICKENING
+#define E_QUICKEN(from, to)	do { if(!prog->shared && instr->OP == (from)) ((e_dinstr*)instr)->OP = (uint8_t)(to); } while(0)
+#else
+#define E_QUICKEN(from, to)	do { } while(0)
+#endif
+#define E_QUICKEN_TYPES(op, a, b)	do { \
+								if(E_NUMBERS(a, b)) E_QUICKEN(op, op##_NUM_NUM); \
+								else if(((op) == E_OP_EQ || (op) == E_OP_NOTEQ) && E_STRINGS(a, b)) E_QUICKEN(op, (op) == E_OP_EQ ? E_OP_EQ_STR_STR : E_OP_NOTEQ_STR_STR); \
+							} while(0)
+#define E_QUICK_GUARD(op, types)	do { \
+								if(E_UNVERIFIED(vm->stack.top < 2) \
+								   || !types(vm->stack.entries[vm->stack.top - 2], vm->stack.entries[vm->stack.top - 1])) E_REDISPATCH(op); \
+							} while(0)
+#define E_QUICK_NUM(o)		do { \
+								e_value* e = &vm->stack.entries[--vm->stack.top]; \
+								e[-1].val = e[-1].val o e[0].val; \
+							} while(0)
+
+// A binary instruction whose second pop failed releases the operand it already popped, a failed pop holds no value
+#define E_OPERANDS_ERROR()	do { e_value_release(s1.val); e_value_release(s2.val); goto error; } while(0)
+
+// Locals of the current call frame
+#define E_LOCALS(vm)		((vm)->cfcnt > 0 ? &(vm)->frame_slots[(vm)->callframes[(vm)->cfcnt - 1].base] : (vm)->locals)
+#define E_LOCALS_SIZE(vm)	((vm)->cfcnt > 0 ? (vm)->callframes[(vm)->cfcnt - 1].size : (vm)->config.locals)
+
+// Superinstructions: skip the fused JZ, or take its jump if the condition does not hold
+#define E_BRANCH_UNLESS(c)	do { \
+								if(!(c)) { \
+									if(E_UNVERIFIED(instr[1].target == E_TARGET_INVALID)) goto error; \
+									vm->ip = instr[1].target; \
+								} else { \
+									vm->ip++; \
+								} \
+							} while(0)
+
+#if E_THREADED_DISPATCH
+#define E_CASE(op)		op_##op:
+#define E_DEFAULT		op_invalid:
+#define E_SWITCH()		E_FETCH(); goto *dispatch_table[instr->OP];
+#define E_NEXT()		do { E_FETCH(); goto *dispatch_table[instr->OP]; } while(0)
+#define E_REDISPATCH(op)	goto *dispatch_table[(op)]
+#else
+#define E_CASE(op)		case op:
+#define E_DEFAULT		default:
+#define E_SWITCH()		E_FETCH(); opcode = instr->OP; redispatch: switch(opcode)
+#define E_NEXT()		continue
+#define E_REDISPATCH(op)	do { opcode = (op); goto redispatch; } while(0)
+#endif
 
+// Arrays
+static e_array* e_array_new(e_vm* vm);
+static e_array* e_array_get(const e_vm* vm, e_value arr);
+static uint8_t e_array_column(e_vm* vm, e_array* a, uint32_t cap, uint8_t numeric);
+static uint8_t e_array_reserve(e_vm* vm, e_array* a, uint32_t cap);
+static uint8_t e_array_make_values(e_vm* vm, e_array* a);
+static uint8_t e_array_make_numeric(e_vm* vm, e_array* a);
+static uint8_t e_array_assign(e_vm* vm, e_array* a, e_value* values, uint32_t len);
+static uint8_t e_array_store(e_vm* vm, e_value* slot, e_value* values, uint32_t len);
 static uint8_t e_find_value_in_arr(const e_vm* vm, e_value arr, uint32_t index, e_value* vptr);
-static uint8_t e_change_value_in_arr(e_vm* vm, uint32_t aptr, uint32_t index, e_value v, uint32_t global_local);
-static uint8_t e_array_append(e_vm* vm, uint32_t aptr, uint32_t index, e_value v, uint32_t global_local);
+static uint8_t e_change_value_in_arr(e_vm* vm, e_value arr, uint32_t index, e_value v);
+
+// Loading
+static e_vm_status e_vm_start_program(e_vm* vm);
+
+// Interpreter
+static e_vm_status e_vm_exec_checked(e_vm* vm, const e_program* prog, uint64_t steps);
+static e_vm_status e_vm_exec_unchecked(e_vm* vm, const e_program* prog, uint64_t steps);
+
+// Calls
+static uint8_t e_vm_call_return(e_vm* vm, const char* name, int32_t tmp_stat, uint32_t argsbefore, uint32_t arglen);
+
+// Values
+static uint32_t e_value_str_size(e_value v);
+static uint32_t e_value_str_write(const e_vm* vm, e_value v, uint8_t* dst);
 
 // Stack
 static void e_stack_init(e_stack* stack, uint32_t size);
 static e_stack_status_ret e_stack_push(e_stack* stack, e_value v);
 static e_stack_status_ret e_stack_pop(e_stack* stack);
 static e_stack_status_ret e_stack_peek_index(const e_stack* stack, uint32_t index);
-static e_stack_status_ret e_stack_insert_at_index(e_stack* stack, e_value v, uint32_t index);
 static e_stack_status_ret e_stack_swap_last(e_stack* stack);
 
+// Program
+// Verifier state per instruction (see e_program_verify), a function's summary is kept at its entry
+typedef struct {
+	uint32_t owner;     /* Entry of the function the instruction belongs to + 1, 0 if not reached */
+	int32_t depth;      /* Stack depth before the instruction, relative to the function's base */
+	uint32_t data;      /* Pending DATA entries */
+	uint8_t target;     /* Jumped to or called */
+
+	/* Function summary */
+	uint8_t returns;    /* delta is known */
+	int32_t delta;      /* Depth at JFS */
+	int32_t min;        /* Lowest depth, including what called functions pop below their base */
+	int32_t max;        /* Highest depth of its own instructions */
+} e_verify_instr;
+
+static inline uint8_t e_fetch_byte(const uint8_t* bytes, uint32_t offset);
+static e_vm_status e_program_decode(e_program* prog, const uint8_t* bytes, uint32_t script_offset, uint32_t blen);
+static uint32_t e_program_index_of(const e_program* prog, double addr);
+static e_vm_status e_program_frame_sizes(e_program* prog);
+static e_vm_status e_program_verify(e_program* prog);
+static uint8_t e_verify_flow(e_verify_instr* v, uint32_t* work, uint32_t* wcnt, uint32_t count,
+							 uint32_t k, uint32_t owner, int32_t depth, uint32_t data);
+static uint8_t e_operand_index(double d, uint32_t limit);
+static e_vm_status e_program_translate(e_program* prog, const e_verify_instr* v);
+static uint8_t e_translate_emit(e_program* prog, uint32_t* cap, e_rinstr r);
+static uint8_t e_translate_spill(e_program* prog, uint32_t* cap, e_reg* slot, int32_t depth, const e_reg* var);
+static uint8_t e_translate_const(e_program* prog, uint32_t* cap, double d, e_reg* reg);
+static uint32_t e_str_hash(const uint8_t* s, uint32_t len);
+
 // Varstack
 static void e_varstack_init(e_value* varstack, uint32_t size);
 static e_stack_status_ret e_varstack_peek_index(const e_value* varstack, uint32_t index);
 static e_stack_status_ret e_varstack_insert_global_at_index(e_value* varstack, e_value v, uint32_t index);
-static e_stack_status_ret e_varstack_insert_local_at_index(e_value* varstack, e_value v, uint32_t index);
+
+// Call frames
+static e_value* e_frame_local(e_vm* vm, uint32_t index);
+static uint8_t e_frame_reserve(e_vm* vm, uint32_t frame, uint32_t size);
+static e_value e_frame_inherited(const e_vm* vm, uint32_t frame, uint32_t index);
+#if E_PROFILE
+static void e_profile_sample(e_profile* prof, uint8_t op);
+#endif
+
+// Limits
+static uint32_t e_config_limit(uint32_t value, uint32_t max);
 
 // VM
 void
 e_vm_init(e_vm* vm) {
+	e_vm_init_config(vm, NULL);
+}
+
+void
+e_vm_init_config(e_vm* vm, const e_vm_config* config) {
+	/* Nothing is allocated yet, an idle vm is only its struct */
 	if(vm == NULL) return;
+	const e_vm_config c = config != NULL ? *config : (e_vm_config) { 0 };
+	vm->config = (e_vm_config) {
+		.stack_size = e_config_limit(c.stack_size, E_STACK_SIZE),
+		.globals = e_config_limit(c.globals, E_MAX_GLOBALS),
+		.locals = e_config_limit(c.locals, E_MAX_LOCALS),
+		.callframes = e_config_limit(c.callframes, E_MAX_CALLFRAMES),
+		.frame_slots = e_config_limit(c.frame_slots, E_FRAME_STACK_SIZE),
+		.arrays = e_config_limit(c.arrays, E_MAX_ARRAYS),
+		.array_len = e_config_limit(c.array_len, E_MAX_ARRAY_LEN)
+	};
 	vm->ip = 0;
-	e_stack_init(&vm->stack, E_STACK_SIZE);
-	e_varstack_init(vm->globals, E_MAX_GLOBALS);
-	e_varstack_init(vm->locals, E_MAX_LOCALS);
+	vm->stack = (e_stack) { 0 };
+	vm->globals = NULL;
+	vm->locals = NULL;
+	vm->callframes = NULL;
+	vm->frame_slots = NULL;
 	vm->pupo_is_data = 0;
 	vm->pupo_arr_index = -1;
 	vm->ds_offset = 0;
-	for(uint32_t i = 0; i < E_MAX_LOCALS; i++) {
-		for(uint32_t e = 0; e < E_MAX_ARRAYSIZE; e++) {
-			vm->arrays_local[i][e] = (e_array_entry) { .v = {{ 0 }}, .used = 0 };
+	vm->arrays = NULL;
+	vm->acount = 0;
+	vm->acap = 0;
+	e_arena_init(&vm->arena);
+	vm->cfcnt = 0;
+	vm->status = E_VM_STATUS_READY;
+	vm->executed = 0;
+	vm->unchecked = 0;
+	vm->pending = (e_pending_call) { 0 };
+	vm->profile = NULL;
+	vm->jit = NULL;
+	vm->prog = NULL;
+	vm->program = (e_program) { 0 };
+	e_str_heap_init(&vm->strings);
+	vm->registry = &e_default_registry;
+}
+
+void
+e_vm_destroy(e_vm* vm) {
+	if(vm == NULL) return;
+
+	e_vm_reset(vm);
+	e_arena_free(&vm->arena);
+	e_program_free(&vm->program);
+	e_str_heap_clear(&vm->strings);
+	E_FREE(vm->stack.entries);
+	E_FREE(vm->frame_slots);
+	e_vm_config config = vm->config;
+	e_vm_init_config(vm, &config);
+}
+
+uint8_t
+e_vm_alloc(e_vm* vm) {
+	/* The stack, globals, locals and call frames in one zeroed block, done by the first load or run */
+	if(vm->stack.entries != NULL) return 1;
+
+	const e_vm_config* c = &vm->config;
+	size_t values = (size_t)c->stack_size + c->globals + c->locals;
+	size_t size = sizeof(e_value) * values + sizeof(e_callframe) * c->callframes;
+	uint8_t* p = E_MALLOC(size);
+	if(p == NULL) {
+		e_fail("Cannot allocate the vm");
+		return 0;
+	}
+	memset(p, 0, size);
+
+	vm->stack = (e_stack) { .entries = (e_value*)p, .size = c->stack_size, .top = 0 };
+	vm->globals = vm->stack.entries + c->stack_size;
+	vm->locals = vm->globals + c->globals;
+	vm->callframes = (e_callframe*)(vm->locals + c->locals);
+	return 1;
+}
+
+uint32_t
+e_config_limit(uint32_t value, uint32_t max) {
+	return value == 0 || value > max ? max : value;
+}
+
+void
+e_vm_reset(e_vm* vm) {
+	if(vm == NULL) return;
+
+	/* Release all values still referenced by the vm */
+	for(uint32_t i = 0; i < vm->stack.top; i++) {
+		e_value_release(vm->stack.entries[i]);
+	}
+	for(uint32_t i = 0; vm->globals != NULL && i < vm->config.globals; i++) {
+		e_value_release(vm->globals[i]);
+	}
+	for(uint32_t i = 0; vm->locals != NULL && i < vm->config.locals; i++) {
+		e_value_release(vm->locals[i]);
+	}
+	for(uint32_t c = 0; c < vm->cfcnt; c++) {
+		for(uint32_t i = 0; i < vm->callframes[c].size; i++) {
+			e_value_release(vm->frame_slots[vm->callframes[c].base + i]);
 		}
 	}
-	for(uint32_t i = 0; i < E_MAX_GLOBALS; i++) {
-		for(uint32_t e = 0; e < E_MAX_ARRAYSIZE; e++) {
-			vm->arrays_global[i][e] = (e_array_entry) { .v = {{ 0 }}, .used = 0 };
+	for(uint32_t a = 0; a < vm->acount; a++) {
+		if(vm->arrays[a].items == NULL) continue;
+		for(uint32_t i = 0; i < vm->arrays[a].len; i++) {
+			e_value_release(vm->arrays[a].items[i]);
 		}
 	}
+	if(vm->status == E_VM_STATUS_WAITING) {
+		e_value_release(vm->pending.name);
+	}
+	vm->pending = (e_pending_call) { 0 };
+
+	/* All arrays are released at once, the program and cached memory are kept */
+	e_arena_reset(&vm->arena);
+	vm->arrays = NULL;
+	vm->acount = 0;
+	vm->acap = 0;
+
+	e_stack_init(&vm->stack, vm->stack.size);
+	e_varstack_init(vm->globals, vm->config.globals);
+	e_varstack_init(vm->locals, vm->config.locals);
+	e_varstack_init(vm->frame_slots, vm->config.frame_slots);
 	vm->cfcnt = 0;
+	vm->pupo_is_data = 0;
+	vm->pupo_arr_index = -1;
+	vm->ip = 0;
+	vm->executed = 0;
+	vm->unchecked = 0;
 	vm->status = E_VM_STATUS_READY;
 }
 
 e_vm_status
 e_vm_parse_bytes(e_vm* vm, uint32_t script_offset, uint32_t blen) {
 	if(blen == 0) return E_VM_STATUS_EOF;
+	if(!e_vm_alloc(vm)) return E_VM_STATUS_ERROR;
 
 	vm->ds_offset = script_offset;
 
-	do {
-#if E_DEBUG
-		snprintf(dbg_s, E_MAX_STRLEN, "** IP: %d ** ", vm->ip);
-		e_print(dbg_s);
-#endif
+	e_program_free(&vm->program);
+	if(vm->jit != NULL) vm->jit->prog = NULL;
+	if(e_program_load(&vm->program, script_offset, blen) != E_VM_STATUS_OK || e_vm_start_program(vm) != E_VM_STATUS_OK) {
+		return E_VM_STATUS_ERROR;
+	}
 
+	return e_vm_run(vm, &vm->program);
+}
 
-#if E_USE_LOCK
-		if (!e_check_locked()) {
-#endif
-			e_instr cur_instr;
-			uint32_t ip_begin = vm->ip;
-			uint8_t next_bytes[E_INSTR_BYTES - 1] = { 0 };
-
-			cur_instr.OP = e_read_byte(vm->ds_offset + vm->ip);
-			if (!sb_ops[cur_instr.OP]) {
-				next_bytes[0] = e_read_byte(vm->ds_offset + vm->ip + 1);
-				next_bytes[1] = e_read_byte(vm->ds_offset + vm->ip + 2);
-				next_bytes[2] = e_read_byte(vm->ds_offset + vm->ip + 3);
-				next_bytes[3] = e_read_byte(vm->ds_offset + vm->ip + 4);
-				next_bytes[4] = e_read_byte(vm->ds_offset + vm->ip + 5);
-				next_bytes[5] = e_read_byte(vm->ds_offset + vm->ip + 6);
-				next_bytes[6] = e_read_byte(vm->ds_offset + vm->ip + 7);
-				next_bytes[7] = e_read_byte(vm->ds_offset + vm->ip + 8);
-
-				cur_instr.op1 = (uint32_t) ((next_bytes[0] << 24u) | (next_bytes[1] << 16u) |
-											(next_bytes[2] << 8u) | next_bytes[3]);
-				cur_instr.op2 = (uint32_t) ((next_bytes[4] << 24u) | (next_bytes[5] << 16u) |
-											(next_bytes[6] << 8u) | next_bytes[7]);
-				vm->ip += 9;
-
-				uint32_t ip_end = vm->ip;
-				if (ip_end - ip_begin != E_INSTR_BYTES) {
-					e_fail("Instruction size / offset error");
-					return E_VM_STATUS_ERROR;
-				}
-			} else {
-				vm->ip++;
+e_vm_status
+e_vm_parse_buffer(e_vm* vm, const uint8_t* bytes, uint32_t blen) {
+	e_vm_status s = e_vm_load_buffer(vm, bytes, blen);
+	if(s != E_VM_STATUS_OK) return s;
 
-				uint32_t ip_end = vm->ip;
-				if (ip_end - ip_begin != E_INSTR_SINGLE_BYTES) {
-					e_fail("Instruction size / offset error");
-					return E_VM_STATUS_ERROR;
-				}
-			}
+	return e_vm_run(vm, &vm->program);
+}
 
-#if E_DEBUG
-			snprintf(dbg_s, E_MAX_STRLEN, "Fetched instruction -> [0x%02X] (0x%02X, 0x%02X)\n", cur_instr.OP, cur_instr.op1, cur_instr.op2);
-			e_print(dbg_s);
+e_vm_status
+e_vm_load_buffer(e_vm* vm, const uint8_t* bytes, uint32_t blen) {
+	/* Loads into vm->program without running it, see e_vm_run_steps */
+	if(blen == 0) return E_VM_STATUS_EOF;
+	if(!e_vm_alloc(vm)) return E_VM_STATUS_ERROR;
+
+	e_program_free(&vm->program);
+	if(vm->jit != NULL) vm->jit->prog = NULL;
+	if(e_program_load_buffer(&vm->program, bytes, blen) != E_VM_STATUS_OK) {
+		return E_VM_STATUS_ERROR;
+	}
+	return e_vm_start_program(vm);
+}
+
+e_vm_status
+e_vm_start_program(e_vm* vm) {
+	/* Prepares the program just loaded into vm->program and starts the vm at its first instruction,
+	   whatever state the previous run left it in (i.e. waiting for a call) */
+#if E_USE_SUPERINSTRUCTIONS
+	e_program_fuse(&vm->program);
 #endif
+	if(e_program_link(&vm->program, vm->registry) != E_VM_STATUS_OK) {
+		return E_VM_STATUS_ERROR;
+	}
+	vm->ip = 0;
+	vm->unchecked = 0;
+	vm->status = E_VM_STATUS_READY;
+	return E_VM_STATUS_OK;
+}
 
-			e_vm_status es = e_vm_evaluate_instr(vm, cur_instr);
-			if (es != E_VM_STATUS_OK) {
-				e_fail("Invalid instruction or malformed arguments - STOPPED EXECUTION");
-				return E_VM_STATUS_ERROR;
-			}
+e_vm_status
+e_vm_run(e_vm* vm, const e_program* prog) {
+	return e_vm_run_steps(vm, prog, E_VM_STEPS_UNLIMITED);
+}
 
-		}
+e_vm_status
+e_vm_run_until(e_vm* vm, const e_program* prog, uint64_t deadline_ns) {
+	/* Run slices of steps, so the clock is only read every E_VM_SLICE_STEPS instructions */
+	e_vm_status s;
+	do {
+		s = e_vm_run_steps(vm, prog, E_VM_SLICE_STEPS);
+	} while(s == E_VM_STATUS_SUSPENDED && e_vm_clock_ns() < deadline_ns);
+	return s;
+}
 
-#if E_USE_LOCK
+#if E_PROFILE
+void
+e_profile_sample(e_profile* prof, uint8_t op) {
+	/* Starts measuring op, or ends the measurement at the fetch after it */
+	uint64_t t = E_PROFILE_CYCLES();
+	if(prof->sample_op == E_PROFILE_NO_SAMPLE) {
+		prof->sample_op = op;
+		prof->sample_start = t;
+		prof->countdown = 1;
+		return;
 	}
+
+	uint64_t estimate = (t - prof->sample_start) * prof->period;
+	prof->ops[prof->sample_op].cycles += estimate;
+	prof->cycles += estimate;
+	prof->sample_op = E_PROFILE_NO_SAMPLE;
+	prof->countdown = prof->period - 1;
+}
 #endif
-	while (vm->ip < blen);
 
-	return E_VM_STATUS_OK;
+uint64_t
+e_vm_clock_ns(void) {
+#if E_USE_CLOCK_GETTIME
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+	return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
 }
 
 e_vm_status
-e_vm_evaluate_instr(e_vm* vm, e_instr instr) {
-	/* */
-	e_stack_status_ret s1;
-	e_stack_status_ret s2;
-
-	union {
-		uint32_t u[2];
-		uint64_t l;
-		double d;
-	} conv = {
-		.u[0] = instr.op2,
-		.u[1] = instr.op1
-	};
-	double d_op = conv.d;
-
-	switch(instr.OP) {
-		case E_OP_NOP:
-			break;
-		case E_OP_PUSHG:
-			// Add value of pop([s-1]) to global symbol stack at index u32(op1)
-			if(vm->pupo_is_data) {
-				e_value tmp_arr[E_MAX_ARRAYSIZE];
-				uint32_t arr_len = vm->pupo_is_data;
-				uint32_t e = arr_len - 1;
-				do {
-					s1 = e_stack_pop(&vm->stack);
-					if(s1.status == E_STATUS_OK) {
-						tmp_arr[e] = s1.val;
-					} else goto error;
-					e--;
-				} while((vm->pupo_is_data--) - 1);
-
-				e_value arr = e_create_array(vm, tmp_arr, arr_len, d_op, E_ARRAY_GLOBAL);
-				if(arr.aval.alen == arr_len) {
-					e_stack_status_ret s = e_varstack_insert_global_at_index(vm->globals, arr, d_op);
-					vm->pupo_is_data = 0;
-
-					if (s.status != E_STATUS_OK) goto error;
-				} else goto error;
-			} else {
-					e_stack_status_ret s_peek = e_varstack_peek_index(vm->globals, d_op);
-					if(s_peek.val.argtype == E_ARRAY) {
-						/* Array access based on index */
-						if(vm->pupo_arr_index >= 0) {
-							e_stack_status_ret s_value = e_stack_pop(&vm->stack);
-							if(s_value.status == E_STATUS_OK) {
-								e_change_value_in_arr(vm, s_peek.val.aval.aptr, vm->pupo_arr_index, s_value.val, E_ARRAY_GLOBAL);
-							} else {
-								e_fail("Array out of bounds");
-								goto error;
-							}
-							vm->pupo_arr_index = -1;
-						}
-					} else {
-						s1 = e_stack_pop(&vm->stack);
-						if(s1.status == E_STATUS_OK) {
-#if E_DEBUG
-						snprintf(dbg_s, E_MAX_STRLEN, "Storing value %f to global stack [%d] (type: %d)\n", s1.val.val, instr.op1, instr.op2);
-						e_print(dbg_s);
-#endif
-						if (instr.op2 == E_ARGT_STRING) {
-							s1.val.argtype = E_STRING;
-						}
-						e_stack_status_ret s = e_varstack_insert_global_at_index(vm->globals, s1.val, d_op);
-						if (s.status != E_STATUS_OK) goto error;
-					} else goto error;
-				}
-			}
-			break;
-		case E_OP_POPG:
-			// Find value [index] in global stack
-			{
-				e_stack_status_ret s = e_varstack_peek_index(vm->globals, d_op);
-				if(s.status == E_STATUS_OK) {
-#if E_DEBUG
-					snprintf(dbg_s, E_MAX_STRLEN, "Loading global from index %d -> %f\n", instr.op1, s.val.val);
-					e_print(dbg_s);
-#endif
-					if(s.val.argtype == E_ARRAY) {
-						/* Array access based on index */
-						if(vm->pupo_arr_index >= 0) {
-							e_value v;
-							if(e_find_value_in_arr(vm, s.val, vm->pupo_arr_index, &v)) {
-								e_stack_status_ret s_push = e_stack_push(&vm->stack, v);
-								if(s_push.status == E_STATUS_NESIZE) {
-									e_fail("Stack overflow");
-									goto error;
-								}
-							} else {
-								/* Out of bounds */
-								e_fail("Array out of bounds");
-								goto error;
-							}
-							vm->pupo_arr_index = -1;
-						} else {
-							/* Array pass-by-value? */
-							e_stack_status_ret s_push = e_stack_push(&vm->stack, s.val);
-							if(s_push.status == E_STATUS_NESIZE) {
-								e_fail("Stack overflow");
-								goto error;
-							}
-						}
-					} else {
-						// Push this value onto the vm->stack
-						e_stack_status_ret s_push = e_stack_push(&vm->stack, s.val);
-						if(s_push.status == E_STATUS_NESIZE) {
-							e_fail("Stack overflow");
-							goto error;
-						}
-					}
-				} else goto error;
-			}
-			break;
-		case E_OP_PUSHL:
-			// Add value of pop([s-1]) to locals symbol stack at index u32(op1)
-			if(vm->pupo_is_data) {
-				e_value tmp_arr[E_MAX_ARRAYSIZE];
-				uint32_t arr_len = vm->pupo_is_data;
-				uint32_t e = arr_len - 1;
-				do {
-					s1 = e_stack_pop(&vm->stack);
-					if(s1.status == E_STATUS_OK) {
-						tmp_arr[e] = s1.val;
-					} else goto error;
-					e--;
-				} while((vm->pupo_is_data--) - 1);
-
-				e_value arr = e_create_array(vm, tmp_arr, arr_len, d_op, E_ARRAY_LOCAL);
-				e_stack_status_ret s;
-
-				if(vm->cfcnt > 0) {
-					s = e_stack_insert_at_index(&vm->callframes[vm->cfcnt - 1].locals, arr, d_op);
-				} else {
-					s = e_varstack_insert_local_at_index(vm->locals, arr, d_op);
-				}
-				vm->pupo_is_data = 0;
+e_vm_run_steps(e_vm* vm, const e_program* prog, uint64_t steps) {
+	if(vm == NULL || prog == NULL || prog->code == NULL) return E_VM_STATUS_ERROR;
+	if(vm->status == E_VM_STATUS_WAITING) return E_VM_STATUS_WAITING;
+	if(!e_vm_alloc(vm)) return E_VM_STATUS_ERROR;
+	if(prog->nglobals > vm->config.globals) {
+		e_fail("The program uses more globals than the vm has");
+		return E_VM_STATUS_ERROR;
+	}
 
-				if (s.status != E_STATUS_OK) goto error;
-			} else {
-				e_stack_status_ret s_peek;
+	if(vm->prog != prog) vm->unchecked = 0;
+	vm->prog = prog;
 
-				if(vm->cfcnt > 0) {
-					s_peek = e_stack_peek_index(&vm->callframes[vm->cfcnt - 1].locals, d_op);
-				} else {
-					s_peek = e_varstack_peek_index(vm->locals, d_op);
-				}
-				if(s_peek.val.argtype == E_ARRAY) {
-					/* Array access based on index */
-					if(vm->pupo_arr_index >= 0) {
-						e_stack_status_ret s_value = e_stack_pop(&vm->stack);
-						if(s_value.status == E_STATUS_OK) {
-							e_change_value_in_arr(vm, s_peek.val.aval.aptr, vm->pupo_arr_index, s_value.val, E_ARRAY_LOCAL);
-						} else {
-							e_fail("Array out of bounds");
-							goto error;
-						}
-						vm->pupo_arr_index = -1;
-					}
-				} else {
-					s1 = e_stack_pop(&vm->stack);
-					if (s1.status == E_STATUS_OK) {
-#if E_DEBUG
-						if(instr.op2 == E_ARGT_STRING) {
-							snprintf(dbg_s, E_MAX_STRLEN, "Storing value %s to local stack [%d] (type: %d)\n", s1.val.sval.sval, instr.op1, instr.op2);
-							e_print(dbg_s);
-						} else if(instr.op2 == E_ARGT_NUMBER) {
-							snprintf(dbg_s, E_MAX_STRLEN, "Storing value %f to local stack [%d] (type: %d)\n", s1.val.val, instr.op1, instr.op2);
-							e_print(dbg_s);
-						}
-#endif
-						e_stack_status_ret s;
-						if(vm->cfcnt > 0) {
-							s = e_stack_insert_at_index(&vm->callframes[vm->cfcnt - 1].locals, s1.val, d_op);
-						} else {
-							s = e_varstack_insert_local_at_index(vm->locals, s1.val, d_op);
-						}
-						if (s.status != E_STATUS_OK) goto error;
-					} else goto error;
-				}
+	/* Verified programs run unchecked from their start, as their stack depths are verified from an empty stack,
+	   if the vm's limits hold what the verifier derived */
+	if(prog->verified && !vm->unchecked) {
+		vm->unchecked = vm->ip == 0 && vm->cfcnt == 0 && vm->stack.top == 0 && vm->pupo_is_data == 0
+						&& prog->depth < vm->stack.size && prog->nlocals <= vm->config.locals;
+	}
+	if(vm->unchecked) {
+		uint64_t executed = vm->executed;
+		e_vm_status s = e_vm_exec_unchecked(vm, prog, steps);
+		if(s == E_VM_STATUS_ERROR) vm->unchecked = 0;
+		if(s != E_VM_STATUS_READY) return s;
+
+		/* Deoptimized, the rest of the run is checked */
+		vm->unchecked = 0;
+		steps -= vm->executed - executed;
+	}
+	return e_vm_exec_checked(vm, prog, steps);
+}
+
+// Interpreter (see vm_interp.h)
+#define E_INTERP_CHECKED 1
+#define E_INTERP_NAME e_vm_exec_checked
+#include "vm_interp.h"
+
+#define E_INTERP_CHECKED 0
+#define E_INTERP_NAME e_vm_exec_unchecked
+#include "vm_interp.h"
+
+// Calls
+uint8_t
+e_vm_call_return(e_vm* vm, const char* name, int32_t tmp_stat, uint32_t argsbefore, uint32_t arglen) {
+	if(tmp_stat == 0) {
+		char tmp[E_MAX_STRLEN + 30];
+		snprintf(tmp, E_MAX_STRLEN + 30, "Error in external function %s", name);
+		e_fail(tmp);
+		return 0;
+	}
+
+	uint32_t ret_values = (uint32_t)tmp_stat;
+	// Discard all remaining stack values that are unwanted after the function call
+	uint32_t A = argsbefore - arglen;	// allowed remaining
+	uint32_t argsafter = vm->stack.top;
+	uint32_t I = argsafter - (ret_values - 1);
+
+	if(A != I) {
+		for (uint32_t i = 0; i < (I - A); i++) {
+			if (vm->stack.top > 1) {
+				e_stack_swap_last(&vm->stack);
 			}
-			break;
-		case E_OP_POPL:
-			// Find value [index] in local stack
-			{
-				e_stack_status_ret s;
+			e_value_release(e_stack_pop(&vm->stack).val);
+		}
+	}
 
-				if(vm->cfcnt > 0) {
-					s = e_stack_peek_index(&vm->callframes[vm->cfcnt - 1].locals, d_op);
-				} else {
-					s = e_varstack_peek_index(vm->locals, d_op);
-				}
+	// Return array?
+	uint32_t arr_len = ret_values - 1;
+	if(arr_len > 1) {
+		vm->pupo_is_data = arr_len;
+	}
+	return 1;
+}
 
-				//e_stack_status_ret s = e_stack_peek_index(&vm->locals, d_op);
-				if(s.status == E_STATUS_OK) {
-#if E_DEBUG
-					snprintf(dbg_s, E_MAX_STRLEN, "Loading local from index %d -> %f\n", instr.op1, s.val.val);
-					e_print(dbg_s);
-#endif
-					if(s.val.argtype == E_ARRAY) {
-						/* Array access based on index */
-						if(vm->pupo_arr_index >= 0) {
-							e_value v;
-							if(e_find_value_in_arr(vm, s.val, vm->pupo_arr_index, &v)) {
-								e_stack_status_ret s_push = e_stack_push(&vm->stack, v);
-								if(s_push.status == E_STATUS_NESIZE) {
-									e_fail("Stack overflow");
-									goto error;
-								}
-							} else {
-								/* Out of bounds */
-								e_fail("Array out of bounds");
-							}
-							vm->pupo_arr_index = -1;
-						} else {
-							/* Array pass-by-value? */
-							e_stack_status_ret s_push = e_stack_push(&vm->stack, s.val);
-							if(s_push.status == E_STATUS_NESIZE) {
-								e_fail("Stack overflow");
-								goto error;
-							}
-						}
-					} else {
-						// Push this value onto the vm->stack
-						e_stack_status_ret s_push = e_stack_push(&vm->stack, s.val);
-						if(s_push.status == E_STATUS_NESIZE) {
-							e_fail("Stack overflow");
-							goto error;
-						}
-					}
-				} else goto error;
+e_vm_status
+e_vm_complete(e_vm* vm, uint32_t ret) {
+	/* Finishes the pending call like a synchronous return, the results have to be pushed before */
+	if(vm == NULL || vm->status != E_VM_STATUS_WAITING) return E_VM_STATUS_ERROR;
+
+	e_pending_call p = vm->pending;
+	vm->pending = (e_pending_call) { 0 };
+	uint8_t ok = e_vm_call_return(vm, (const char*)p.name.sval->sval, (int32_t)ret, p.argsbefore, p.arglen);
+	e_value_release(p.name);
+
+	/* Like the guard of a synchronous call, a verified program only continues unchecked with one result */
+	if(!ok || vm->stack.top != p.argsbefore - p.arglen + 1 || vm->pupo_is_data != 0) vm->unchecked = 0;
+
+	vm->status = ok ? E_VM_STATUS_SUSPENDED : E_VM_STATUS_ERROR;
+	return vm->status;
+}
+
+// Program
+e_vm_status
+e_program_load(e_program* prog, uint32_t script_offset, uint32_t blen) {
+	return e_program_decode(prog, NULL, script_offset, blen);
+}
+
+e_vm_status
+e_program_load_buffer(e_program* prog, const uint8_t* bytes, uint32_t blen) {
+	if(bytes == NULL) return E_VM_STATUS_ERROR;
+	return e_program_decode(prog, bytes, 0, blen);
+}
+
+uint8_t
+e_fetch_byte(const uint8_t* bytes, uint32_t offset) {
+	/* Fall back to the user callback if no buffer is given (i.e. flash-backed targets) */
+	return bytes != NULL ? bytes[offset] : e_read_byte(offset);
+}
+
+e_vm_status
+e_program_decode(e_program* prog, const uint8_t* bytes, uint32_t script_offset, uint32_t blen) {
+	if(prog == NULL) return E_VM_STATUS_ERROR;
+	*prog = (e_program) { 0 };
+	prog->blen = blen;
+
+	uint32_t cap = 0;
+	uint32_t lcap = 0;
+	uint32_t ip = 0;
+	uint32_t* itab = NULL;	/* Literal intern table, literal index + 1 */
+	uint32_t icap = 0;
+
+	/* Fetch and decode every instruction once */
+	while(ip < blen) {
+		e_instr cur_instr = { 0 };
+		uint32_t ip_begin = ip;
+
+		cur_instr.OP = e_fetch_byte(bytes, script_offset + ip);
+		if(cur_instr.OP >= sizeof(sb_ops)) {
+			e_fail("Invalid instruction");
+			goto error;
+		}
+
+		if(!sb_ops[cur_instr.OP]) {
+			if(ip + E_INSTR_BYTES > blen) {
+				e_fail("Instruction size / offset error");
+				goto error;
 			}
-			break;
-		case E_OP_PUSHA:
-			vm->pupo_arr_index = d_op;
-			break;
-		case E_OP_PUSHAS:
-			{
-				s1 = e_stack_pop(&vm->stack);
-				if(s1.status == E_STATUS_OK) {
-					vm->pupo_arr_index = s1.val.val;
-				} else goto error;
+
+			uint8_t next_bytes[E_INSTR_BYTES - 1];
+			for(uint32_t i = 0; i < E_INSTR_BYTES - 1; i++) {
+				next_bytes[i] = e_fetch_byte(bytes, script_offset + ip + 1 + i);
 			}
-			break;
-		case E_OP_PUSH:
-			// Push (u32(operand 1 | operand 2)) onto stack
-			{
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(d_op));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
+			cur_instr.op1 = (uint32_t) ((next_bytes[0] << 24u) | (next_bytes[1] << 16u) |
+										(next_bytes[2] << 8u) | next_bytes[3]);
+			cur_instr.op2 = (uint32_t) ((next_bytes[4] << 24u) | (next_bytes[5] << 16u) |
+										(next_bytes[6] << 8u) | next_bytes[7]);
+			ip += E_INSTR_BYTES;
+		} else {
+			ip += E_INSTR_SINGLE_BYTES;
+		}
+
+		if(prog->count == cap) {
+			cap = cap ? cap * 2 : 64;
+			e_dinstr* code = E_REALLOC(prog->code, sizeof(e_dinstr) * cap);
+			if(code == NULL) goto error;
+			prog->code = code;
+		}
+
+		e_dinstr* d = &prog->code[prog->count++];
+		union {
+			uint32_t u[2];
+			uint64_t l;
+			double d;
+		} conv = {
+			.u[0] = cur_instr.op2,
+			.u[1] = cur_instr.op1
+		};
+		*d = (e_dinstr) {
+			.OP = cur_instr.OP,
+			.op1 = cur_instr.op1,
+			.op2 = cur_instr.op2,
+			.addr = ip_begin,
+			.target = E_TARGET_INVALID,
+			.d_op = conv.d
+		};
+
+		if(d->OP == E_OP_PUSHS) {
+			/* String literal follows the instruction */
+			if(!(d->d_op >= 0 && d->d_op <= blen - ip) || d->d_op != (uint32_t)d->d_op) {
+				e_fail("Invalid string literal");
+				goto error;
 			}
-			break;
-		case E_OP_PUSHS:
-			// Push string onto stack
-			{
-				char tmp_str[E_MAX_STRLEN];
-				if(d_op < E_MAX_STRLEN - 1) {
-					for(uint32_t i = 0; i < d_op && i < E_MAX_STRLEN; i++) {
-						tmp_str[i] = e_read_byte(vm->ds_offset + vm->ip + i);
-					}
-					tmp_str[(uint32_t)d_op] = 0;
-					e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_string(tmp_str));
-					if(s_push.status == E_STATUS_NESIZE) {
-						e_fail("Stack overflow");
-						goto error;
-					}
-					vm->ip = vm->ip + d_op;
-				} else goto error;
+			uint32_t slen = d->d_op;
+			e_str_type* str = e_str_alloc(NULL, slen);
+			if(str == NULL) goto error;
+			for(uint32_t i = 0; i < slen; i++) {
+				str->sval[i] = e_fetch_byte(bytes, script_offset + ip + i);
 			}
-			break;
-		case E_OP_DATA:
-			vm->pupo_is_data = d_op;
-			break;
-		case E_OP_EQ:
-			// PUSH (s[-1] == s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val == s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_NOTEQ:
-			// PUSH (s[-1] != s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val != s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_LT:
-			// PUSH (s[-1] < s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val < s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_GT:
-			// PUSH (s[-1] > s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val > s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_LTEQ:
-			// PUSH (s[-1] <= s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val <= s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_GTEQ:
-			// PUSH (s[-1] >= s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val >= s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_ADD:
-			// PUSH (s[-1] + s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val + s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_NEG:
-			s1 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(-s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_SUB:
-			// PUSH (s[-1] - s[-2])
-			// PUSH (s[-1] + s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val - s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
+			ip += slen;
+
+			if(prog->lcount == lcap) {
+				lcap = lcap ? lcap * 2 : 16;
+				e_value* literals = E_REALLOC(prog->literals, sizeof(e_value) * lcap);
+				if(literals == NULL) {
+					E_FREE(str);
 					goto error;
 				}
-			} else goto error;
-			break;
-		case E_OP_MUL:
-			// PUSH (s[-1] * s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val * s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
+				prog->literals = literals;
+			}
+			if(prog->lcount * 2 >= icap) {
+				/* Grow and rebuild the intern table */
+				uint32_t ncap = icap ? icap * 2 : 32;
+				uint32_t* ntab = E_MALLOC(sizeof(uint32_t) * ncap);
+				if(ntab == NULL) {
+					E_FREE(str);
 					goto error;
 				}
-			} else goto error;
-			break;
-		case E_OP_DIV:
-			// PUSH (s[-1] / s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(s2.val.val / s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
+				memset(ntab, 0, sizeof(uint32_t) * ncap);
+				for(uint32_t l = 0; l < prog->lcount; l++) {
+					const e_str_type* ls = prog->literals[l].sval;
+					uint32_t h = e_str_hash(ls->sval, ls->slen) & (ncap - 1);
+					while(ntab[h] != 0) h = (h + 1) & (ncap - 1);
+					ntab[h] = l + 1;
 				}
+				E_FREE(itab);
+				itab = ntab;
+				icap = ncap;
 			}
-			break;
-		case E_OP_MOD:
-			// PUSH (s[-1] % s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number((uint8_t)((uint32_t)s2.val.val % (uint32_t)s1.val.val)));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
+
+			/* Intern, equal literals share one string */
+			uint32_t h = e_str_hash(str->sval, slen) & (icap - 1);
+			while(itab[h] != 0) {
+				const e_str_type* ls = prog->literals[itab[h] - 1].sval;
+				if(ls->slen == slen && memcmp(ls->sval, str->sval, slen) == 0) break;
+				h = (h + 1) & (icap - 1);
 			}
-			break;
-		case E_OP_AND:
-			// PUSH (s[-1] && s[-2])
-			// PUSH (s[-1] + s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number((uint8_t)s2.val.val && s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_OR:
-			// PUSH (s[-1] || s[-2])
-			// PUSH (s[-1] + s[-2])
-			s1 = e_stack_pop(&vm->stack);
-			s2 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number((uint8_t)s2.val.val || s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_NOT:
-			// PUSH !s[-1]
-			s1 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK) {
-				e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_number(!s1.val.val));
-				if(s_push.status == E_STATUS_NESIZE) {
-					e_fail("Stack overflow");
-					goto error;
-				}
-			} else goto error;
-			break;
-		case E_OP_CONCAT:
-			// Concatenate two strings (cast if number type) s[-1] and s[-2]
-			s2 = e_stack_pop(&vm->stack);
-			s1 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
-
-				if((s1.val.argtype == E_STRING || s2.val.argtype == E_STRING)
-					&& (s1.val.argtype != s2.val.argtype)) {
-					// s1 or s2 contains string and
-					// s1 or s2 contains number
-					char buf[E_MAX_STRLEN];
-					char num_buf[E_MAX_STRLEN];
-					memset(buf, 0, E_MAX_STRLEN);
-					memset(num_buf, 0, E_MAX_STRLEN);
-
-					if(s1.val.argtype == E_NUMBER) {
-						uint32_t l1 = snprintf(num_buf, E_MAX_STRLEN, "%f", s1.val.val);
-						uint32_t len = s2.val.sval.slen + l1;
-						if(len > E_MAX_STRLEN) goto error;
-						strcat(buf, num_buf);
-						strcat(buf, (char*)s2.val.sval.sval);
-						buf[len] = 0;
-					} else if(s2.val.argtype == E_NUMBER) {
-						uint32_t l1 = snprintf(num_buf, E_MAX_STRLEN, "%f", s2.val.val);
-						uint32_t len = s1.val.sval.slen + l1;
-						if(len > E_MAX_STRLEN) goto error;
-						memcpy(buf, (char*)s1.val.sval.sval, s1.val.sval.slen);
-						buf[s1.val.sval.slen] = 0;
-						strcat(buf, num_buf);
-					} else {
-						// Array?
-						if(s1.val.argtype == E_ARRAY) {
-							uint32_t l1 = snprintf(num_buf, E_MAX_STRLEN, "Array<%d> with length %d", s1.val.aval.aptr, s1.val.aval.alen);
-							uint32_t len = s2.val.sval.slen + l1;
-							if(len + strlen(num_buf) > E_MAX_STRLEN) goto error;
-							strcat(buf, num_buf);
-							strcat(buf, (char*)s2.val.sval.sval);
-							buf[len] = 0;
-						} else if(s2.val.argtype == E_ARRAY) {
-							uint32_t l1 = snprintf(num_buf, E_MAX_STRLEN, "Array<%d> with length %d", s2.val.aval.aptr, s2.val.aval.alen);
-							uint32_t len = s1.val.sval.slen + l1;
-							if(len + strlen(num_buf) > E_MAX_STRLEN) goto error;
-							memcpy(buf, (char*)s1.val.sval.sval, s1.val.sval.slen);
-							buf[s1.val.sval.slen] = 0;
-							strcat(buf, num_buf);
-						} else {
-							e_fail("Unsupported argtype");
-							goto error;
-						}
-					}
+			if(itab[h] != 0) {
+				E_FREE(str);
+				d->target = itab[h] - 1;
+			} else {
+				/* Literals are owned by the program, never by the values referencing them */
+				str->refs = E_STR_STATIC;
+				itab[h] = prog->lcount + 1;
+				d->target = prog->lcount;
+				prog->literals[prog->lcount++] = (e_value) { .sval = str, .argtype = E_STRING };
+			}
+		}
+	}
+	E_FREE(itab);
+	itab = NULL;
+
+	/* Terminate the program with a sentinel, so the interpreter needs no bounds check */
+	if(prog->count == cap) {
+		e_dinstr* code = E_REALLOC(prog->code, sizeof(e_dinstr) * (cap + 1));
+		if(code == NULL) goto error;
+		prog->code = code;
+	}
+	prog->code[prog->count] = (e_dinstr) { .OP = E_OP_HALT, .addr = blen, .target = E_TARGET_INVALID };
 
-					e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_string(buf));
-					if(s_push.status == E_STATUS_NESIZE) {
-						e_fail("Stack overflow");
-						goto error;
-					}
-				} else {
-					// s1 contains string
-					// s2 contains string
-					char buf1[E_MAX_STRLEN];
-					char buf2[E_MAX_STRLEN];
+	/* Resolve jump targets to instruction indexes */
+	for(uint32_t i = 0; i < prog->count; i++) {
+		e_dinstr* d = &prog->code[i];
+		if(d->OP == E_OP_JZ || d->OP == E_OP_JMP || d->OP == E_OP_JMPFUN) {
+			d->target = e_program_index_of(prog, d->d_op);
+		}
+	}
 
-					if(s1.val.sval.slen + s2.val.sval.slen > E_MAX_STRLEN) {
-						goto error;
-					}
-					memcpy(buf1, s1.val.sval.sval, s1.val.sval.slen);
-					memcpy(buf2, s2.val.sval.sval, s2.val.sval.slen);
-					buf1[s1.val.sval.slen] = 0;
-					buf2[s2.val.sval.slen] = 0;
-
-					// Concatenate strings
-					strcat(buf1, buf2);
-					e_stack_status_ret s_push = e_stack_push(&vm->stack, e_create_string(buf1));
-					if(s_push.status == E_STATUS_NESIZE) {
-						e_fail("Stack overflow");
-						goto error;
-					}
-				}
-			} else goto error;
-			break;
-		case E_OP_JZ:
-			// POP s[-1]
-			// if(s[-1] == 0) then perform_jump()
-			s1 = e_stack_pop(&vm->stack);
-			if(s1.status == E_STATUS_OK) {
-				if(s1.val.val == 0) {
-#if E_DEBUG
-					snprintf(dbg_s, E_MAX_STRLEN, "is zero, perform jump to address [%f]\n", d_op);
-					e_print(dbg_s);
-#endif
-					// Perform jump
-					vm->ip = d_op;
-				}
-			} else goto error;
-			break;
-		case E_OP_JMP:
-			// perform_jump()
-#if E_DEBUG
-			snprintf(dbg_s, E_MAX_STRLEN, "perform jump to address [%f]\n", d_op);
-			e_print(dbg_s);
-#endif
-			vm->ip = d_op;
-			break;
-		case E_OP_JFS:
-			{
-				// Get callframe
-				if(vm->cfcnt == 0) goto error;
-				e_callframe callframe = vm->callframes[vm->cfcnt - 1];
+	if(e_program_frame_sizes(prog) != E_VM_STATUS_OK) goto error;
+	if(e_program_verify(prog) != E_VM_STATUS_OK) goto error;
 
-				// Close callframe
-				if(vm->cfcnt - 1 >= 0) {
-					vm->cfcnt -= 1;
-				} else goto error;
+	return E_VM_STATUS_OK;
+	error:
+		E_FREE(itab);
+		e_program_free(prog);
+		return E_VM_STATUS_ERROR;
+}
 
-				// Return addr
-				vm->ip = callframe.retAddr;
-			}
-			break;
-		case E_OP_JMPFUN:
-			// Create CallFrame
-			{
-				e_callframe callframe = { 0 };
-				s1 = e_stack_pop(&vm->stack);
-				if(s1.status == E_STATUS_OK) {
-					callframe.retAddr = s1.val.val;
+e_vm_status
+e_program_frame_sizes(e_program* prog) {
+	/* Every JMPFUN records how many local slots the called function uses: the highest
+	   PUSHL / POPL index reachable from its entry without returning (JFS) */
+	uint32_t* seen = E_MALLOC(sizeof(uint32_t) * (prog->count + 1));
+	uint32_t* work = E_MALLOC(sizeof(uint32_t) * 2 * (prog->count + 1));
+	uint16_t* sizes = E_MALLOC(sizeof(uint16_t) * (prog->count + 1));
+	if(seen == NULL || work == NULL || sizes == NULL) {
+		E_FREE(seen);
+		E_FREE(work);
+		E_FREE(sizes);
+		return E_VM_STATUS_ERROR;
+	}
+	memset(seen, 0, sizeof(uint32_t) * (prog->count + 1));
+	memset(sizes, 0xFF, sizeof(uint16_t) * (prog->count + 1));
+
+	uint32_t stamp = 0;
+	for(uint32_t i = 0; i < prog->count; i++) {
+		e_dinstr* call = &prog->code[i];
+		if(call->OP != E_OP_JMPFUN || call->target >= prog->count) continue;
+		if(sizes[call->target] != 0xFFFF) {
+			call->nlocals = sizes[call->target];
+			continue;
+		}
 
-					if(vm->cfcnt == 0) {
-						memcpy(callframe.locals.entries, vm->locals, E_MAX_LOCALS);
-					} else {
-						callframe.locals = vm->callframes[vm->cfcnt - 1].locals;
+		uint32_t nlocals = 0;
+		uint32_t wcnt = 0;
+		stamp++;
+		work[wcnt++] = call->target;
+		while(wcnt > 0) {
+			uint32_t k = work[--wcnt];
+			if(k >= prog->count || seen[k] == stamp) continue;
+			seen[k] = stamp;
+
+			const e_dinstr* d = &prog->code[k];
+			switch(d->OP) {
+				case E_OP_PUSHL:
+				case E_OP_POPL:
+					if(d->d_op >= 0) {
+						uint32_t n = d->d_op < E_STACK_SIZE ? (uint32_t)d->d_op + 1 : E_STACK_SIZE;
+						if(n > nlocals) nlocals = n;
 					}
-					vm->callframes[vm->cfcnt] = callframe;
+					work[wcnt++] = k + 1;
+					break;
+				case E_OP_JFS:
+					break;
+				case E_OP_JMP:
+					work[wcnt++] = d->target;
+					break;
+				case E_OP_JZ:
+					work[wcnt++] = d->target;
+					work[wcnt++] = k + 1;
+					break;
+				default:
+					work[wcnt++] = k + 1;
+					break;
+			}
+		}
+		sizes[call->target] = nlocals;
+		call->nlocals = nlocals;
+	}
 
-					if(vm->cfcnt + 1 < E_MAX_CALLFRAMES) {
-						vm->cfcnt++;
-					} else {
-						e_fail("Cannot create another call frame");
-						goto error;
-					}
-				} else goto error;
+	E_FREE(seen);
+	E_FREE(work);
+	E_FREE(sizes);
+	return E_VM_STATUS_OK;
+}
 
-				vm->ip = d_op;
-			}
-			break;
-		case E_OP_CALL:
-			// External function / subroutine call
-			s1 = e_stack_pop(&vm->stack);
-
-			if(s1.status == E_STATUS_OK && s1.val.argtype == E_STRING) {
-				uint32_t argsbefore = vm->stack.top;
-				int32_t tmp_stat = e_api_call_sub(vm, (const char*)s1.val.sval.sval, d_op);
-				if(tmp_stat == -1) {
-					char tmp[E_MAX_STRLEN + 30];
-					snprintf(tmp, E_MAX_STRLEN + 30, "Unknown function / subroutine %s", s1.val.sval.sval);
-					e_fail(tmp);
-					goto error;
-				} else if(tmp_stat == 0) {
-					char tmp[E_MAX_STRLEN + 30];
-					snprintf(tmp, E_MAX_STRLEN + 30, "Error in external function %s", s1.val.sval.sval);
-					e_fail(tmp);
-					goto error;
-				} else {
-					uint32_t ret_values = (uint32_t)tmp_stat;
-					// Discard all remaining stack values that are unwanted after the function call
-					uint32_t A = argsbefore - d_op;	// allowed remaining
-					uint32_t argsafter = vm->stack.top;
-					uint32_t I = argsafter - (ret_values - 1);
-
-					if(A != I) {
-						for (uint32_t i = 0; i < (I - A); i++) {
-							if (vm->stack.top > 1) {
-								e_stack_swap_last(&vm->stack);
-							}
-							e_stack_pop(&vm->stack);
+e_vm_status
+e_program_verify(e_program* prog) {
+	/* Malformed instructions fail the load. Then the stack depth of every reachable instruction is
+	   derived per function (relative to the function's base), the program is only marked verified
+	   if the depths never over- or underflow, so it can run unchecked (see e_vm_run_steps) */
+	const uint32_t n = prog->count;
+	prog->verified = 0;
+	prog->nglobals = 0;
+	prog->nlocals = 0;
+	prog->depth = 0;
+
+	for(uint32_t k = 0; k < n; k++) {
+		const e_dinstr* d = &prog->code[k];
+		const char* err = NULL;
+		switch(d->OP) {
+			case E_OP_PUSHG:
+			case E_OP_POPG:
+				if(!e_operand_index(d->d_op, E_MAX_GLOBALS)) err = "Invalid global index";
+				else if(d->d_op >= prog->nglobals) prog->nglobals = (uint32_t)d->d_op + 1;
+				break;
+			case E_OP_PUSHL:
+			case E_OP_POPL:
+				if(!e_operand_index(d->d_op, E_STACK_SIZE)) err = "Invalid local index";
+				break;
+			case E_OP_DATA:
+				if(!e_operand_index(d->d_op, E_STACK_SIZE)) err = "Invalid data segment size";
+				break;
+			case E_OP_PUSHA:
+				if(!e_operand_index(d->d_op, (uint32_t)INT32_MAX + 1)) err = "Invalid array index";
+				break;
+			case E_OP_CALL:
+				if(!e_operand_index(d->d_op, E_STACK_SIZE)) err = "Invalid argument count";
+				break;
+			case E_OP_JZ:
+			case E_OP_JMP:
+			case E_OP_JMPFUN:
+				if(d->target == E_TARGET_INVALID) err = "Invalid jump target";
+				break;
+			case E_OP_NOP: case E_OP_PUSH: case E_OP_PUSHS: case E_OP_PUSHAS:
+			case E_OP_EQ: case E_OP_LT: case E_OP_GT: case E_OP_LTEQ: case E_OP_GTEQ: case E_OP_NOTEQ:
+			case E_OP_ADD: case E_OP_NEG: case E_OP_SUB: case E_OP_MUL: case E_OP_DIV:
+			case E_OP_AND: case E_OP_OR: case E_OP_NOT: case E_OP_CONCAT: case E_OP_MOD:
+			case E_OP_JFS: case E_OP_PRINT: case E_OP_ARGTYPE: case E_OP_LEN: case E_OP_ARRAY:
+				break;
+			default:
+				err = "Invalid instruction";
+				break;
+		}
+		if(err != NULL) {
+			e_fail(err);
+			return E_VM_STATUS_ERROR;
+		}
+	}
+	if(n == 0) return E_VM_STATUS_OK;
+
+	/* Every instruction is queued once, and JMPFUN once more when its function's delta gets known */
+	e_verify_instr* v = E_MALLOC(sizeof(e_verify_instr) * (n + 1));
+	uint32_t* work = E_MALLOC(sizeof(uint32_t) * 2 * (n + 1));
+	if(v == NULL || work == NULL) {
+		E_FREE(v);
+		E_FREE(work);
+		return E_VM_STATUS_ERROR;
+	}
+	memset(v, 0, sizeof(e_verify_instr) * (n + 1));
+	for(uint32_t k = 0; k < n; k++) {
+		const e_dinstr* d = &prog->code[k];
+		if((d->OP == E_OP_JZ || d->OP == E_OP_JMP || d->OP == E_OP_JMPFUN) && d->target < n) {
+			v[d->target].target = 1;
+		}
+	}
+
+	/* The top level code is the function at instruction 0 */
+	uint32_t wcnt = 0;
+	uint8_t ok = e_verify_flow(v, work, &wcnt, n, 0, 1, 0, 0);
+	while(ok && wcnt > 0) {
+		uint32_t k = work[--wcnt];
+		const e_dinstr* d = &prog->code[k];
+		const uint32_t owner = v[k].owner;
+		e_verify_instr* f = &v[owner - 1];
+		uint32_t data = v[k].data;
+		uint32_t pops = 0;
+		uint32_t pushes = 0;
+
+		switch(d->OP) {
+			case E_OP_POPG:
+			case E_OP_POPL:
+			case E_OP_PUSH:
+			case E_OP_PUSHS:
+				pushes = 1;
+				break;
+			case E_OP_PUSHG:
+			case E_OP_PUSHL:
+				pops = data ? data : 1;
+				data = 0;
+				break;
+			case E_OP_DATA:
+				data = d->d_op;
+				break;
+			case E_OP_PUSHAS:
+			case E_OP_PRINT:
+			case E_OP_JZ:
+			case E_OP_JMPFUN:
+				pops = 1;
+				break;
+			case E_OP_NEG:
+			case E_OP_NOT:
+			case E_OP_ARGTYPE:
+			case E_OP_LEN:
+			case E_OP_ARRAY:
+				pops = 1;
+				pushes = 1;
+				break;
+			case E_OP_CALL:
+				/* Name and arguments, an external function is assumed to return one value (guarded at run time) */
+				pops = 1 + (uint32_t)d->d_op;
+				pushes = 1;
+				break;
+			case E_OP_EQ: case E_OP_LT: case E_OP_GT: case E_OP_LTEQ: case E_OP_GTEQ: case E_OP_NOTEQ:
+			case E_OP_ADD: case E_OP_SUB: case E_OP_MUL: case E_OP_DIV:
+			case E_OP_AND: case E_OP_OR: case E_OP_CONCAT: case E_OP_MOD:
+				pops = 2;
+				pushes = 1;
+				break;
+			default:
+				break;
+		}
+
+		int32_t depth = v[k].depth - (int32_t)pops;
+		if(depth < f->min) f->min = depth;
+		depth += pushes;
+		if(depth > f->max) f->max = depth;
+
+		/* Top level locals are limited to E_MAX_LOCALS, a function's locals are reserved by JMPFUN */
+		if((d->OP == E_OP_PUSHL || d->OP == E_OP_POPL) && owner == 1) {
+			if(d->d_op >= E_MAX_LOCALS) ok = 0;
+			else if(d->d_op >= prog->nlocals) prog->nlocals = (uint32_t)d->d_op + 1;
+		}
+
+		switch(d->OP) {
+			case E_OP_JMP:
+				ok = ok && e_verify_flow(v, work, &wcnt, n, d->target, owner, depth, data);
+				break;
+			case E_OP_JZ:
+				ok = ok && e_verify_flow(v, work, &wcnt, n, d->target, owner, depth, data)
+					 && e_verify_flow(v, work, &wcnt, n, k + 1, owner, depth, data);
+				break;
+			case E_OP_JFS:
+				if(owner == 1 || data != 0) {
+					ok = 0;
+				} else if(!f->returns) {
+					/* Continue after the calls of the function */
+					f->returns = 1;
+					f->delta = depth;
+					for(uint32_t c = 0; c < n; c++) {
+						if(prog->code[c].OP == E_OP_JMPFUN && prog->code[c].target == owner - 1 && v[c].owner != 0) {
+							work[wcnt++] = c;
 						}
 					}
-
-					// Return array?
-					uint32_t arr_len = ret_values - 1;
-					if(arr_len > 1) {
-						vm->pupo_is_data = arr_len;
+				} else if(f->delta != depth) {
+					ok = 0;
+				}
+				break;
+			case E_OP_JMPFUN:
+				/* The return address has to be pushed right before, so the function returns to the next instruction */
+				if(k == 0 || prog->code[k - 1].OP != E_OP_PUSH || e_program_index_of(prog, prog->code[k - 1].d_op) != k + 1
+				   || v[k].target || data != 0 || d->target == 0) {
+					ok = 0;
+				} else if(d->target < n) {
+					ok = e_verify_flow(v, work, &wcnt, n, d->target, d->target + 1, 0, 0);
+					if(ok && v[d->target].returns) {
+						ok = e_verify_flow(v, work, &wcnt, n, k + 1, owner, depth + v[d->target].delta, 0);
 					}
 				}
-			}
-			break;
-		case E_OP_PRINT:
-			e_builtin_print(vm, 1);
-			break;
-		case E_OP_ARGTYPE:
-			{
-				uint32_t r = e_builtin_argtype(vm, 1);
-				if(r == 0) {
-					e_fail("Builtin function ARGTYPE failed");
-					goto error;
+				break;
+			case E_OP_CALL:
+				/* Only calls of a literal name, a name that is not a string would not pop the arguments */
+				if(k == 0 || prog->code[k - 1].OP != E_OP_PUSHS || v[k].target || data != 0) {
+					ok = 0;
+				} else {
+					ok = e_verify_flow(v, work, &wcnt, n, k + 1, owner, depth, data);
 				}
+				break;
+			default:
+				ok = ok && e_verify_flow(v, work, &wcnt, n, k + 1, owner, depth, data);
+				break;
+		}
+	}
+
+	/* A function also pops what the functions it calls pop below their base */
+	for(uint8_t changed = 1; ok && changed; ) {
+		changed = 0;
+		for(uint32_t k = 0; k < n && ok; k++) {
+			const e_dinstr* d = &prog->code[k];
+			if(d->OP != E_OP_JMPFUN || v[k].owner == 0 || d->target >= n) continue;
+
+			e_verify_instr* caller = &v[v[k].owner - 1];
+			int32_t min = v[k].depth - 1 + v[d->target].min;
+			if(min < caller->min) {
+				caller->min = min;
+				changed = 1;
+				if(min < -(int32_t)E_STACK_SIZE) ok = 0;
 			}
-			break;
-		case E_OP_LEN:
-			{
-				uint32_t r = e_builtin_len(vm, 1);
-				if(r == 0) {
-					e_fail("Builtin function LEN failed");
-					goto error;
-				}
+		}
+	}
+
+	/* The top level starts with an empty stack, JMPFUN checks a function's maximum at run time */
+	if(ok && v[0].min >= 0 && v[0].max < (int32_t)E_STACK_SIZE) {
+		for(uint32_t k = 0; k < n && ok; k++) {
+			e_dinstr* d = &prog->code[k];
+			if(d->OP != E_OP_JMPFUN || v[k].owner == 0 || d->target >= n) continue;
+			if(v[d->target].max >= (int32_t)E_STACK_SIZE || v[d->target].max > UINT8_MAX) {
+				ok = 0;
+			} else {
+				d->depth = v[d->target].max;
 			}
-			break;
-		case E_OP_ARRAY:
-			{
-				uint32_t r = e_builtin_array(vm, 1);
-				if(r == 0) {
-					e_fail("Builtin function ARRAY failed");
-					goto error;
-				}
+		}
+		prog->verified = ok;
+		prog->depth = (uint32_t)v[0].max;
+	}
+
+	e_vm_status s = E_VM_STATUS_OK;
+#if E_USE_REGISTERS
+	if(prog->verified) s = e_program_translate(prog, v);
+#endif
+	E_FREE(v);
+	E_FREE(work);
+	return s;
+}
+
+uint8_t
+e_verify_flow(e_verify_instr* v, uint32_t* work, uint32_t* wcnt, uint32_t count,
+			  uint32_t k, uint32_t owner, int32_t depth, uint32_t data) {
+	/* Control reaches k, paths joining at an instruction have to agree on its function and depth */
+	if(k >= count) return 1;
+	if(depth > (int32_t)E_STACK_SIZE || depth < -(int32_t)E_STACK_SIZE) return 0;
+
+	e_verify_instr* i = &v[k];
+	if(i->owner == 0) {
+		i->owner = owner;
+		i->depth = depth;
+		i->data = data;
+		work[(*wcnt)++] = k;
+		return 1;
+	}
+	return i->owner == owner && i->depth == depth && i->data == data;
+}
+
+uint8_t
+e_operand_index(double d, uint32_t limit) {
+	return d >= 0 && d < limit && d == (uint32_t)d;
+}
+
+e_vm_status
+e_program_translate(e_program* prog, const e_verify_instr* v) {
+	/* Straight line code is translated into register groups: operations read their operands from variables,
+	   constants or stack slots, and write their result to the variable it is stored to instead of the stack.
+	   Only what is left on the stack at the end of a group is written to its slots. Like superinstructions,
+	   only the first instruction of a group is rewritten (E_OP_REG), so a jump into a group, or a group
+	   that cannot run as a whole, simply runs the stack code */
+	const uint32_t n = prog->count;
+	uint32_t rcap = 0;
+	uint32_t gcap = 0;
+	uint32_t kcap = 16;
+	e_reg slots[2 * E_STACK_SIZE];
+	e_reg* slot = slots + E_STACK_SIZE;	/* Operand of each stack slot, relative to the top at the start of the group */
+
+	prog->rconsts = E_MALLOC(sizeof(e_value) * kcap);
+	if(prog->rconsts == NULL) return E_VM_STATUS_ERROR;
+
+	for(uint32_t s = 0; s < n; ) {
+		const uint32_t first = prog->rcount;
+		const uint32_t kfirst = prog->rkcount;
+		int32_t depth = 0;
+		uint8_t ok = 1;
+		uint8_t branch = 0;
+		for(int32_t p = -(int32_t)E_STACK_SIZE; p < (int32_t)E_STACK_SIZE; p++) {
+			slot[p] = (e_reg) { .kind = E_REG_TEMP, .index = p };
+		}
+
+		/* A group ends before a jump target, a pending DATA store and anything that is not translated */
+		uint32_t k = s;
+		while(ok && !branch && k < n && v[k].owner != 0 && v[k].data == 0 && (k == s || !v[k].target)) {
+			const e_dinstr* d = &prog->code[k];
+			const e_dinstr* next = &prog->code[k + 1];	/* at most the E_OP_HALT sentinel */
+			const uint8_t next_in_group = k + 1 < n && !v[k + 1].target && v[k + 1].data == 0;
+			e_rinstr r = { .op = d->OP, .target = E_TARGET_INVALID };
+			uint32_t used = 1;
+
+			switch(d->OP) {
+				case E_OP_NOP:
+					break;
+				case E_OP_PUSH:
+					ok = e_translate_const(prog, &kcap, d->d_op, &slot[depth++]);
+					break;
+				case E_OP_POPG:
+					slot[depth++] = (e_reg) { .kind = E_REG_GLOBAL, .index = d->d_op };
+					break;
+				case E_OP_POPL:
+					slot[depth++] = (e_reg) { .kind = E_REG_LOCAL, .index = d->d_op };
+					break;
+				case E_OP_PUSHG:
+				case E_OP_PUSHL:
+					r.op = E_OP_MOV;
+					r.a = slot[--depth];
+					r.dst = (e_reg) { .kind = d->OP == E_OP_PUSHG ? E_REG_GLOBAL : E_REG_LOCAL, .index = d->d_op };
+					ok = e_translate_spill(prog, &rcap, slot, depth, &r.dst) && e_translate_emit(prog, &rcap, r);
+					break;
+				case E_OP_EQ: case E_OP_LT: case E_OP_GT: case E_OP_LTEQ: case E_OP_GTEQ: case E_OP_NOTEQ:
+				case E_OP_ADD: case E_OP_SUB: case E_OP_MUL: case E_OP_DIV:
+				case E_OP_NEG: case E_OP_NOT:
+					if(d->OP != E_OP_NEG && d->OP != E_OP_NOT) r.b = slot[--depth];
+					r.a = slot[--depth];
+					if(next_in_group && (next->OP == E_OP_PUSHG || next->OP == E_OP_PUSHL)) {
+						/* Result stored to a variable */
+						r.dst = (e_reg) { .kind = next->OP == E_OP_PUSHG ? E_REG_GLOBAL : E_REG_LOCAL, .index = next->d_op };
+						ok = e_translate_spill(prog, &rcap, slot, depth, &r.dst) && e_translate_emit(prog, &rcap, r);
+						used = 2;
+					} else if(next_in_group && next->OP == E_OP_JZ && d->OP >= E_OP_EQ && d->OP <= E_OP_NOTEQ) {
+						/* Compare and branch, same opcodes as the superinstructions */
+						static const uint8_t branch_ops[] = { E_OP_EQ_JZ, E_OP_LT_JZ, E_OP_GT_JZ, E_OP_LTEQ_JZ, E_OP_GTEQ_JZ, E_OP_NOTEQ_JZ };
+						r.op = branch_ops[d->OP - E_OP_EQ];
+						r.target = next->target;
+						ok = e_translate_spill(prog, &rcap, slot, depth, NULL) && e_translate_emit(prog, &rcap, r);
+						used = 2;
+						branch = 1;
+					} else {
+						r.dst = (e_reg) { .kind = E_REG_TEMP, .index = depth };
+						ok = e_translate_emit(prog, &rcap, r);
+						slot[depth++] = r.dst;
+					}
+					break;
+				case E_OP_JZ:
+					r.a = slot[--depth];
+					/* fall through */
+				case E_OP_JMP:
+					r.target = d->target;
+					ok = e_translate_spill(prog, &rcap, slot, depth, NULL) && e_translate_emit(prog, &rcap, r);
+					branch = 1;
+					break;
+				default:
+					used = 0;
+					break;
 			}
-			break;
-		default:
+			if(used == 0) break;
+			k += used;
+		}
+		if(ok && !branch) ok = e_translate_spill(prog, &rcap, slot, depth, NULL);
+		if(!ok) return E_VM_STATUS_ERROR;
+
+		/* Single instructions run just as fast on the stack */
+		if(k - s < 2) {
+			prog->rcount = first;
+			prog->rkcount = kfirst;
+			s++;
+			continue;
+		}
+
+		if(prog->rgcount == gcap) {
+			gcap = gcap ? gcap * 2 : 16;
+			e_rgroup* groups = E_REALLOC(prog->rgroups, sizeof(e_rgroup) * gcap);
+			if(groups == NULL) return E_VM_STATUS_ERROR;
+			prog->rgroups = groups;
+		}
+		prog->rgroups[prog->rgcount] = (e_rgroup) {
+			.first = first,
+			.count = prog->rcount - first,
+			.end = k,
+			.steps = k - s,
+			.delta = depth,
+			.op = prog->code[s].OP
+		};
+		prog->code[s].OP = E_OP_REG;
+		prog->code[s].target = prog->rgcount++;
+		s = k;
+	}
+	return E_VM_STATUS_OK;
+}
+
+uint8_t
+e_translate_emit(e_program* prog, uint32_t* cap, e_rinstr r) {
+	if(prog->rcount == *cap) {
+		uint32_t ncap = *cap ? *cap * 2 : 64;
+		e_rinstr* code = E_REALLOC(prog->rcode, sizeof(e_rinstr) * ncap);
+		if(code == NULL) return 0;
+		prog->rcode = code;
+		*cap = ncap;
+	}
+	prog->rcode[prog->rcount++] = r;
+	return 1;
+}
+
+uint8_t
+e_translate_spill(e_program* prog, uint32_t* cap, e_reg* slot, int32_t depth, const e_reg* var) {
+	/* Writes the operands below depth to their stack slots, or only those reading var before it is stored */
+	for(int32_t p = -(int32_t)E_STACK_SIZE; p < depth; p++) {
+		e_reg o = slot[p];
+		if(o.kind == E_REG_TEMP || (var != NULL && (o.kind != var->kind || o.index != var->index))) continue;
+
+		slot[p] = (e_reg) { .kind = E_REG_TEMP, .index = p };
+		if(!e_translate_emit(prog, cap, (e_rinstr) { .op = E_OP_MOV, .dst = slot[p], .a = o, .target = E_TARGET_INVALID })) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+uint8_t
+e_translate_const(e_program* prog, uint32_t* cap, double d, e_reg* reg) {
+	if(prog->rkcount == *cap) {
+		uint32_t ncap = *cap * 2;
+		e_value* consts = E_REALLOC(prog->rconsts, sizeof(e_value) * ncap);
+		if(consts == NULL) return 0;
+		prog->rconsts = consts;
+		*cap = ncap;
+	}
+	prog->rconsts[prog->rkcount] = e_create_number(d);
+	*reg = (e_reg) { .kind = E_REG_CONST, .index = prog->rkcount++ };
+	return 1;
+}
+
+uint32_t
+e_str_hash(const uint8_t* s, uint32_t len) {
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for(uint32_t i = 0; i < len; i++) {
+		h = (h ^ s[i]) * 16777619u;
+	}
+	return h;
+}
+
+void
+e_program_fuse(e_program* prog) {
+	if(prog == NULL || prog->code == NULL) return;
+
+	/* Only the head of a sequence is rewritten, the remaining instructions are kept
+	   as they are, so jumps into the middle of a sequence still run the unfused code.
+	   Instructions after the head of a register group are not fused: a group that does not run as a whole
+	   runs its stack code one step per instruction, the steps it takes when it does (see E_OP_REG) */
+	uint32_t g = 0;
+	for(uint32_t i = 0; i + 1 < prog->count; i++) {
+		while(g < prog->rgcount && prog->rgroups[g].end <= i) g++;
+		if(g < prog->rgcount && i > prog->rgroups[g].end - prog->rgroups[g].steps) continue;
+
+		e_dinstr* d = &prog->code[i];
+		const e_dinstr* n1 = &prog->code[i + 1];
+		const e_dinstr* n2 = &prog->code[i + 2];	/* at most the E_OP_HALT sentinel */
+
+		switch(d->OP) {
+			case E_OP_POPG:
+				if(n1->OP == E_OP_PUSH && n2->OP == E_OP_ADD) d->OP = E_OP_POPG_ADDK;
+				else if(n1->OP == E_OP_PUSH && n2->OP == E_OP_SUB) d->OP = E_OP_POPG_SUBK;
+				break;
+			case E_OP_POPL:
+				if(n1->OP == E_OP_PUSH && n2->OP == E_OP_ADD) d->OP = E_OP_POPL_ADDK;
+				else if(n1->OP == E_OP_PUSH && n2->OP == E_OP_SUB) d->OP = E_OP_POPL_SUBK;
+				break;
+			case E_OP_EQ:
+				if(n1->OP == E_OP_JZ) d->OP = E_OP_EQ_JZ;
+				break;
+			case E_OP_NOTEQ:
+				if(n1->OP == E_OP_JZ) d->OP = E_OP_NOTEQ_JZ;
+				break;
+			case E_OP_LT:
+				if(n1->OP == E_OP_JZ) d->OP = E_OP_LT_JZ;
+				break;
+			case E_OP_GT:
+				if(n1->OP == E_OP_JZ) d->OP = E_OP_GT_JZ;
+				break;
+			case E_OP_LTEQ:
+				if(n1->OP == E_OP_JZ) d->OP = E_OP_LTEQ_JZ;
+				break;
+			case E_OP_GTEQ:
+				if(n1->OP == E_OP_JZ) d->OP = E_OP_GTEQ_JZ;
+				break;
+			case E_OP_PUSHA:
+				if(n1->OP == E_OP_POPG) d->OP = E_OP_PUSHA_POPG;
+				else if(n1->OP == E_OP_POPL) d->OP = E_OP_PUSHA_POPL;
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+e_vm_status
+e_program_link(e_program* prog, const e_registry* reg) {
+	if(prog == NULL || prog->code == NULL) return E_VM_STATUS_ERROR;
+
+	/* Calls of a literal name (PUSHS [name], CALL [arglen]) are resolved to the function's index
+	   in the registry, like superinstructions only the head is rewritten, the CALL keeps its place */
+	for(uint32_t i = 0; i + 1 < prog->count; i++) {
+		e_dinstr* d = &prog->code[i];
+		e_dinstr* call = &prog->code[i + 1];
+		if((d->OP != E_OP_PUSHS && d->OP != E_OP_CALLI) || call->OP != E_OP_CALL) continue;
+
+		const char* name = (const char*)prog->literals[d->target].sval->sval;
+		const e_external_mapping* m = e_registry_find(reg, name);
+		if(m == NULL) {
+			char tmp[E_MAX_STRLEN + 30];
+			snprintf(tmp, E_MAX_STRLEN + 30, "Unknown function / subroutine %s", name);
+			e_fail(tmp);
 			return E_VM_STATUS_ERROR;
+		}
+		d->OP = E_OP_CALLI;
+		call->target = m - reg->entries;
 	}
+	prog->registry = reg;
 
 	return E_VM_STATUS_OK;
-	error:
-		return E_VM_STATUS_ERROR;
 }
 
+void
+e_program_free(e_program* prog) {
+	if(prog == NULL) return;
+	for(uint32_t i = 0; i < prog->lcount; i++) {
+		E_FREE(prog->literals[i].sval);
+	}
+	E_FREE(prog->code);
+	E_FREE(prog->literals);
+	E_FREE(prog->rgroups);
+	E_FREE(prog->rcode);
+	E_FREE(prog->rconsts);
+	*prog = (e_program) { 0 };
+}
+
+uint32_t
+e_program_index_of(const e_program* prog, double addr) {
+	/* Addresses at or beyond the end of the script terminate the program */
+	if(!(addr >= 0)) return E_TARGET_INVALID;
+	if(addr >= prog->blen) return prog->count;
+
+	uint32_t a = addr;
+	if(a != addr) return E_TARGET_INVALID;
+
+	uint32_t lo = 0;
+	uint32_t hi = prog->count;
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if(prog->code[mid].addr < a) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if(lo < prog->count && prog->code[lo].addr == a) {
+		return lo;
+	}
+	return E_TARGET_INVALID;
+}
 
 // Stack
 void
@@ -819,7 +1378,7 @@ e_stack_init(e_stack* stack, uint32_t size) {
 	if(stack == NULL) {
 		return;
 	}
-	memset(stack->entries, 0, (sizeof(e_value) * size));
+	if(stack->entries != NULL) memset(stack->entries, 0, (sizeof(e_value) * size));
 	stack->size = size;
 	stack->top = 0;
 }
@@ -860,16 +1419,6 @@ e_stack_peek_index(const e_stack* stack, uint32_t index) {
 	return (e_stack_status_ret) { .status = E_STATUS_OK, .val = stack->entries[index] };
 }
 
-e_stack_status_ret
-e_stack_insert_at_index(e_stack* stack, e_value v, uint32_t index) {
-	if(stack == NULL) {
-		return (e_stack_status_ret) { .status = E_STATUS_NOINIT };
-	}
-
-	stack->entries[index] = v;
-	return (e_stack_status_ret) { .status = E_STATUS_OK };
-}
-
 e_stack_status_ret
 e_stack_swap_last(e_stack* stack) {
 	if(stack == NULL) {
@@ -922,22 +1471,58 @@ e_varstack_insert_global_at_index(e_value* varstack, e_value v, uint32_t index)
 		return (e_stack_status_ret) { .status = E_STATUS_NESIZE };
 	}
 
+	e_value_release(varstack[index]);
 	varstack[index] = v;
 	return (e_stack_status_ret) { .status = E_STATUS_OK };
 }
 
-e_stack_status_ret
-e_varstack_insert_local_at_index(e_value* varstack, e_value v, uint32_t index) {
-	if(varstack == NULL) {
-		return (e_stack_status_ret) { .status = E_STATUS_NOINIT };
+// Call frames
+e_value*
+e_frame_local(e_vm* vm, uint32_t index) {
+	if(vm->cfcnt == 0) {
+		return index < vm->config.locals ? &vm->locals[index] : NULL;
 	}
 
-	if(index >= E_MAX_LOCALS) {
-		return (e_stack_status_ret) { .status = E_STATUS_NESIZE };
+	/* Slots the load time analysis did not see are reserved on first use,
+	   this is always possible as the current frame is the top of the frame stack */
+	e_callframe* f = &vm->callframes[vm->cfcnt - 1];
+	if(index >= f->size && !e_frame_reserve(vm, vm->cfcnt - 1, index + 1)) {
+		return NULL;
 	}
+	return &vm->frame_slots[f->base + index];
+}
 
-	varstack[index] = v;
-	return (e_stack_status_ret) { .status = E_STATUS_OK };
+uint8_t
+e_frame_reserve(e_vm* vm, uint32_t frame, uint32_t size) {
+	e_callframe* f = &vm->callframes[frame];
+	if(size > E_STACK_SIZE || f->base + size > vm->config.frame_slots) {
+		return 0;
+	}
+	if(vm->frame_slots == NULL) {
+		/* Allocated by the first function call */
+		vm->frame_slots = E_MALLOC(sizeof(e_value) * vm->config.frame_slots);
+		if(vm->frame_slots == NULL) return 0;
+		memset(vm->frame_slots, 0, sizeof(e_value) * vm->config.frame_slots);
+	}
+
+	for(uint32_t i = f->size; i < size; i++) {
+		e_value v = e_frame_inherited(vm, frame, i);
+		e_value_retain(v);
+		vm->frame_slots[f->base + i] = v;
+	}
+	if(size > f->size) f->size = size;
+	return 1;
+}
+
+e_value
+e_frame_inherited(const e_vm* vm, uint32_t frame, uint32_t index) {
+	/* A call frame starts with a copy of the caller's locals, a slot the caller
+	   never reserved holds the value of the caller's caller and so on */
+	while(frame-- > 0) {
+		const e_callframe* c = &vm->callframes[frame];
+		if(index < c->size) return vm->frame_slots[c->base + index];
+	}
+	return index < vm->config.locals ? vm->locals[index] : (e_value) { .val = 0 };
 }
 
 e_value
@@ -945,87 +1530,313 @@ e_create_number(double n) {
 	return (e_value){ .val = n, .argtype = E_NUMBER };
 }
 
-e_value
-e_create_string(const char* str) {
-	e_str_type new_str;
+void
+e_value_retain(e_value v) {
+	if(v.argtype == E_STRING && v.sval->refs != E_STR_STATIC) {
+		v.sval->refs++;
+	}
+}
+
+void
+e_value_release(e_value v) {
+	if(v.argtype == E_STRING && v.sval->refs != E_STR_STATIC) {
+		if(--v.sval->refs == 0) {
+			e_str_free(v.sval);
+		}
+	}
+}
+
+uint8_t
+e_value_equals(e_value a, e_value b) {
+	/* Values of different types are never equal */
+	if(a.argtype != b.argtype) return 0;
+	switch(a.argtype) {
+		case E_STRING:
+			return a.sval == b.sval
+				   || (a.sval->slen == b.sval->slen && memcmp(a.sval->sval, b.sval->sval, a.sval->slen) == 0);
+		case E_ARRAY:
+			return a.aval.aptr == b.aval.aptr;
+		default:
+			return a.val == b.val;
+	}
+}
+
+double
+e_value_number(e_value v) {
+	/* Strings convert by their content ("1.5"), anything that is no number is NaN */
+	if(v.argtype == E_NUMBER) return v.val;
+	if(v.argtype != E_STRING || v.sval->slen == 0) return NAN;
+
+	const char* s = (const char*)v.sval->sval;
+	char* end;
+	double d = strtod(s, &end);
+	if(end == s) return NAN;
+	while(*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r') end++;
+	return end == s + v.sval->slen ? d : NAN;
+}
+
+double
+e_value_arith(uint8_t op, e_value a, e_value b) {
+	/* ADD, SUB, MUL, DIV, NEG (b is ignored) */
+	double x = a.argtype == E_NUMBER ? a.val : e_value_number(a);
+	double y = op == E_OP_NEG ? 0 : (b.argtype == E_NUMBER ? b.val : e_value_number(b));
+	switch(op) {
+		case E_OP_ADD: return x + y;
+		case E_OP_SUB: return x - y;
+		case E_OP_MUL: return x * y;
+		case E_OP_DIV: return x / y;
+		case E_OP_NEG: return -x;
+		default: return NAN;
+	}
+}
+
+uint8_t
+e_value_compare(uint8_t op, e_value a, e_value b) {
+	/* EQ / NOTEQ compare types and values, the orderings compare two strings lexicographically and anything else as numbers */
+	if(op == E_OP_EQ) return e_value_equals(a, b);
+	if(op == E_OP_NOTEQ) return !e_value_equals(a, b);
+
+	int c;
+	if(a.argtype == E_STRING && b.argtype == E_STRING) {
+		uint32_t n = a.sval->slen < b.sval->slen ? a.sval->slen : b.sval->slen;
+		c = memcmp(a.sval->sval, b.sval->sval, n);
+		if(c == 0) c = a.sval->slen < b.sval->slen ? -1 : a.sval->slen > b.sval->slen;
+	} else {
+		double x = e_value_number(a);
+		double y = e_value_number(b);
+		if(x != x || y != y) return 0;
+		c = x < y ? -1 : x > y;
+	}
+	switch(op) {
+		case E_OP_LT: return c < 0;
+		case E_OP_GT: return c > 0;
+		case E_OP_LTEQ: return c <= 0;
+		case E_OP_GTEQ: return c >= 0;
+		default: return 0;
+	}
+}
 
-	uint32_t slen = strlen(str);
-	memcpy(new_str.sval, str, slen);
-	new_str.sval[slen] = 0;
-	if(strlen((const char*)new_str.sval) != slen) {
+uint32_t
+e_value_str_size(e_value v) {
+	/* Upper bound of the length of the string form, UINT32_MAX if there is none */
+	switch(v.argtype) {
+		case E_STRING: return v.sval->slen;
+		case E_NUMBER: return E_NUMBER_STRLEN;
+		case E_ARRAY: return E_ARRSTR_SIZE;
+		default: return UINT32_MAX;
+	}
+}
+
+uint32_t
+e_value_str_write(const e_vm* vm, e_value v, uint8_t* dst) {
+	/* Writes the string form to dst, which has room for e_value_str_size(v) bytes */
+	switch(v.argtype) {
+		case E_STRING:
+			memcpy(dst, v.sval->sval, v.sval->slen);
+			return v.sval->slen;
+		case E_NUMBER:
+			return e_format_number(v.val, (char*)dst);
+		case E_ARRAY:
+			{
+				const e_array* a = e_array_get(vm, v);
+				int n = snprintf((char*)dst, E_ARRSTR_SIZE, "Array<%u> with length %u", v.aval.aptr, a != NULL ? a->len : 0);
+				if(n < 0) return 0;
+				return (uint32_t)n < E_ARRSTR_SIZE ? (uint32_t)n : E_ARRSTR_SIZE - 1;
+			}
+		default:
+			return 0;
+	}
+}
+
+e_value
+e_create_array(e_vm* vm, e_value* arr, uint32_t arrlen) {
+	/* Takes over the values, they are released if the array cannot be allocated */
+	e_array* a = e_array_new(vm);
+	if(a == NULL) {
+		for(uint32_t i = 0; i < arrlen; i++) e_value_release(arr[i]);
+		return (e_value) { 0 };
+	}
+	if(!e_array_assign(vm, a, arr, arrlen)) {
 		return (e_value) { 0 };
 	}
-	new_str.slen = slen;
 
-	return (e_value) { .sval = new_str, .argtype = E_STRING };
+	return (e_value) { .aval.aptr = vm->acount++, .argtype = E_ARRAY };
 }
 
 e_value
-e_create_array(e_vm* vm, e_value* arr, uint32_t arrlen, uint32_t index, uint32_t global_local) {
-	for(uint32_t i = 0; i < arrlen && i < E_MAX_ARRAYSIZE; i++) {
-		uint8_t s = e_array_append(vm, index, i, arr[i], global_local);
-		if(!s) {
-			return (e_value) { 0 };
-		}
+e_create_numbers(e_vm* vm, uint32_t len) {
+	/* An array of len zeros, allocated as a numeric column */
+	e_array* a = e_array_new(vm);
+	if(a == NULL || len > vm->config.array_len || !e_array_column(vm, a, len, 1)) {
+		return (e_value) { 0 };
 	}
+	memset(a->nums, 0, sizeof(double) * len);
+	a->len = len;
 
-	return (e_value) { .argtype = E_ARRAY, .aval.aptr = index, .aval.alen = arrlen, .aval.global_local = global_local };
+	return (e_value) { .aval.aptr = vm->acount++, .argtype = E_ARRAY };
+}
+
+e_array*
+e_array_new(e_vm* vm) {
+	/* The next free array (vm->acount), counted once its elements are allocated */
+	if(vm->acount >= vm->config.arrays) return NULL;
+	if(vm->acount == vm->acap) {
+		uint32_t ncap = vm->acap ? vm->acap * 2 : 16;
+		e_array* arrays = vm->acap <= UINT32_MAX / 2 ? e_arena_alloc(&vm->arena, sizeof(e_array) * (size_t)ncap) : NULL;
+		if(arrays == NULL) return NULL;
+		if(vm->acount > 0) memcpy(arrays, vm->arrays, sizeof(e_array) * vm->acount);
+		vm->arrays = arrays;
+		vm->acap = ncap;
+	}
+
+	e_array* a = &vm->arrays[vm->acount];
+	*a = (e_array) { 0 };
+	return a;
+}
+
+e_array*
+e_array_get(const e_vm* vm, e_value arr) {
+	if(arr.argtype != E_ARRAY || arr.aval.aptr >= vm->acount) return NULL;
+	return &vm->arrays[arr.aval.aptr];
 }
 
 uint8_t
-e_array_append(e_vm* vm, uint32_t aptr, uint32_t index, e_value v, uint32_t global_local) {
-	if(global_local == E_ARRAY_GLOBAL) {
-		if(aptr >= E_MAX_GLOBALS) return 0;
+e_array_column(e_vm* vm, e_array* a, uint32_t cap, uint8_t numeric) {
+	/* Moves the elements to a new numeric column or column of values with room for at least cap elements.
+	   It grows geometrically, so appending is amortized O(1), the old block stays in the arena */
+	uint32_t ncap = a->cap ? a->cap : 8;
+	while(ncap < cap) {
+		if(ncap > UINT32_MAX / 2) return 0;
+		ncap *= 2;
+	}
 
-		vm->arrays_global[aptr][index].v = v;
-		vm->arrays_global[aptr][index].used = 1;
-		return 1;
+	if(numeric) {
+		double* nums = e_arena_alloc(&vm->arena, sizeof(double) * (size_t)ncap);
+		if(nums == NULL) return 0;
+		if(a->items == NULL) {
+			if(a->len > 0) memcpy(nums, a->nums, sizeof(double) * a->len);
+		} else {
+			for(uint32_t i = 0; i < a->len; i++) nums[i] = a->items[i].val;
+		}
+		a->items = NULL;
+		a->nums = nums;
 	} else {
-		if(aptr >= E_MAX_LOCALS) return 0;
-
-		vm->arrays_local[aptr][index].v = v;
-		vm->arrays_local[aptr][index].used = 1;
-		return 1;
+		e_value* items = e_arena_alloc(&vm->arena, sizeof(e_value) * (size_t)ncap);
+		if(items == NULL) return 0;
+		if(a->items != NULL) {
+			if(a->len > 0) memcpy(items, a->items, sizeof(e_value) * a->len);
+		} else {
+			for(uint32_t i = 0; i < a->len; i++) items[i] = e_create_number(a->nums[i]);
+		}
+		a->items = items;
+		a->nums = NULL;
 	}
+	a->cap = ncap;
+	return 1;
 }
 
 uint8_t
-e_find_value_in_arr(const e_vm* vm, e_value arr, uint32_t index, e_value* vptr) {
-	if(arr.aval.global_local == E_ARRAY_GLOBAL) {
-		if(index >= E_MAX_ARRAYSIZE) return 0;
+e_array_reserve(e_vm* vm, e_array* a, uint32_t cap) {
+	/* Arrays restored from an image (cap 0) share its elements, they are copied here before the first change */
+	if(cap <= a->cap) return 1;
+	if(cap > vm->config.array_len) return 0;
+	return e_array_column(vm, a, cap, a->items == NULL);
+}
 
-		e_array_entry e = vm->arrays_global[arr.aval.aptr][index];
-		*vptr = e.v;
-		return e.used;
-	} else {
-		if(index >= E_MAX_ARRAYSIZE) return 0;
+uint8_t
+e_array_make_values(e_vm* vm, e_array* a) {
+	if(a->items != NULL) return e_array_reserve(vm, a, a->len);
+	return e_array_column(vm, a, a->len, 0);
+}
 
-		e_array_entry e = vm->arrays_local[arr.aval.aptr][index];
-		*vptr = e.v;
-		return e.used;
+uint8_t
+e_array_make_numeric(e_vm* vm, e_array* a) {
+	/* Packs the elements into a numeric column, fails if one of them is no number */
+	if(a->items == NULL) return e_array_reserve(vm, a, a->len);
+	for(uint32_t i = 0; i < a->len; i++) {
+		if(a->items[i].argtype != E_NUMBER) return 0;
 	}
+	return e_array_column(vm, a, a->len, 1);
 }
 
 uint8_t
-e_change_value_in_arr(e_vm* vm, uint32_t aptr, uint32_t index, e_value v, uint32_t global_local) {
-	if(global_local == E_ARRAY_GLOBAL) {
-		if(aptr >= E_MAX_GLOBALS) return 0;
-		if(index >= E_MAX_ARRAYSIZE) return 0;
-
-		if(vm->arrays_global[aptr][index].used) {
-			vm->arrays_global[aptr][index].v = v;
-			return 1;
-		}
-	} else {
-		if(aptr >= E_MAX_LOCALS) return 0;
-		if(index >= E_MAX_ARRAYSIZE) return 0;
+e_array_assign(e_vm* vm, e_array* a, e_value* values, uint32_t len) {
+	uint8_t numeric = 1;
+	for(uint32_t i = 0; i < len; i++) {
+		numeric &= values[i].argtype == E_NUMBER;
+	}
 
-		if(vm->arrays_local[aptr][index].used) {
-			vm->arrays_local[aptr][index].v = v;
-			return 1;
+	if(a->cap < a->len) {
+		/* Elements shared with an image, nothing to copy or release */
+		*a = (e_array) { 0 };
+	} else if(a->items != NULL) {
+		for(uint32_t i = 0; i < a->len; i++) {
+			e_value_release(a->items[i]);
 		}
 	}
-	return 0;
+	a->len = 0;
+
+	uint8_t ok = len <= vm->config.array_len;
+	if(ok && numeric != (a->items == NULL)) {
+		ok = e_array_column(vm, a, len, numeric);
+	}
+	if(!ok || !e_array_reserve(vm, a, len)) {
+		for(uint32_t i = 0; i < len; i++) e_value_release(values[i]);
+		return 0;
+	}
+
+	if(numeric) {
+		for(uint32_t i = 0; i < len; i++) a->nums[i] = values[i].val;
+	} else if(len > 0) {
+		memcpy(a->items, values, sizeof(e_value) * len);
+	}
+	a->len = len;
+	return 1;
+}
+
+uint8_t
+e_array_store(e_vm* vm, e_value* slot, e_value* values, uint32_t len) {
+	/* Array data stored to a variable that holds an array overwrites the array's elements,
+	   so a script refilling a variable in a loop does not allocate a new array every time */
+	e_array* a = e_array_get(vm, *slot);
+	if(a != NULL) {
+		return e_array_assign(vm, a, values, len);
+	}
+
+	e_value arr = e_create_array(vm, values, len);
+	if(arr.argtype != E_ARRAY) return 0;
+
+	e_value_release(*slot);
+	*slot = arr;
+	return 1;
+}
+
+uint8_t
+e_find_value_in_arr(const e_vm* vm, e_value arr, uint32_t index, e_value* vptr) {
+	const e_array* a = e_array_get(vm, arr);
+	if(a == NULL || index >= a->len) return 0;
+
+	*vptr = a->items == NULL ? e_create_number(a->nums[index]) : a->items[index];
+	return 1;
+}
+
+uint8_t
+e_change_value_in_arr(e_vm* vm, e_value arr, uint32_t index, e_value v) {
+	e_array* a = e_array_get(vm, arr);
+	if(a == NULL || index > a->len) return 0;
+	if(a->items == NULL && v.argtype != E_NUMBER && !e_array_make_values(vm, a)) return 0;
+
+	/* Storing right behind the last element appends */
+	if(!e_array_reserve(vm, a, index == a->len ? a->len + 1 : a->len)) return 0;
+	if(index == a->len) a->len++;
+	else if(a->items != NULL) e_value_release(a->items[index]);
+
+	if(a->items == NULL) {
+		a->nums[index] = v.val;
+	} else {
+		a->items[index] = v;
+	}
+	return 1;
 }
 
 // C-API
@@ -1040,34 +1851,24 @@ e_api_stack_pop(e_stack* stack) {
 	return e_stack_pop(stack);
 }
 
-void
-e_api_register_sub(const char* identifier, uint32_t (*fptr)(e_vm*, uint32_t)) {
-	static uint32_t m_index = 0;
-	if(m_index + 1 < E_MAX_EXTIDENTIFIERS) {
-		if(strlen(identifier) < E_MAX_EXTIDENTIFIERS_STRLEN) {
-			strcpy(e_external_map[m_index].identifier, identifier);
-			if(strlen(identifier) == strlen(e_external_map[m_index].identifier)) {
-				e_external_map[m_index].fptr = fptr;
-				m_index++;
-				return;
-			}
-		}
-	}
-
-	e_fail("Cannot register another subroutine");
+e_array*
+e_api_get_array(e_vm* vm, e_value v) {
+	/* The elements may be changed, so an array shared with an image is copied. A numeric column becomes a column of values */
+	e_array* a = e_array_get(vm, v);
+	if(a != NULL && !e_array_make_values(vm, a)) return NULL;
+	return a;
 }
 
-int32_t
-e_api_call_sub(e_vm* vm, const char* identifier, uint32_t arglen) {
-	uint32_t slen = strlen(identifier);
-	if(slen > E_MAX_EXTIDENTIFIERS_STRLEN) return 0;
-
-	for(uint32_t i = 0; i < E_MAX_EXTIDENTIFIERS; i++) {
-		if(strncmp(identifier, e_external_map[i].identifier, slen) == 0) {
-			// Call external function through fp
-			return e_external_map[i].fptr(vm, arglen);
-		}
-	}
+e_array*
+e_api_get_numbers(e_vm* vm, e_value v) {
+	/* The elements as a numeric column (nums) that may be changed, NULL if one of them is no number */
+	e_array* a = e_array_get(vm, v);
+	if(a != NULL && !e_array_make_numeric(vm, a)) return NULL;
+	return a;
+}
 
-	return -1;
-}
\ No newline at end of file
+const e_array*
+e_api_read_array(const e_vm* vm, e_value v) {
+	/* The elements are in nums if items is NULL */
+	return e_array_get(vm, v);
+}
@@ -6,22 +6,32 @@
 #define ES_VM_H
 
 #include <stdint.h>
-
-#define E_ARRAY_GLOBAL ((uint32_t)0)
-#define E_ARRAY_LOCAL ((uint32_t)1)
+#include <stdio.h>
+#include <stdlib.h>
 
 // Never change E_INSTR_BYTES!
 #define    E_INSTR_BYTES           ((uint32_t)9)
 #define    E_INSTR_SINGLE_BYTES    ((uint32_t)1)
 
-// You may change these values (carefully!)
+// You may change these values (carefully!), they are the defaults and the maximum of e_vm_config
 #define E_STACK_SIZE        ((uint32_t)64)
 #define E_MAX_GLOBALS		((uint32_t)48)
 #define E_MAX_LOCALS		((uint32_t)16)
+#define E_MAX_ARRAYS		((uint32_t)0x7FFFFFFF)
+#define E_MAX_ARRAY_LEN		((uint32_t)0x7FFFFFFF)
 
 #define E_MAX_STRLEN    ((int)64)
-#define E_MAX_ARRAYSIZE ((int)16)
+#define E_NUMBER_STRLEN	((uint32_t)32)	/* Room for the string form of any number */
+#define E_ARENA_BLOCK_SIZE	((uint32_t)4096)
 #define E_MAX_CALLFRAMES ((int)16)
+#define E_FRAME_STACK_SIZE	((uint32_t)(E_MAX_CALLFRAMES * E_MAX_LOCALS))
+
+// Heap allocation, override these to use a custom allocator
+#ifndef E_MALLOC
+#define E_MALLOC(sz)		malloc(sz)
+#define E_REALLOC(p, sz)	realloc((p), (sz))
+#define E_FREE(p)			free(p)
+#endif
 
 // Defines external C-API linkage
 #define E_MAX_EXTIDENTIFIERS    ((int)16)
@@ -44,24 +54,47 @@ typedef enum {
 	E_VM_STATUS_READY = 0,
 	E_VM_STATUS_OK = 1,
 	E_VM_STATUS_EOF = 2,
+	E_VM_STATUS_SUSPENDED = 3,  /* Step budget or deadline reached, run again to continue */
+	E_VM_STATUS_WAITING = 4,    /* Waiting for a pending external function, see e_vm_complete */
 } e_vm_status;
 
+#define E_VM_STEPS_UNLIMITED	((uint64_t)UINT64_MAX)
+#define E_VM_SLICE_STEPS		((uint64_t)4096)   /* Steps between clock reads of e_vm_run_until */
+
 // ES Types
-typedef struct {
-	uint8_t sval[E_MAX_STRLEN];
+// Strings are immutable, reference counted heap objects, values only hold a pointer to them
+typedef struct e_str_type {
+	uint32_t refs;
 	uint32_t slen;
+	union {
+		struct e_str_heap* heap;    /* Owning string heap, NULL if allocated with E_MALLOC */
+		struct e_str_type* next;    /* Free list link while cached by the heap */
+	};
+	uint8_t sval[];                 /* slen bytes, zero terminated */
 } e_str_type;
 
+#define E_STR_STATIC	((uint32_t)0xFFFFFFFF)	/* refs of strings that are never freed (i.e. literals) */
+
+// Per vm string heap, freed small strings are cached per size class
+#define E_STR_HEAP_CLASSES	((uint32_t)4)
+#define E_STR_HEAP_MAX_FREE	((uint32_t)64)
+
+typedef struct e_str_heap {
+	e_str_type* free_list[E_STR_HEAP_CLASSES];
+	uint32_t free_count[E_STR_HEAP_CLASSES];
+	uint32_t live;
+	uint64_t bytes;
+} e_str_heap;
+
 typedef struct {
-	uint32_t aptr;
-	uint32_t alen;
-	uint8_t global_local;
+	uint32_t aptr;      /* Index into vm->arrays */
 } e_array_type;
 
+// 16 byte tagged value, numbers are stored inline
 typedef struct {
 	union {
 		double val;
-		e_str_type sval;
+		e_str_type* sval;
 		e_array_type aval;
 	};
 	enum {
@@ -69,15 +102,35 @@ typedef struct {
 	} argtype;
 } e_value;
 
-// Array type
-typedef struct array_entry {
-	e_value v;
-	uint8_t used;
-} e_array_entry;
+// Array type, the elements are allocated from the vm's arena. Arrays of numbers keep them packed in a numeric column,
+// an array changes to a column of values when anything else is stored
+typedef struct {
+	e_value* items;     /* Column of values, NULL for a numeric column */
+	double* nums;       /* Numeric column, NULL for a column of values */
+	uint32_t len;
+	uint32_t cap;
+} e_array;
+
+// Flags of e_sort_values (and the second argument of __sort)
+#define E_SORT_DESCENDING	((uint32_t)1)
+#define E_SORT_STABLE		((uint32_t)2)	/* Equal strings / mixed values keep their order, needs a buffer */
+
+// Arena (bump allocator), memory is only released all at once
+typedef struct e_arena_block {
+	struct e_arena_block* next;
+	size_t size;
+	size_t used;
+	uint8_t data[];
+} e_arena_block;
+
+typedef struct {
+	e_arena_block* head;
+	uint64_t bytes;
+} e_arena;
 
 // Stack
 typedef struct {
-	e_value entries[E_STACK_SIZE];
+	e_value* entries;
 	uint32_t size;
 	uint32_t top;
 } e_stack;
@@ -87,29 +140,228 @@ typedef struct {
 	e_value val;
 } e_stack_status_ret;
 
+// Call frame, its locals are a slice of the vm's frame stack
 typedef struct {
-	double retAddr;
-	e_stack locals;
+	uint32_t retAddr;   /* Instruction index to return to */
+	uint32_t base;      /* First slot in vm->frame_slots */
+	uint32_t size;      /* Number of reserved slots */
 } e_callframe;
 
-// VM
+// Decoded instruction (see e_program_load)
 typedef struct {
-	uint32_t ip;
-	e_stack stack;
-	e_value globals[E_MAX_GLOBALS];
-	e_value locals[E_MAX_LOCALS];
-	e_callframe callframes[E_MAX_CALLFRAMES];
+	uint8_t OP;
+	uint8_t depth;      /* JMPFUN: stack entries the called function uses above its base (see e_program_verify) */
+	uint16_t nlocals;   /* JMPFUN: local slots used by the called function */
+	uint32_t op1;
+	uint32_t op2;
+	uint32_t addr;      /* Byte address of the instruction within the script */
+	uint32_t target;    /* Resolved instruction index (JZ, JMP, JMPFUN) or literal index (PUSHS) */
+	double d_op;        /* Operand, pre-converted to double */
+} e_dinstr;
+
+#define E_TARGET_INVALID	((uint32_t)0xFFFFFFFF)
+
+// Register groups (see e_program_translate): straight line code of a verified program as operations on
+// variables, constants and stack slots, instead of moving every operand through the stack
+typedef enum {
+	E_REG_CONST = 0,
+	E_REG_GLOBAL = 1,
+	E_REG_LOCAL = 2,
+	E_REG_TEMP = 3      /* Stack slot, relative to the stack top at the start of the group */
+} e_reg_kind;
+
+typedef struct {
+	uint8_t kind;
+	int32_t index;
+} e_reg;
+
+typedef struct {
+	uint8_t op;         /* E_OP_MOV, arithmetic and compare opcodes, E_OP_JZ, E_OP_JMP and the compare-branch opcodes */
+	e_reg dst;
+	e_reg a;
+	e_reg b;
+	uint32_t target;    /* Branches: instruction index */
+} e_rinstr;
+
+typedef struct {
+	uint32_t first;     /* First operation in e_program.rcode */
+	uint32_t count;
+	uint32_t end;       /* Instruction index after the group */
+	uint32_t steps;     /* Instructions of the group */
+	int32_t delta;      /* Change of the stack top */
+	uint8_t op;         /* Original opcode of the group's first instruction */
+} e_rgroup;
+
+#define E_PROFILE_PERIOD	((uint32_t)32)
+#define E_PROFILE_NO_SAMPLE	((uint32_t)256)
+
+// Program (decoded byte code)
+typedef struct {
+	e_dinstr* code;
+	uint32_t count;
+	e_value* literals;
+	uint32_t lcount;
+	uint32_t blen;
+	uint32_t nglobals;  /* Highest global index + 1 */
+	uint32_t nlocals;   /* Highest top level local index + 1, only known for verified programs */
+	uint32_t depth;     /* Highest stack depth of the top level code, only known for verified programs */
+	uint8_t verified;   /* Stack depths verified, runs without checks (see e_program_verify) */
+	uint8_t shared;     /* Run by vms on several threads, read only (see e_runner_prepare) */
+	e_rgroup* rgroups;  /* Register groups, only run by the unchecked interpreter */
+	uint32_t rgcount;
+	e_rinstr* rcode;
+	uint32_t rcount;
+	e_value* rconsts;
+	uint32_t rkcount;
+	const struct e_registry* registry;  /* Registry the call sites were resolved against (see e_program_link) */
+} e_program;
+
+// External function call that returned E_API_CALL_RETURN_PENDING
+typedef struct {
+	e_value name;
+	uint32_t argsbefore;
+	uint32_t arglen;
+} e_pending_call;
+
+// Profiler (compiled in with E_PROFILE), see e_vm_set_profile
+typedef struct {
+	uint64_t count;             /* Executions */
+	uint64_t cycles;            /* Cycles until the next instruction was fetched */
+} e_profile_op;
+
+typedef struct {
+	uint64_t hits;              /* Executions of the instruction */
+	uint64_t calls;             /* JMPFUN calls with the instruction as target */
+	uint64_t cycles;            /* Cycles spent in those calls, callees included */
+} e_profile_ip;
+
+typedef struct {
+	uint32_t target;
+	uint64_t start;
+} e_profile_frame;
+
+typedef struct {
+	e_profile_op ops[256];
+	e_profile_ip* ips;          /* Per instruction index of prog */
+	uint32_t ip_count;
+	const e_program* prog;
+	const e_dinstr* code;       /* Code of prog when the profile started */
+	uint64_t cycles;            /* Cycles of all profiled instructions (estimated from the samples) */
+	uint32_t period;            /* The cycles of every period-th instruction are measured */
+
+	/* Running state */
+	uint32_t countdown;
+	uint32_t sample_op;         /* Opcode being measured, E_PROFILE_NO_SAMPLE if none */
+	uint64_t sample_start;
+	uint64_t paused;            /* Cycles the vm was not running (suspended, waiting), not counted for functions */
+	uint64_t paused_at;
+	e_profile_frame frames[E_MAX_CALLFRAMES];
+} e_profile;
+
+// Baseline JIT (compiled in with E_JIT, x86-64 only), see e_vm_set_jit
+#define E_JIT_HOT			((uint32_t)1000)
+#define E_JIT_MAX_GROUPS	((uint32_t)64)
+
+struct e_vm;
+
+/* Runs a compiled region, returns the instruction index the interpreter continues at */
+typedef uint32_t (*e_jit_fn)(struct e_vm* vm, e_value* locals, uint64_t* steps);
+
+typedef struct {
+	uint32_t count;             /* Executions of the group */
+	uint8_t candidate;          /* Loop header or JMPFUN target, compiled after jit.hot executions */
+	e_jit_fn fn;                /* Native code of the region starting at the group, NULL if not compiled */
+} e_jit_group;
+
+typedef struct e_jit_block {
+	struct e_jit_block* next;
+	size_t size;
+	size_t used;
+} e_jit_block;
+
+typedef struct {
+	e_jit_group* groups;        /* Per register group of prog */
+	uint32_t gcount;
+	const e_program* prog;
+	const e_dinstr* code;       /* Code of prog when the jit started */
+	e_jit_block* blocks;        /* Executable memory */
+	uint32_t hot;               /* Executions before a candidate is compiled */
+	uint32_t compiled;          /* Compiled regions */
+	uint64_t bytes;             /* Size of the native code */
+} e_jit;
+
+// Limits of a vm (see e_vm_init_config), 0 selects the default. Larger values than the defaults are capped
+typedef struct {
+	uint32_t stack_size;        /* Stack entries (E_STACK_SIZE) */
+	uint32_t globals;           /* Global variables (E_MAX_GLOBALS) */
+	uint32_t locals;            /* Top level local variables (E_MAX_LOCALS) */
+	uint32_t callframes;        /* Nested function calls (E_MAX_CALLFRAMES) */
+	uint32_t frame_slots;       /* Locals of all active function calls (E_FRAME_STACK_SIZE) */
+	uint32_t arrays;            /* Arrays created by a run (E_MAX_ARRAYS) */
+	uint32_t array_len;         /* Elements of an array (E_MAX_ARRAY_LEN) */
+} e_vm_config;
+
+// VM, the state every instruction uses comes first and fits one cache line.
+// The stack, variables and call frames are allocated by the first load or run (see e_vm_alloc), the frame slots by the first function call
+typedef struct e_vm {
+	uint32_t ip;                /* Index into prog->code, NOT a byte offset */
 	uint32_t cfcnt;
+	e_stack stack;
+	e_value* globals;
+	e_value* locals;
+	e_callframe* callframes;
+	e_value* frame_slots;
+	uint32_t pupo_is_data;
+	int32_t pupo_arr_index;
+
+	const e_program* prog;
 	e_vm_status status;
+	uint8_t unchecked;          /* Running a verified program unchecked, cleared when a guard fails */
+	uint64_t executed;          /* Instructions executed since e_vm_init / e_vm_reset */
+	e_pending_call pending;     /* Valid while status is E_VM_STATUS_WAITING */
+	e_vm_config config;
 
 	uint32_t ds_offset;
 
-	uint8_t pupo_is_data;
-	int32_t pupo_arr_index;
-	e_array_entry arrays_local[E_MAX_LOCALS][E_MAX_ARRAYSIZE];
-	e_array_entry arrays_global[E_MAX_GLOBALS][E_MAX_ARRAYSIZE];
+	e_array* arrays;
+	uint32_t acount;
+	uint32_t acap;
+	e_arena arena;
+
+	e_program program;          /* Program owned by e_vm_parse_bytes */
+	e_str_heap strings;
+	struct e_registry* registry;    /* External functions, may be shared between vms */
+	e_profile* profile;         /* Only used with E_PROFILE */
+	e_jit* jit;                 /* Only used with E_JIT */
 } e_vm;
 
+// Snapshot of a vm (see e_vm_snapshot), vms restored from it share its strings and array elements
+typedef struct {
+	uint8_t* bytes;             /* Binary image, can be stored and loaded again with e_vm_image_load */
+	uint32_t size;
+
+	/* Decoded state, read-only while vms use it */
+	uint32_t code_count;        /* Instructions of the program the vm ran, 0 if none */
+	uint32_t nglobals;          /* Globals and top level locals of the vm (e_vm_config) */
+	uint32_t nlocals;
+	e_vm_status status;
+	uint32_t ip;
+	uint64_t executed;
+	uint8_t unchecked;          /* Not trusted, a restored vm continues checked */
+	uint32_t pupo_is_data;
+	int32_t pupo_arr_index;
+	e_pending_call pending;
+	uint32_t cfcnt;
+	e_callframe callframes[E_MAX_CALLFRAMES];
+	uint32_t top;
+	uint32_t nslots;            /* Frame slots in use */
+	e_value* values;            /* Stack, globals, locals, frame slots, array elements, pending call name */
+	double* numbers;            /* Elements of the arrays of numbers */
+	e_array* arrays;            /* cap 0, the elements are owned by the image */
+	uint32_t acount;
+	uint8_t* strings;           /* Static strings (E_STR_STATIC) of the values */
+} e_vm_image;
+
 // External subroutines / functions
 typedef struct {
 	char identifier[E_MAX_EXTIDENTIFIERS_STRLEN];
@@ -117,7 +369,15 @@ typedef struct {
 	uint32_t (*fptr)(e_vm *vm, uint32_t arglen);
 } e_external_mapping;
 
-extern e_external_mapping e_external_map[E_MAX_EXTIDENTIFIERS];
+// Registry of external functions, lookups are lock free, registration is serialized by a lock
+// Entries are only appended, so vms on other threads can keep calling while functions are registered
+typedef struct e_registry {
+	e_external_mapping entries[E_MAX_EXTIDENTIFIERS];
+	uint32_t count;     /* Number of published entries */
+	uint8_t lock;
+} e_registry;
+
+extern e_registry e_default_registry;
 
 // OPCODES
 typedef enum {
@@ -160,6 +420,44 @@ typedef enum {
 	E_OP_ARGTYPE = 0x51,   /* Argtype statement 					   ARGTYPE(expr)					   */
 	E_OP_LEN = 0x52,       /* Len statement							   LEN(expr)						   */
 	E_OP_ARRAY = 0x53, 	   /* Array (dim) statement					   ARRAY(n)							   */
+
+	/* Internal opcodes, only used in decoded programs */
+	E_OP_HALT = 0xFF,      /* End of program                                                               */
+
+	/* Superinstructions (see e_program_fuse) */
+	E_OP_POPG_ADDK = 0xE0, /* POPG [index], PUSH [k], ADD                                                  */
+	E_OP_POPG_SUBK = 0xE1, /* POPG [index], PUSH [k], SUB                                                  */
+	E_OP_POPL_ADDK = 0xE2, /* POPL [index], PUSH [k], ADD                                                  */
+	E_OP_POPL_SUBK = 0xE3, /* POPL [index], PUSH [k], SUB                                                  */
+	E_OP_EQ_JZ = 0xE4,     /* EQ, JZ [addr]                                                                */
+	E_OP_LT_JZ = 0xE5,     /* LT, JZ [addr]                                                                */
+	E_OP_GT_JZ = 0xE6,     /* GT, JZ [addr]                                                                */
+	E_OP_LTEQ_JZ = 0xE7,   /* LTEQ, JZ [addr]                                                              */
+	E_OP_GTEQ_JZ = 0xE8,   /* GTEQ, JZ [addr]                                                              */
+	E_OP_NOTEQ_JZ = 0xE9,  /* NOTEQ, JZ [addr]                                                             */
+	E_OP_PUSHA_POPG = 0xEA,/* PUSHA [index], POPG [index]                                                  */
+	E_OP_PUSHA_POPL = 0xEB,/* PUSHA [index], POPL [index]                                                  */
+
+	/* Resolved calls (see e_program_link) */
+	E_OP_CALLI = 0xEC,     /* PUSHS [name], CALL [arglen], name resolved to a registry index               */
+
+	/* Quickened instructions (see E_QUICKEN), rewritten on first execution */
+	E_OP_ADD_NUM_NUM = 0xC0,
+	E_OP_SUB_NUM_NUM = 0xC1,
+	E_OP_MUL_NUM_NUM = 0xC2,
+	E_OP_DIV_NUM_NUM = 0xC3,
+	E_OP_EQ_NUM_NUM = 0xC4,
+	E_OP_LT_NUM_NUM = 0xC5,
+	E_OP_GT_NUM_NUM = 0xC6,
+	E_OP_LTEQ_NUM_NUM = 0xC7,
+	E_OP_GTEQ_NUM_NUM = 0xC8,
+	E_OP_NOTEQ_NUM_NUM = 0xC9,
+	E_OP_EQ_STR_STR = 0xCA,
+	E_OP_NOTEQ_STR_STR = 0xCB,
+
+	/* Register groups (see e_program_translate) */
+	E_OP_REG = 0xED,       /* First instruction of a register group, target is the group index            */
+	E_OP_MOV = 0xEE,       /* Register operation: dst = a                                                  */
 } e_opcode;
 
 /* Single byte operations
@@ -197,15 +495,103 @@ typedef struct {
 
 // VM
 void e_vm_init(e_vm *vm);
+void e_vm_init_config(e_vm* vm, const e_vm_config* config);
+uint8_t e_vm_alloc(e_vm* vm);
+void e_vm_destroy(e_vm *vm);
+void e_vm_reset(e_vm *vm);
 e_vm_status e_vm_parse_bytes(e_vm* vm, uint32_t offset, uint32_t blen);
-e_vm_status e_vm_evaluate_instr(e_vm *vm, e_instr instr);
+e_vm_status e_vm_parse_buffer(e_vm* vm, const uint8_t* bytes, uint32_t blen);
+e_vm_status e_vm_load_buffer(e_vm* vm, const uint8_t* bytes, uint32_t blen);
+e_vm_status e_vm_run(e_vm* vm, const e_program* prog);
+e_vm_status e_vm_run_steps(e_vm* vm, const e_program* prog, uint64_t steps);
+e_vm_status e_vm_run_until(e_vm* vm, const e_program* prog, uint64_t deadline_ns);
+uint64_t e_vm_clock_ns(void);
+e_vm_status e_vm_complete(e_vm* vm, uint32_t ret);
 e_value e_create_number(double n);
 e_value e_create_string(const char *str);
-e_value e_create_array(e_vm* vm, e_value* arr, uint32_t arrlen, uint32_t index, uint32_t global_local);
+e_value e_api_create_string(e_vm* vm, const char *str, uint32_t slen);
+e_value e_api_number_to_string(e_vm* vm, double d);
+void e_value_retain(e_value v);
+void e_value_release(e_value v);
+uint8_t e_value_equals(e_value a, e_value b);
+double e_value_number(e_value v);
+double e_value_arith(uint8_t op, e_value a, e_value b);
+uint8_t e_value_compare(uint8_t op, e_value a, e_value b);
+e_value e_create_array(e_vm* vm, e_value* arr, uint32_t arrlen);
+e_value e_create_numbers(e_vm* vm, uint32_t len);
+
+// Arena
+void e_arena_init(e_arena* arena);
+void* e_arena_alloc(e_arena* arena, size_t size);
+void e_arena_reset(e_arena* arena);
+void e_arena_free(e_arena* arena);
+
+// Strings
+void e_str_heap_init(e_str_heap* heap);
+void e_str_heap_clear(e_str_heap* heap);
+e_str_type* e_str_alloc(e_str_heap* heap, uint32_t slen);
+void e_str_free(e_str_type* str);
+void e_str_truncate(e_str_type* str, uint32_t slen);
+
+// Number formatting
+uint32_t e_format_number(double d, char* dst);
+
+// Sorting
+uint8_t e_sort_values(e_value* items, uint32_t len, uint32_t flags);
+uint8_t e_sort_numbers(double* nums, uint32_t len, uint32_t flags);
+
+// Numeric kernels
+double e_numeric_sum(const double* x, uint32_t len);
+double e_numeric_min(const double* x, uint32_t len);
+double e_numeric_max(const double* x, uint32_t len);
+double e_numeric_dot(const double* x, const double* y, uint32_t len);
+void e_numeric_scale(double* x, uint32_t len, double k);
+void e_numeric_clamp(double* x, uint32_t len, double lo, double hi);
+
+// Program
+e_vm_status e_program_load(e_program* prog, uint32_t offset, uint32_t blen);
+e_vm_status e_program_load_buffer(e_program* prog, const uint8_t* bytes, uint32_t blen);
+e_vm_status e_program_load_file(e_program* prog, const char* path);
+void e_program_fuse(e_program* prog);
+e_vm_status e_program_link(e_program* prog, const e_registry* reg);
+void e_program_free(e_program* prog);
+
+// Registry
+void e_registry_init(e_registry* reg);
+uint8_t e_registry_add(e_registry* reg, const char* identifier, uint32_t (*fptr)(e_vm*, uint32_t));
+const e_external_mapping* e_registry_find(const e_registry* reg, const char* identifier);
+int32_t e_registry_call(const e_registry* reg, uint32_t index, e_vm* vm, uint32_t arglen);
+void e_vm_set_registry(e_vm* vm, e_registry* reg);
+
+// Profiler
+void e_profile_init(e_profile* prof);
+void e_profile_clear(e_profile* prof);
+void e_profile_free(e_profile* prof);
+uint8_t e_profile_begin(e_profile* prof, const e_program* prog);
+uint8_t e_profile_dump(const e_profile* prof, FILE* f);
+const char* e_opcode_name(uint8_t op);
+void e_vm_set_profile(e_vm* vm, e_profile* prof);
+
+// Baseline JIT
+void e_jit_init(e_jit* jit);
+void e_jit_free(e_jit* jit);
+uint8_t e_jit_begin(e_jit* jit, const e_program* prog);
+e_jit_fn e_jit_compile(e_jit* jit, const e_program* prog, uint32_t group);
+uint8_t e_jit_supported(void);
+void e_vm_set_jit(e_vm* vm, e_jit* jit);
+
+// Snapshots
+uint8_t e_vm_snapshot(const e_vm* vm, e_vm_image* img);
+uint8_t e_vm_image_load(e_vm_image* img, const uint8_t* bytes, uint32_t size);
+void e_vm_image_free(e_vm_image* img);
+e_vm_status e_vm_restore(e_vm* vm, const e_vm_image* img, const e_program* prog);
 
 // API
 e_stack_status_ret e_api_stack_push(e_stack *stack, e_value v);
 e_stack_status_ret e_api_stack_pop(e_stack *stack);
+e_array* e_api_get_array(e_vm *vm, e_value v);
+e_array* e_api_get_numbers(e_vm *vm, e_value v);
+const e_array* e_api_read_array(const e_vm *vm, e_value v);
 void e_api_register_sub(const char *identifier, uint32_t (*fptr)(e_vm *, uint32_t));
 int32_t e_api_call_sub(e_vm *vm, const char *identifier, uint32_t arglen);
 
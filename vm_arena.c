@@ -0,0 +1,60 @@
+//
+// es_vm
+//
+
+#include "vm.h"
+
+// Allocations are rounded up to keep e_value (and double) aligned
+#define E_ARENA_ALIGN	((size_t)8)
+
+void
+e_arena_init(e_arena* arena) {
+	if(arena == NULL) return;
+	*arena = (e_arena) { 0 };
+}
+
+void*
+e_arena_alloc(e_arena* arena, size_t size) {
+	size = (size + E_ARENA_ALIGN - 1) & ~(E_ARENA_ALIGN - 1);
+
+	e_arena_block* b = arena->head;
+	if(b == NULL || b->size - b->used < size) {
+		/* Start a new block, allocations larger than a block get their own */
+		size_t bsize = size > E_ARENA_BLOCK_SIZE ? size : E_ARENA_BLOCK_SIZE;
+		b = E_MALLOC(sizeof(e_arena_block) + bsize);
+		if(b == NULL) return NULL;
+		b->next = arena->head;
+		b->size = bsize;
+		b->used = 0;
+		arena->head = b;
+	}
+
+	void* p = b->data + b->used;
+	b->used += size;
+	arena->bytes += size;
+	return p;
+}
+
+void
+e_arena_reset(e_arena* arena) {
+	if(arena == NULL || arena->head == NULL) return;
+
+	/* Keep the newest block for the next run, release all others */
+	e_arena_block* b = arena->head->next;
+	while(b != NULL) {
+		e_arena_block* next = b->next;
+		E_FREE(b);
+		b = next;
+	}
+	arena->head->next = NULL;
+	arena->head->used = 0;
+	arena->bytes = 0;
+}
+
+void
+e_arena_free(e_arena* arena) {
+	if(arena == NULL) return;
+	e_arena_reset(arena);
+	E_FREE(arena->head);
+	arena->head = NULL;
+}
@@ -5,9 +5,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "vm_builtins.h"
 
-static int cmpfunc(const void* a, const void* b);
+static uint32_t e_builtin_reduce(e_vm* vm, uint32_t arglen, double (*kernel)(const double*, uint32_t), uint8_t mean);
+static const double* e_builtin_numbers(const e_array* arr, double** tmp);
 
 /* Built-ins */
 uint32_t e_builtin_print(e_vm* vm, uint32_t arglen) {
@@ -15,8 +17,9 @@ uint32_t e_builtin_print(e_vm* vm, uint32_t arglen) {
 		e_stack_status_ret s1 = e_api_stack_pop(&vm->stack);
 		if(s1.status == E_STATUS_OK
 		   && s1.val.argtype == E_STRING) {
-			e_print((char*)s1.val.sval.sval);
+			e_print((char*)s1.val.sval->sval);
 		}
+		e_value_release(s1.val);
 	}
 	return E_API_CALL_RETURN_OK(0);
 }
@@ -25,6 +28,7 @@ uint32_t e_builtin_argtype(e_vm* vm, uint32_t arglen) {
 	if(arglen == 1) {
 		e_stack_status_ret s1 = e_api_stack_pop(&vm->stack);
 		if(s1.status == E_STATUS_OK) {
+			e_value_release(s1.val);
 			e_stack_status_ret s_push = e_api_stack_push(&vm->stack, e_create_number(s1.val.argtype));
 			if(s_push.status == E_STATUS_OK) {
 				return E_API_CALL_RETURN_OK(1);
@@ -46,10 +50,14 @@ uint32_t e_builtin_len(e_vm* vm, uint32_t arglen) {
 					s_push = e_api_stack_push(&vm->stack, e_create_number(0));
 					break;
 				case E_STRING:
-					s_push = e_api_stack_push(&vm->stack, e_create_number(s1.val.sval.slen));
+					s_push = e_api_stack_push(&vm->stack, e_create_number(s1.val.sval->slen));
+					e_value_release(s1.val);
 					break;
 				case E_ARRAY:
-					s_push = e_api_stack_push(&vm->stack, e_create_number(s1.val.aval.alen));
+					{
+						const e_array* a = e_api_read_array(vm, s1.val);
+						s_push = e_api_stack_push(&vm->stack, e_create_number(a != NULL ? a->len : 0));
+					}
 					break;
 			}
 			if(s_push.status == E_STATUS_OK) {
@@ -60,47 +68,168 @@ uint32_t e_builtin_len(e_vm* vm, uint32_t arglen) {
 	return E_API_CALL_RETURN_ERROR;
 }
 
-int cmpfunc(const void* a, const void* b) {
-	e_value* v1 = (e_value*)a;
-	e_value* v2 = (e_value*)b;
+uint32_t e_builtin_sort(e_vm* vm, uint32_t arglen) {
+	/* __sort(arr) or __sort(arr, flags) sorts the elements of arr in place and returns arr */
+	if(arglen == 1 || arglen == 2) {
+		uint32_t flags = 0;
+		if(arglen == 2) {
+			e_stack_status_ret s2 = e_api_stack_pop(&vm->stack);
+			if(s2.status != E_STATUS_OK || s2.val.argtype != E_NUMBER
+			   || !(s2.val.val >= 0 && s2.val.val <= (E_SORT_DESCENDING | E_SORT_STABLE))) {
+				e_value_release(s2.val);
+				return E_API_CALL_RETURN_ERROR;
+			}
+			flags = (uint32_t)s2.val.val;
+		}
 
-	if(v1->argtype == E_NUMBER && v2->argtype == E_NUMBER) {
-		return (int)(v1->val - v2->val);
-	} else if(v1->argtype == E_STRING && v2->argtype == E_STRING) {
-		return (int)(v1->sval.slen - v2->sval.slen);
+		e_stack_status_ret s1 = e_api_stack_pop(&vm->stack);
+		uint8_t ok = 0;
+		if(s1.status == E_STATUS_OK) {
+			/* Numeric columns are sorted as they are, anything else as values */
+			e_array* arr = e_api_get_numbers(vm, s1.val);
+			if(arr != NULL) {
+				ok = e_sort_numbers(arr->nums, arr->len, flags);
+			} else {
+				arr = e_api_get_array(vm, s1.val);
+				ok = arr != NULL && e_sort_values(arr->items, arr->len, flags);
+			}
+		}
+		if(ok) {
+			e_stack_status_ret s_push = e_api_stack_push(&vm->stack, s1.val);
+			if(s_push.status == E_STATUS_OK) {
+				return E_API_CALL_RETURN_OK(1);
+			}
+		}
+		e_value_release(s1.val);
 	}
-	return 0;
+	return E_API_CALL_RETURN_ERROR;
 }
 
-uint32_t e_builtin_sort(e_vm* vm, uint32_t arglen) {
+const double* e_builtin_numbers(const e_array* arr, double** tmp) {
+	/* The elements of an array that is only read, without changing it: a numeric column as it is,
+	   a column of values is copied to *tmp (freed by the caller). NULL if one of them is no number */
+	*tmp = NULL;
+	if(arr == NULL) return NULL;
+	if(arr->items == NULL) return arr->nums;
+	for(uint32_t i = 0; i < arr->len; i++) {
+		if(arr->items[i].argtype != E_NUMBER) return NULL;
+	}
+	*tmp = E_MALLOC(sizeof(double) * arr->len + 1);
+	if(*tmp == NULL) return NULL;
+	for(uint32_t i = 0; i < arr->len; i++) {
+		(*tmp)[i] = arr->items[i].val;
+	}
+	return *tmp;
+}
+
+uint32_t e_builtin_reduce(e_vm* vm, uint32_t arglen, double (*kernel)(const double*, uint32_t), uint8_t mean) {
 	if(arglen == 1) {
 		e_stack_status_ret s1 = e_api_stack_pop(&vm->stack);
-		if(s1.status == E_STATUS_OK && s1.val.argtype == E_ARRAY) {
+		const e_array* arr = s1.status == E_STATUS_OK ? e_api_read_array(vm, s1.val) : NULL;
+		double* tmp;
+		const double* x = e_builtin_numbers(arr, &tmp);
+		if(x != NULL) {
+			double r = kernel(x, arr->len);
+			E_FREE(tmp);
+			e_stack_status_ret s_push = e_api_stack_push(&vm->stack, e_create_number(mean ? r / arr->len : r));
+			if(s_push.status == E_STATUS_OK) {
+				return E_API_CALL_RETURN_OK(1);
+			}
+		}
+		e_value_release(s1.val);
+	}
+	return E_API_CALL_RETURN_ERROR;
+}
 
-			e_value tmp_arr[E_MAX_ARRAYSIZE];
+/* The numeric built-ins take arrays of numbers only, anything else fails the call */
+uint32_t e_builtin_sum(e_vm* vm, uint32_t arglen) {
+	return e_builtin_reduce(vm, arglen, &e_numeric_sum, 0);
+}
+
+uint32_t e_builtin_min(e_vm* vm, uint32_t arglen) {
+	return e_builtin_reduce(vm, arglen, &e_numeric_min, 0);
+}
+
+uint32_t e_builtin_max(e_vm* vm, uint32_t arglen) {
+	return e_builtin_reduce(vm, arglen, &e_numeric_max, 0);
+}
+
+uint32_t e_builtin_mean(e_vm* vm, uint32_t arglen) {
+	/* NaN for an empty array */
+	return e_builtin_reduce(vm, arglen, &e_numeric_sum, 1);
+}
 
-			e_array_entry (*arr_ptr)[E_MAX_ARRAYSIZE] = NULL;
-			if(s1.val.aval.global_local == E_ARRAY_GLOBAL) {
-				arr_ptr = vm->arrays_global;
+uint32_t e_builtin_dot(e_vm* vm, uint32_t arglen) {
+	/* __dot(a, b) of two arrays with the same length */
+	if(arglen == 2) {
+		e_stack_status_ret s2 = e_api_stack_pop(&vm->stack);
+		e_stack_status_ret s1 = e_api_stack_pop(&vm->stack);
+		const e_array* a = s1.status == E_STATUS_OK ? e_api_read_array(vm, s1.val) : NULL;
+		const e_array* b = s2.status == E_STATUS_OK ? e_api_read_array(vm, s2.val) : NULL;
+		if(a != NULL && b != NULL && a->len == b->len) {
+			double* ta;
+			double* tb;
+			const double* x = e_builtin_numbers(a, &ta);
+			const double* y = x != NULL ? e_builtin_numbers(b, &tb) : NULL;
+			if(y != NULL) {
+				double r = e_numeric_dot(x, y, a->len);
+				E_FREE(ta);
+				E_FREE(tb);
+				e_stack_status_ret s_push = e_api_stack_push(&vm->stack, e_create_number(r));
+				if(s_push.status == E_STATUS_OK) {
+					return E_API_CALL_RETURN_OK(1);
+				}
 			} else {
-				arr_ptr = vm->arrays_local;
-			}
-			
-			for(uint32_t i = 0; i < s1.val.aval.alen; i++) {
-				tmp_arr[i] = arr_ptr[s1.val.aval.aptr][i].v;
+				E_FREE(ta);
 			}
+		}
+		e_value_release(s1.val);
+		e_value_release(s2.val);
+	}
+	return E_API_CALL_RETURN_ERROR;
+}
 
-			qsort(&tmp_arr, s1.val.aval.alen, sizeof(e_value), cmpfunc);
+uint32_t e_builtin_scale(e_vm* vm, uint32_t arglen) {
+	/* __scale(arr, k) multiplies the elements in place and returns arr */
+	if(arglen == 2) {
+		e_stack_status_ret s2 = e_api_stack_pop(&vm->stack);
+		e_stack_status_ret s1 = e_api_stack_pop(&vm->stack);
+		if(s2.status == E_STATUS_OK && s2.val.argtype == E_NUMBER && s1.status == E_STATUS_OK) {
+			e_array* arr = e_api_get_numbers(vm, s1.val);
+			if(arr != NULL) {
+				e_numeric_scale(arr->nums, arr->len, s2.val.val);
+				e_stack_status_ret s_push = e_api_stack_push(&vm->stack, s1.val);
+				if(s_push.status == E_STATUS_OK) {
+					return E_API_CALL_RETURN_OK(1);
+				}
+			}
+		}
+		e_value_release(s1.val);
+		e_value_release(s2.val);
+	}
+	return E_API_CALL_RETURN_ERROR;
+}
 
-			for(uint32_t i = 0; i < s1.val.aval.alen; i++) {
-				e_stack_status_ret s_push = e_api_stack_push(&vm->stack, tmp_arr[i]);
-				if(s_push.status != E_STATUS_OK) {
-					return E_API_CALL_RETURN_ERROR;
+uint32_t e_builtin_clamp(e_vm* vm, uint32_t arglen) {
+	/* __clamp(arr, lo, hi) limits the elements to [lo, hi] in place and returns arr */
+	if(arglen == 3) {
+		e_stack_status_ret s3 = e_api_stack_pop(&vm->stack);
+		e_stack_status_ret s2 = e_api_stack_pop(&vm->stack);
+		e_stack_status_ret s1 = e_api_stack_pop(&vm->stack);
+		if(s3.status == E_STATUS_OK && s3.val.argtype == E_NUMBER && s2.status == E_STATUS_OK && s2.val.argtype == E_NUMBER
+		   && s1.status == E_STATUS_OK) {
+			e_array* arr = e_api_get_numbers(vm, s1.val);
+			if(arr != NULL) {
+				e_numeric_clamp(arr->nums, arr->len, s2.val.val, s3.val.val);
+				e_stack_status_ret s_push = e_api_stack_push(&vm->stack, s1.val);
+				if(s_push.status == E_STATUS_OK) {
+					return E_API_CALL_RETURN_OK(1);
 				}
 			}
-			vm->pupo_is_data = s1.val.aval.alen;
-			return E_API_CALL_RETURN_OK(s1.val.aval.alen);
 		}
+		e_value_release(s1.val);
+		e_value_release(s2.val);
+		e_value_release(s3.val);
 	}
 	return E_API_CALL_RETURN_ERROR;
 }
@@ -108,18 +237,25 @@ uint32_t e_builtin_sort(e_vm* vm, uint32_t arglen) {
 uint32_t e_builtin_array(e_vm* vm, uint32_t arglen) {
 	if(arglen == 1) {
 		e_stack_status_ret s1 = e_api_stack_pop(&vm->stack);
-		if(s1.status == E_STATUS_OK && s1.val.argtype == E_NUMBER) {
-			for(uint32_t i = 0; i < s1.val.val; i++) {
-				e_stack_status_ret s_push = e_api_stack_push(&vm->stack, e_create_number(0));
-				if(s_push.status != E_STATUS_OK) {
-					return E_API_CALL_RETURN_ERROR;
+		if(s1.status == E_STATUS_OK && s1.val.argtype == E_NUMBER && s1.val.val >= 0 && s1.val.val <= INT32_MAX) {
+			/* The array is created directly, its size is not limited by the stack but by the vm's array_len */
+			uint32_t len = s1.val.val;
+			if(len > vm->config.array_len) {
+				return E_API_CALL_RETURN_ERROR;
+			}
+
+			e_value arr = e_create_numbers(vm, len);
+			if(arr.argtype == E_ARRAY) {
+				e_stack_status_ret s_push = e_api_stack_push(&vm->stack, arr);
+				if(s_push.status == E_STATUS_OK) {
+					return E_API_CALL_RETURN_OK(1);
 				}
 			}
-			vm->pupo_is_data = s1.val.val;
-			return E_API_CALL_RETURN_OK(0);
+			return E_API_CALL_RETURN_ERROR;
 		}
+		e_value_release(s1.val);
 	}
-	return 0;
+	return E_API_CALL_RETURN_ERROR;
 }
 
 #if 0
@@ -9,6 +9,7 @@
 
 #define E_API_CALL_RETURN_OK(v)	((uint32_t)1 + v)
 #define E_API_CALL_RETURN_ERROR	((uint32_t)0)
+#define E_API_CALL_RETURN_PENDING	((uint32_t)0x7FFFFFFF)	/* Finished later with e_vm_complete */
 
 // Built-ins
 uint32_t e_builtin_print(e_vm* vm, uint32_t arglen);
@@ -16,6 +17,13 @@ uint32_t e_builtin_argtype(e_vm* vm, uint32_t arglen);
 uint32_t e_builtin_len(e_vm* vm, uint32_t arglen);
 uint32_t e_builtin_sort(e_vm* vm, uint32_t arglen);
 uint32_t e_builtin_array(e_vm* vm, uint32_t arglen);
+uint32_t e_builtin_sum(e_vm* vm, uint32_t arglen);
+uint32_t e_builtin_min(e_vm* vm, uint32_t arglen);
+uint32_t e_builtin_max(e_vm* vm, uint32_t arglen);
+uint32_t e_builtin_mean(e_vm* vm, uint32_t arglen);
+uint32_t e_builtin_dot(e_vm* vm, uint32_t arglen);
+uint32_t e_builtin_scale(e_vm* vm, uint32_t arglen);
+uint32_t e_builtin_clamp(e_vm* vm, uint32_t arglen);
 
 // User implemented callbacks
 uint8_t e_read_byte(uint32_t offset);
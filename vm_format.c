@@ -0,0 +1,328 @@
+//
+// es_vm
+//
+
+#include <string.h>
+#include "vm.h"
+
+// Shortest decimal form of a double that reads back to the same value (Grisu2, see Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers"), integral values take a plain integer path
+
+#define E_FP_HIDDEN_BIT		((uint64_t)0x0010000000000000)
+#define E_FP_SIGNIFICAND	((uint64_t)0x000FFFFFFFFFFFFF)
+#define E_FP_EXPONENT		((uint64_t)0x7FF0000000000000)
+#define E_FP_EXPONENT_BIAS	(0x3FF + 52)
+
+#define E_FP_MAX_INTEGER	9007199254740992.0	/* 2^53 */
+
+typedef struct {
+	uint64_t f;
+	int32_t e;
+} e_fp;
+
+/* 10^k normalized to 64 bits for k = -348, -340, ..., 340 */
+static const e_fp e_fp_cached_powers[] = {
+	{ 0xFA8FD5A0081C0288ULL, -1220 }, { 0xBAAEE17FA23EBF76ULL, -1193 }, { 0x8B16FB203055AC76ULL, -1166 },
+	{ 0xCF42894A5DCE35EAULL, -1140 }, { 0x9A6BB0AA55653B2DULL, -1113 }, { 0xE61ACF033D1A45DFULL, -1087 },
+	{ 0xAB70FE17C79AC6CAULL, -1060 }, { 0xFF77B1FCBEBCDC4FULL, -1034 }, { 0xBE5691EF416BD60CULL, -1007 },
+	{ 0x8DD01FAD907FFC3CULL, -980 }, { 0xD3515C2831559A83ULL, -954 }, { 0x9D71AC8FADA6C9B5ULL, -927 },
+	{ 0xEA9C227723EE8BCBULL, -901 }, { 0xAECC49914078536DULL, -874 }, { 0x823C12795DB6CE57ULL, -847 },
+	{ 0xC21094364DFB5637ULL, -821 }, { 0x9096EA6F3848984FULL, -794 }, { 0xD77485CB25823AC7ULL, -768 },
+	{ 0xA086CFCD97BF97F4ULL, -741 }, { 0xEF340A98172AACE5ULL, -715 }, { 0xB23867FB2A35B28EULL, -688 },
+	{ 0x84C8D4DFD2C63F3BULL, -661 }, { 0xC5DD44271AD3CDBAULL, -635 }, { 0x936B9FCEBB25C996ULL, -608 },
+	{ 0xDBAC6C247D62A584ULL, -582 }, { 0xA3AB66580D5FDAF6ULL, -555 }, { 0xF3E2F893DEC3F126ULL, -529 },
+	{ 0xB5B5ADA8AAFF80B8ULL, -502 }, { 0x87625F056C7C4A8BULL, -475 }, { 0xC9BCFF6034C13053ULL, -449 },
+	{ 0x964E858C91BA2655ULL, -422 }, { 0xDFF9772470297EBDULL, -396 }, { 0xA6DFBD9FB8E5B88FULL, -369 },
+	{ 0xF8A95FCF88747D94ULL, -343 }, { 0xB94470938FA89BCFULL, -316 }, { 0x8A08F0F8BF0F156BULL, -289 },
+	{ 0xCDB02555653131B6ULL, -263 }, { 0x993FE2C6D07B7FACULL, -236 }, { 0xE45C10C42A2B3B06ULL, -210 },
+	{ 0xAA242499697392D3ULL, -183 }, { 0xFD87B5F28300CA0EULL, -157 }, { 0xBCE5086492111AEBULL, -130 },
+	{ 0x8CBCCC096F5088CCULL, -103 }, { 0xD1B71758E219652CULL, -77 }, { 0x9C40000000000000ULL, -50 },
+	{ 0xE8D4A51000000000ULL, -24 }, { 0xAD78EBC5AC620000ULL, 3 }, { 0x813F3978F8940984ULL, 30 },
+	{ 0xC097CE7BC90715B3ULL, 56 }, { 0x8F7E32CE7BEA5C70ULL, 83 }, { 0xD5D238A4ABE98068ULL, 109 },
+	{ 0x9F4F2726179A2245ULL, 136 }, { 0xED63A231D4C4FB27ULL, 162 }, { 0xB0DE65388CC8ADA8ULL, 189 },
+	{ 0x83C7088E1AAB65DBULL, 216 }, { 0xC45D1DF942711D9AULL, 242 }, { 0x924D692CA61BE758ULL, 269 },
+	{ 0xDA01EE641A708DEAULL, 295 }, { 0xA26DA3999AEF774AULL, 322 }, { 0xF209787BB47D6B85ULL, 348 },
+	{ 0xB454E4A179DD1877ULL, 375 }, { 0x865B86925B9BC5C2ULL, 402 }, { 0xC83553C5C8965D3DULL, 428 },
+	{ 0x952AB45CFA97A0B3ULL, 455 }, { 0xDE469FBD99A05FE3ULL, 481 }, { 0xA59BC234DB398C25ULL, 508 },
+	{ 0xF6C69A72A3989F5CULL, 534 }, { 0xB7DCBF5354E9BECEULL, 561 }, { 0x88FCF317F22241E2ULL, 588 },
+	{ 0xCC20CE9BD35C78A5ULL, 614 }, { 0x98165AF37B2153DFULL, 641 }, { 0xE2A0B5DC971F303AULL, 667 },
+	{ 0xA8D9D1535CE3B396ULL, 694 }, { 0xFB9B7CD9A4A7443CULL, 720 }, { 0xBB764C4CA7A44410ULL, 747 },
+	{ 0x8BAB8EEFB6409C1AULL, 774 }, { 0xD01FEF10A657842CULL, 800 }, { 0x9B10A4E5E9913129ULL, 827 },
+	{ 0xE7109BFBA19C0C9DULL, 853 }, { 0xAC2820D9623BF429ULL, 880 }, { 0x80444B5E7AA7CF85ULL, 907 },
+	{ 0xBF21E44003ACDD2DULL, 933 }, { 0x8E679C2F5E44FF8FULL, 960 }, { 0xD433179D9C8CB841ULL, 986 },
+	{ 0x9E19DB92B4E31BA9ULL, 1013 }, { 0xEB96BF6EBADF77D9ULL, 1039 }, { 0xAF87023B9BF0EE6BULL, 1066 },
+};
+
+static const uint32_t e_fp_pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+
+static const char e_digit_pairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static e_fp e_fp_from_double(double d);
+static e_fp e_fp_normalize(e_fp x);
+static e_fp e_fp_mul(e_fp x, e_fp y);
+static void e_fp_boundaries(e_fp v, e_fp* minus, e_fp* plus);
+static e_fp e_fp_cached_power(int32_t e, int32_t* k);
+static uint32_t e_fp_count_digits(uint32_t n);
+static void e_grisu_round(char* buf, uint32_t len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w);
+static uint32_t e_grisu_digits(e_fp w, e_fp mp, uint64_t delta, char* buf, int32_t* k);
+static uint32_t e_grisu2(double d, char* buf, int32_t* k);
+static uint32_t e_format_exponent(int32_t k, char* dst);
+static uint32_t e_format_decimal(char* buf, uint32_t len, int32_t k);
+static uint32_t e_format_integer(uint64_t n, char* dst);
+
+e_fp
+e_fp_from_double(double d) {
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+	int32_t biased = (int32_t)((u & E_FP_EXPONENT) >> 52);
+	uint64_t significand = u & E_FP_SIGNIFICAND;
+	if(biased != 0) return (e_fp) { significand + E_FP_HIDDEN_BIT, biased - E_FP_EXPONENT_BIAS };
+	return (e_fp) { significand, 1 - E_FP_EXPONENT_BIAS };
+}
+
+e_fp
+e_fp_normalize(e_fp x) {
+#if defined(__GNUC__) || defined(__clang__)
+	int32_t s = __builtin_clzll(x.f);
+	x.f <<= s;
+	x.e -= s;
+#else
+	while(!(x.f & ((uint64_t)1 << 63))) {
+		x.f <<= 1;
+		x.e--;
+	}
+#endif
+	return x;
+}
+
+e_fp
+e_fp_mul(e_fp x, e_fp y) {
+	/* Upper 64 bits of the 128 bit product, rounded */
+	uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFF;
+	uint64_t c = y.f >> 32, d = y.f & 0xFFFFFFFF;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t mid = (bd >> 32) + (ad & 0xFFFFFFFF) + (bc & 0xFFFFFFFF) + ((uint64_t)1 << 31);
+	return (e_fp) { ac + (ad >> 32) + (bc >> 32) + (mid >> 32), x.e + y.e + 64 };
+}
+
+void
+e_fp_boundaries(e_fp v, e_fp* minus, e_fp* plus) {
+	/* Halfway points to the neighbouring doubles, the lower gap is smaller at a power of two */
+	e_fp pl = e_fp_normalize((e_fp) { (v.f << 1) + 1, v.e - 1 });
+	e_fp mi = v.f == E_FP_HIDDEN_BIT ? (e_fp) { (v.f << 2) - 1, v.e - 2 } : (e_fp) { (v.f << 1) - 1, v.e - 1 };
+	mi.f <<= mi.e - pl.e;
+	mi.e = pl.e;
+	*minus = mi;
+	*plus = pl;
+}
+
+e_fp
+e_fp_cached_power(int32_t e, int32_t* k) {
+	/* Power that scales the binary exponent into [-60, -32] */
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int32_t ik = (int32_t)dk;
+	if(dk - ik > 0.0) ik++;
+	uint32_t index = (uint32_t)((ik >> 3) + 1);
+	*k = -(-348 + (int32_t)index * 8);
+	return e_fp_cached_powers[index];
+}
+
+uint32_t
+e_fp_count_digits(uint32_t n) {
+	uint32_t d = 1;
+	while(d < 10 && n >= e_fp_pow10[d]) d++;
+	return d;
+}
+
+void
+e_grisu_round(char* buf, uint32_t len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+	/* Move the last digit towards the exact value while it stays inside the rounding interval */
+	while(rest < wp_w && delta - rest >= ten_kappa && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+uint32_t
+e_grisu_digits(e_fp w, e_fp mp, uint64_t delta, char* buf, int32_t* k) {
+	const int32_t shift = -mp.e;
+	const uint64_t one = (uint64_t)1 << shift;
+	const uint64_t wp_w = mp.f - w.f;
+	uint32_t p1 = (uint32_t)(mp.f >> shift);
+	uint64_t p2 = mp.f & (one - 1);
+	int32_t kappa = (int32_t)e_fp_count_digits(p1);
+	uint32_t len = 0;
+
+	while(kappa > 0) {
+		uint32_t div = e_fp_pow10[kappa - 1];
+		uint32_t d = p1 / div;
+		p1 %= div;
+		if(d || len) buf[len++] = (char)('0' + d);
+		kappa--;
+		uint64_t rest = ((uint64_t)p1 << shift) + p2;
+		if(rest <= delta) {
+			*k += kappa;
+			e_grisu_round(buf, len, delta, rest, (uint64_t)e_fp_pow10[kappa] << shift, wp_w);
+			return len;
+		}
+	}
+	for(;;) {
+		p2 *= 10;
+		delta *= 10;
+		char d = (char)(p2 >> shift);
+		if(d || len) buf[len++] = (char)('0' + d);
+		p2 &= one - 1;
+		kappa--;
+		if(p2 < delta) {
+			*k += kappa;
+			e_grisu_round(buf, len, delta, p2, one, -kappa < 10 ? wp_w * e_fp_pow10[-kappa] : 0);
+			return len;
+		}
+	}
+}
+
+uint32_t
+e_grisu2(double d, char* buf, int32_t* k) {
+	/* Digits of a finite d > 0, the value is digits * 10^k */
+	e_fp v = e_fp_from_double(d);
+	e_fp w_m, w_p;
+	e_fp_boundaries(v, &w_m, &w_p);
+
+	e_fp c_mk = e_fp_cached_power(w_p.e, k);
+	e_fp w = e_fp_mul(e_fp_normalize(v), c_mk);
+	e_fp wp = e_fp_mul(w_p, c_mk);
+	e_fp wm = e_fp_mul(w_m, c_mk);
+	wm.f++;
+	wp.f--;
+	return e_grisu_digits(w, wp, wp.f - wm.f, buf, k);
+}
+
+uint32_t
+e_format_exponent(int32_t k, char* dst) {
+	uint32_t n = 0;
+	dst[n++] = 'e';
+	if(k < 0) {
+		dst[n++] = '-';
+		k = -k;
+	} else {
+		dst[n++] = '+';
+	}
+	if(k >= 100) {
+		dst[n++] = (char)('0' + k / 100);
+		k %= 100;
+		memcpy(dst + n, e_digit_pairs + k * 2, 2);
+		n += 2;
+	} else if(k >= 10) {
+		memcpy(dst + n, e_digit_pairs + k * 2, 2);
+		n += 2;
+	} else {
+		dst[n++] = (char)('0' + k);
+	}
+	return n;
+}
+
+uint32_t
+e_format_decimal(char* buf, uint32_t len, int32_t k) {
+	/* Lays out digits * 10^k in place: fixed notation for 1e-6 <= v < 1e21, scientific otherwise */
+	const int32_t kk = (int32_t)len + k;
+	if(k >= 0 && kk <= 21) {
+		/* 1234e7 -> 12340000000 */
+		memset(buf + len, '0', (size_t)k);
+		return (uint32_t)kk;
+	}
+	if(kk > 0 && kk <= 21) {
+		/* 1234e-2 -> 12.34 */
+		memmove(buf + kk + 1, buf + kk, len - (uint32_t)kk);
+		buf[kk] = '.';
+		return len + 1;
+	}
+	if(kk > -6 && kk <= 0) {
+		/* 1234e-6 -> 0.001234 */
+		uint32_t offset = (uint32_t)(2 - kk);
+		memmove(buf + offset, buf, len);
+		buf[0] = '0';
+		buf[1] = '.';
+		memset(buf + 2, '0', offset - 2);
+		return len + offset;
+	}
+	if(len == 1) {
+		/* 1e30 */
+		return 1 + e_format_exponent(kk - 1, buf + 1);
+	}
+	/* 1234e30 -> 1.234e+33 */
+	memmove(buf + 2, buf + 1, len - 1);
+	buf[1] = '.';
+	return len + 1 + e_format_exponent(kk - 1, buf + len + 1);
+}
+
+uint32_t
+e_format_integer(uint64_t n, char* dst) {
+	char tmp[20];
+	uint32_t pos = sizeof(tmp);
+	while(n >= 100) {
+		uint32_t r = (uint32_t)(n % 100);
+		n /= 100;
+		pos -= 2;
+		memcpy(tmp + pos, e_digit_pairs + r * 2, 2);
+	}
+	if(n >= 10) {
+		pos -= 2;
+		memcpy(tmp + pos, e_digit_pairs + n * 2, 2);
+	} else {
+		tmp[--pos] = (char)('0' + n);
+	}
+	memcpy(dst, tmp + pos, sizeof(tmp) - pos);
+	return sizeof(tmp) - pos;
+}
+
+uint32_t
+e_format_number(double d, char* dst) {
+	/* Writes at most E_NUMBER_STRLEN bytes, no terminator */
+	if(d != d) {
+		memcpy(dst, "nan", 3);
+		return 3;
+	}
+
+	uint32_t n = 0;
+	if(d < 0) {
+		dst[n++] = '-';
+		d = -d;
+	}
+	if(d == 0) {
+		/* -0 is printed as 0 */
+		dst[0] = '0';
+		return 1;
+	}
+	if(d > 1.7976931348623157e308) {
+		memcpy(dst + n, "inf", 3);
+		return n + 3;
+	}
+	if(d <= E_FP_MAX_INTEGER && d == (double)(uint64_t)d) {
+		return n + e_format_integer((uint64_t)d, dst + n);
+	}
+
+	int32_t k;
+	uint32_t len = e_grisu2(d, dst + n, &k);
+	return n + e_format_decimal(dst + n, len, k);
+}
+
+e_value
+e_api_number_to_string(e_vm* vm, double d) {
+	e_str_type* str = e_str_alloc(vm != NULL ? &vm->strings : NULL, E_NUMBER_STRLEN);
+	if(str == NULL) {
+		return (e_value) { 0 };
+	}
+	e_str_truncate(str, e_format_number(d, (char*)str->sval));
+
+	return (e_value) { .sval = str, .argtype = E_STRING };
+}
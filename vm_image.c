@@ -0,0 +1,515 @@
+//
+// es_vm
+//
+
+#include <string.h>
+#include "vm.h"
+#include "vm_builtins.h"
+
+// Binary image, little endian: header, string table, array lengths, then the values of the stack, the globals,
+// the locals, the used frame slots, the elements of all arrays and the name of a pending call
+#define E_IMAGE_MAGIC	((uint32_t)0x4D565345)	/* "ESVM" */
+#define E_IMAGE_VERSION	((uint32_t)1)
+
+#define E_IMAGE_ALIGN(n)	(((n) + (size_t)7) & ~(size_t)7)
+
+typedef struct {
+	uint8_t* buf;
+	uint32_t len;
+	uint32_t cap;
+	uint8_t ok;
+} e_image_writer;
+
+typedef struct {
+	const uint8_t* buf;
+	uint32_t len;
+	uint32_t pos;
+	uint8_t ok;
+} e_image_reader;
+
+// Strings of a snapshot, equal strings are written once
+typedef struct {
+	const e_str_type** strs;
+	uint32_t count;
+	uint32_t* table;    /* Open addressing, index + 1 */
+	uint32_t cap;
+} e_image_strings;
+
+static void e_image_put(e_image_writer* w, const void* p, uint32_t n);
+static void e_image_put_u32(e_image_writer* w, uint32_t v);
+static void e_image_put_u64(e_image_writer* w, uint64_t v);
+static void e_image_put_value(e_image_writer* w, e_image_strings* s, e_value v);
+static uint32_t e_image_intern(e_image_strings* s, const e_str_type* str);
+static uint32_t e_image_hash(const uint8_t* p, uint32_t len);
+static const uint8_t* e_image_get(e_image_reader* r, uint32_t n);
+static uint32_t e_image_get_u32(e_image_reader* r);
+static uint64_t e_image_get_u64(e_image_reader* r);
+static e_value e_image_get_value(e_image_reader* r, e_str_type** strs, uint32_t scount, uint32_t acount);
+static uint8_t e_image_decode(e_vm_image* img);
+static uint8_t e_image_numbers(const e_value* values, uint32_t len);
+static uint32_t e_image_slots(const e_vm* vm);
+
+uint8_t
+e_vm_snapshot(const e_vm* vm, e_vm_image* img) {
+	/* Writes the state of vm to img->bytes and decodes it, the program is not part of the image */
+	if(vm == NULL || img == NULL) return 0;
+	*img = (e_vm_image) { 0 };
+
+	/* A vm that never ran has no storage yet */
+	uint32_t nglobals = vm->globals != NULL ? vm->config.globals : 0;
+	uint32_t nlocals = vm->locals != NULL ? vm->config.locals : 0;
+	uint32_t nslots = e_image_slots(vm);
+	uint8_t waiting = vm->status == E_VM_STATUS_WAITING;
+	uint64_t nvalues = (uint64_t)vm->stack.top + nglobals + nlocals + nslots + waiting;
+	for(uint32_t a = 0; a < vm->acount; a++) {
+		nvalues += vm->arrays[a].len;
+	}
+	if(nvalues > UINT32_MAX / 4) return 0;
+
+	/* Every value can be a string, the table stays at most half full */
+	e_image_strings s = { 0 };
+	s.cap = 16;
+	while(s.cap < nvalues * 2) s.cap *= 2;
+	s.strs = E_MALLOC(sizeof(e_str_type*) * nvalues + 1);
+	s.table = E_MALLOC(sizeof(uint32_t) * s.cap);
+	e_image_writer w = { .ok = s.strs != NULL && s.table != NULL };
+	e_image_writer body = { .ok = w.ok };
+	if(!w.ok) goto error;
+	memset(s.table, 0, sizeof(uint32_t) * s.cap);
+
+	/* The values first, the string table is complete after them */
+	for(uint32_t i = 0; i < vm->stack.top; i++) e_image_put_value(&body, &s, vm->stack.entries[i]);
+	for(uint32_t i = 0; i < nglobals; i++) e_image_put_value(&body, &s, vm->globals[i]);
+	for(uint32_t i = 0; i < nlocals; i++) e_image_put_value(&body, &s, vm->locals[i]);
+	for(uint32_t i = 0; i < nslots; i++) e_image_put_value(&body, &s, vm->frame_slots[i]);
+	for(uint32_t a = 0; a < vm->acount; a++) {
+		const e_array* arr = &vm->arrays[a];
+		for(uint32_t i = 0; i < arr->len; i++) {
+			e_image_put_value(&body, &s, arr->items != NULL ? arr->items[i] : e_create_number(arr->nums[i]));
+		}
+	}
+	if(waiting) e_image_put_value(&body, &s, vm->pending.name);
+
+	e_image_put_u32(&w, E_IMAGE_MAGIC);
+	e_image_put_u32(&w, E_IMAGE_VERSION);
+	e_image_put_u32(&w, nglobals);
+	e_image_put_u32(&w, nlocals);
+	e_image_put_u32(&w, vm->prog != NULL ? vm->prog->count : 0);
+	e_image_put_u32(&w, (uint32_t)vm->status);
+	e_image_put_u32(&w, vm->ip);
+	e_image_put_u64(&w, vm->executed);
+	e_image_put_u32(&w, vm->unchecked);
+	e_image_put_u32(&w, vm->pupo_is_data);
+	e_image_put_u32(&w, (uint32_t)vm->pupo_arr_index);
+	e_image_put_u32(&w, waiting ? vm->pending.argsbefore : 0);
+	e_image_put_u32(&w, waiting ? vm->pending.arglen : 0);
+	e_image_put_u32(&w, vm->cfcnt);
+	for(uint32_t c = 0; c < vm->cfcnt; c++) {
+		e_image_put_u32(&w, vm->callframes[c].retAddr);
+		e_image_put_u32(&w, vm->callframes[c].base);
+		e_image_put_u32(&w, vm->callframes[c].size);
+	}
+	e_image_put_u32(&w, vm->stack.top);
+	e_image_put_u32(&w, nslots);
+	e_image_put_u32(&w, s.count);
+	e_image_put_u32(&w, vm->acount);
+	for(uint32_t i = 0; i < s.count; i++) {
+		e_image_put_u32(&w, s.strs[i]->slen);
+		e_image_put(&w, s.strs[i]->sval, s.strs[i]->slen);
+	}
+	for(uint32_t a = 0; a < vm->acount; a++) {
+		e_image_put_u32(&w, vm->arrays[a].len);
+	}
+	if(body.ok) e_image_put(&w, body.buf, body.len);
+	if(!w.ok || !body.ok) goto error;
+
+	E_FREE(body.buf);
+	E_FREE(s.strs);
+	E_FREE(s.table);
+	img->bytes = w.buf;
+	img->size = w.len;
+	if(!e_image_decode(img)) {
+		e_vm_image_free(img);
+		return 0;
+	}
+	return 1;
+
+error:
+	e_fail("Cannot snapshot the vm");
+	E_FREE(w.buf);
+	E_FREE(body.buf);
+	E_FREE(s.strs);
+	E_FREE(s.table);
+	return 0;
+}
+
+uint8_t
+e_vm_image_load(e_vm_image* img, const uint8_t* bytes, uint32_t size) {
+	/* Copies and decodes an image written by e_vm_snapshot (img->bytes) */
+	if(img == NULL || bytes == NULL) return 0;
+	*img = (e_vm_image) { 0 };
+
+	img->bytes = E_MALLOC(size + 1);
+	if(img->bytes == NULL) return 0;
+	memcpy(img->bytes, bytes, size);
+	img->size = size;
+	if(!e_image_decode(img)) {
+		e_vm_image_free(img);
+		return 0;
+	}
+	return 1;
+}
+
+void
+e_vm_image_free(e_vm_image* img) {
+	/* No vm restored from img may use it anymore */
+	if(img == NULL) return;
+	E_FREE(img->bytes);
+	E_FREE(img->values);
+	E_FREE(img->numbers);
+	E_FREE(img->arrays);
+	E_FREE(img->strings);
+	*img = (e_vm_image) { 0 };
+}
+
+e_vm_status
+e_vm_restore(e_vm* vm, const e_vm_image* img, const e_program* prog) {
+	/* Resets vm to the state of img, prog has to be the program the snapshot was taken with.
+	   Strings and array elements are shared with img, an array is copied to the vm when it is changed first */
+	if(vm == NULL || img == NULL || img->values == NULL) return E_VM_STATUS_ERROR;
+	if((img->code_count != 0 && (prog == NULL || prog->count != img->code_count))
+	   || (prog != NULL && img->ip > prog->count) || (prog == NULL && img->cfcnt > 0)) {
+		e_fail("The vm image belongs to another program");
+		return E_VM_STATUS_ERROR;
+	}
+
+	if(img->nglobals > vm->config.globals || img->nlocals > vm->config.locals || img->top >= vm->config.stack_size
+	   || img->cfcnt >= vm->config.callframes || img->nslots > vm->config.frame_slots || img->acount > vm->config.arrays) {
+		e_fail("The vm image does not fit the vm's limits");
+		return E_VM_STATUS_ERROR;
+	}
+
+	/* Images are untrusted, every frame has to lie within the restored slots and return into prog */
+	for(uint32_t c = 0; c < img->cfcnt; c++) {
+		const e_callframe* f = &img->callframes[c];
+		if(f->base > img->nslots || f->size > img->nslots - f->base || f->retAddr > prog->count) {
+			e_fail("The vm image has an invalid call frame");
+			return E_VM_STATUS_ERROR;
+		}
+	}
+
+	e_vm_reset(vm);
+	if(!e_vm_alloc(vm)) return E_VM_STATUS_ERROR;
+	if(img->cfcnt > 0 && vm->frame_slots == NULL) {
+		vm->frame_slots = E_MALLOC(sizeof(e_value) * vm->config.frame_slots);
+		if(vm->frame_slots == NULL) return E_VM_STATUS_ERROR;
+		memset(vm->frame_slots, 0, sizeof(e_value) * vm->config.frame_slots);
+	}
+
+	const e_value* v = img->values;
+	memcpy(vm->stack.entries, v, sizeof(e_value) * img->top);
+	v += img->top;
+	memcpy(vm->globals, v, sizeof(e_value) * img->nglobals);
+	v += img->nglobals;
+	memcpy(vm->locals, v, sizeof(e_value) * img->nlocals);
+	v += img->nlocals;
+	if(img->nslots > 0) memcpy(vm->frame_slots, v, sizeof(e_value) * img->nslots);
+
+	if(img->acount > 0) {
+		vm->arrays = e_arena_alloc(&vm->arena, sizeof(e_array) * img->acount);
+		if(vm->arrays == NULL) {
+			e_vm_reset(vm);
+			return E_VM_STATUS_ERROR;
+		}
+		memcpy(vm->arrays, img->arrays, sizeof(e_array) * img->acount);
+		vm->acount = img->acount;
+		vm->acap = img->acount;
+	}
+
+	vm->stack.top = img->top;
+	vm->cfcnt = img->cfcnt;
+	memcpy(vm->callframes, img->callframes, sizeof(e_callframe) * img->cfcnt);
+	vm->ip = img->ip;
+	vm->executed = img->executed;
+	vm->pupo_is_data = img->pupo_is_data;
+	vm->pupo_arr_index = img->pupo_arr_index;
+	vm->pending = img->pending;
+	vm->status = img->status;
+	vm->prog = prog;
+	/* Continues checked, e_vm_run_steps decides when the program can run unchecked again */
+	vm->unchecked = 0;
+	return vm->status;
+}
+
+// Writing
+void
+e_image_put(e_image_writer* w, const void* p, uint32_t n) {
+	if(!w->ok) return;
+	if(n > w->cap - w->len) {
+		uint64_t ncap = w->cap ? (uint64_t)w->cap * 2 : 256;
+		while(ncap < (uint64_t)w->len + n) ncap *= 2;
+		uint8_t* buf = ncap <= UINT32_MAX ? E_REALLOC(w->buf, ncap) : NULL;
+		if(buf == NULL) {
+			w->ok = 0;
+			return;
+		}
+		w->buf = buf;
+		w->cap = (uint32_t)ncap;
+	}
+	if(n > 0) memcpy(w->buf + w->len, p, n);
+	w->len += n;
+}
+
+void
+e_image_put_u32(e_image_writer* w, uint32_t v) {
+	uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+	e_image_put(w, b, 4);
+}
+
+void
+e_image_put_u64(e_image_writer* w, uint64_t v) {
+	e_image_put_u32(w, (uint32_t)v);
+	e_image_put_u32(w, (uint32_t)(v >> 32));
+}
+
+void
+e_image_put_value(e_image_writer* w, e_image_strings* s, e_value v) {
+	/* The type, then a double, a string table index or an array index. Cleared slots (type 0) have no payload */
+	uint8_t t = (uint8_t)v.argtype;
+	e_image_put(w, &t, 1);
+	switch(v.argtype) {
+		case E_NUMBER: {
+			uint64_t bits;
+			memcpy(&bits, &v.val, sizeof(bits));
+			e_image_put_u64(w, bits);
+			break;
+		}
+		case E_STRING:
+			e_image_put_u32(w, e_image_intern(s, v.sval));
+			break;
+		case E_ARRAY:
+			e_image_put_u32(w, v.aval.aptr);
+			break;
+		default:
+			break;
+	}
+}
+
+uint32_t
+e_image_intern(e_image_strings* s, const e_str_type* str) {
+	uint32_t h = e_image_hash(str->sval, str->slen) & (s->cap - 1);
+	while(s->table[h] != 0) {
+		const e_str_type* o = s->strs[s->table[h] - 1];
+		if(o == str || (o->slen == str->slen && memcmp(o->sval, str->sval, str->slen) == 0)) return s->table[h] - 1;
+		h = (h + 1) & (s->cap - 1);
+	}
+	s->strs[s->count] = str;
+	s->table[h] = ++s->count;
+	return s->count - 1;
+}
+
+uint32_t
+e_image_hash(const uint8_t* p, uint32_t len) {
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for(uint32_t i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+uint32_t
+e_image_slots(const e_vm* vm) {
+	/* Frame slots in use, the slots above the innermost frame are unused */
+	uint32_t n = 0;
+	for(uint32_t c = 0; c < vm->cfcnt; c++) {
+		uint32_t end = vm->callframes[c].base + vm->callframes[c].size;
+		if(end > n) n = end;
+	}
+	return n;
+}
+
+// Reading
+const uint8_t*
+e_image_get(e_image_reader* r, uint32_t n) {
+	if(!r->ok || n > r->len - r->pos) {
+		r->ok = 0;
+		return NULL;
+	}
+	const uint8_t* p = r->buf + r->pos;
+	r->pos += n;
+	return p;
+}
+
+uint32_t
+e_image_get_u32(e_image_reader* r) {
+	const uint8_t* b = e_image_get(r, 4);
+	if(b == NULL) return 0;
+	return (uint32_t)b[0] | ((uint32_t)b[1] << 8) | ((uint32_t)b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+uint64_t
+e_image_get_u64(e_image_reader* r) {
+	uint64_t lo = e_image_get_u32(r);
+	return lo | ((uint64_t)e_image_get_u32(r) << 32);
+}
+
+e_value
+e_image_get_value(e_image_reader* r, e_str_type** strs, uint32_t scount, uint32_t acount) {
+	const uint8_t* t = e_image_get(r, 1);
+	if(t == NULL) return (e_value) { 0 };
+
+	switch(*t) {
+		case 0:
+			return (e_value) { 0 };
+		case E_NUMBER: {
+			uint64_t bits = e_image_get_u64(r);
+			double d;
+			memcpy(&d, &bits, sizeof(d));
+			return e_create_number(d);
+		}
+		case E_STRING: {
+			uint32_t i = e_image_get_u32(r);
+			if(i < scount) return (e_value) { .sval = strs[i], .argtype = E_STRING };
+			break;
+		}
+		case E_ARRAY: {
+			uint32_t i = e_image_get_u32(r);
+			if(i < acount) return (e_value) { .aval.aptr = i, .argtype = E_ARRAY };
+			break;
+		}
+		default:
+			break;
+	}
+	r->ok = 0;
+	return (e_value) { 0 };
+}
+
+uint8_t
+e_image_numbers(const e_value* values, uint32_t len) {
+	for(uint32_t i = 0; i < len; i++) {
+		if(values[i].argtype != E_NUMBER) return 0;
+	}
+	return 1;
+}
+
+uint8_t
+e_image_decode(e_vm_image* img) {
+	/* Decodes img->bytes into the values shared by the restored vms, the strings become static */
+	e_image_reader r = { .buf = img->bytes, .len = img->size, .ok = 1 };
+	e_str_type** strs = NULL;
+
+	if(e_image_get_u32(&r) != E_IMAGE_MAGIC || e_image_get_u32(&r) != E_IMAGE_VERSION) goto error;
+	img->nglobals = e_image_get_u32(&r);
+	img->nlocals = e_image_get_u32(&r);
+	if(img->nglobals > E_MAX_GLOBALS || img->nlocals > E_MAX_LOCALS) goto error;
+
+	img->code_count = e_image_get_u32(&r);
+	img->status = (e_vm_status)(int32_t)e_image_get_u32(&r);
+	img->ip = e_image_get_u32(&r);
+	img->executed = e_image_get_u64(&r);
+	img->unchecked = e_image_get_u32(&r) != 0;
+	img->pupo_is_data = e_image_get_u32(&r);
+	img->pupo_arr_index = (int32_t)e_image_get_u32(&r);
+	img->pending.argsbefore = e_image_get_u32(&r);
+	img->pending.arglen = e_image_get_u32(&r);
+	img->cfcnt = e_image_get_u32(&r);
+	if(img->cfcnt > E_MAX_CALLFRAMES) goto error;
+	for(uint32_t c = 0; c < img->cfcnt; c++) {
+		e_callframe* f = &img->callframes[c];
+		f->retAddr = e_image_get_u32(&r);
+		f->base = e_image_get_u32(&r);
+		f->size = e_image_get_u32(&r);
+		if(f->base > E_FRAME_STACK_SIZE || f->size > E_FRAME_STACK_SIZE - f->base) goto error;
+	}
+	img->top = e_image_get_u32(&r);
+	img->nslots = e_image_get_u32(&r);
+	uint32_t scount = e_image_get_u32(&r);
+	img->acount = e_image_get_u32(&r);
+	if(!r.ok || img->top > E_STACK_SIZE || img->nslots > E_FRAME_STACK_SIZE
+	   || img->status < E_VM_STATUS_ERROR || img->status > E_VM_STATUS_WAITING) goto error;
+
+	/* Every string and array takes at least 4 bytes, so the counts are bounded by the size */
+	if(scount > (r.len - r.pos) / 4 || img->acount > (r.len - r.pos) / 4) goto error;
+	strs = E_MALLOC(sizeof(e_str_type*) * scount + 1);
+	if(strs == NULL) goto error;
+
+	/* All strings in one block, never freed by their references */
+	uint32_t start = r.pos;
+	size_t ssize = 0;
+	for(uint32_t i = 0; i < scount && r.ok; i++) {
+		uint32_t slen = e_image_get_u32(&r);
+		e_image_get(&r, slen);
+		ssize += E_IMAGE_ALIGN(sizeof(e_str_type) + (size_t)slen + 1);
+	}
+	if(!r.ok) goto error;
+	img->strings = E_MALLOC(ssize + 1);
+	if(img->strings == NULL) goto error;
+	r.pos = start;
+	uint8_t* p = img->strings;
+	for(uint32_t i = 0; i < scount; i++) {
+		e_str_type* s = (e_str_type*)p;
+		s->refs = E_STR_STATIC;
+		s->slen = e_image_get_u32(&r);
+		s->heap = NULL;
+		memcpy(s->sval, e_image_get(&r, s->slen), s->slen);
+		s->sval[s->slen] = 0;
+		strs[i] = s;
+		p += E_IMAGE_ALIGN(sizeof(e_str_type) + (size_t)s->slen + 1);
+	}
+
+	/* Values take at least one byte each */
+	img->arrays = E_MALLOC(sizeof(e_array) * img->acount + 1);
+	if(img->arrays == NULL) goto error;
+	uint64_t nvalues = (uint64_t)img->top + img->nglobals + img->nlocals + img->nslots
+					   + (img->status == E_VM_STATUS_WAITING);
+	for(uint32_t a = 0; a < img->acount; a++) {
+		img->arrays[a] = (e_array) { .len = e_image_get_u32(&r) };
+		nvalues += img->arrays[a].len;
+	}
+	if(!r.ok || nvalues > r.len - r.pos) goto error;
+
+	img->values = E_MALLOC(sizeof(e_value) * (size_t)nvalues + 1);
+	if(img->values == NULL) goto error;
+	for(uint32_t i = 0; i < nvalues; i++) {
+		img->values[i] = e_image_get_value(&r, strs, scount, img->acount);
+	}
+	if(!r.ok || r.pos != r.len) goto error;
+
+	/* cap 0: the elements belong to the image (see e_array_reserve), arrays of numbers get a numeric column */
+	e_value* items = img->values + img->top + img->nglobals + img->nlocals + img->nslots;
+	e_value* end = items;
+	uint64_t nnumbers = 0;
+	for(uint32_t a = 0; a < img->acount; a++) {
+		if(e_image_numbers(end, img->arrays[a].len)) nnumbers += img->arrays[a].len;
+		end += img->arrays[a].len;
+	}
+	img->numbers = E_MALLOC(sizeof(double) * (size_t)nnumbers + 1);
+	if(img->numbers == NULL) goto error;
+	double* nums = img->numbers;
+	for(uint32_t a = 0; a < img->acount; a++) {
+		e_array* arr = &img->arrays[a];
+		if(e_image_numbers(items, arr->len)) {
+			for(uint32_t i = 0; i < arr->len; i++) nums[i] = items[i].val;
+			arr->nums = nums;
+			nums += arr->len;
+		} else {
+			arr->items = items;
+		}
+		items += arr->len;
+	}
+	if(img->status == E_VM_STATUS_WAITING) {
+		img->pending.name = *items;
+		if(img->pending.name.argtype != E_STRING) goto error;
+	} else {
+		img->pending = (e_pending_call) { 0 };
+	}
+
+	E_FREE(strs);
+	return 1;
+
+error:
+	e_fail("Invalid vm image");
+	E_FREE(strs);
+	return 0;
+}
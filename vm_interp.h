@@ -0,0 +1,1066 @@
+//
+// es_vm
+//
+
+// Interpreter loop, included twice by vm.c (no include guard):
+// E_INTERP_CHECKED 1 checks every stack access and operand, E_INTERP_CHECKED 0 runs programs
+// verified by e_program_verify, only the guards for what cannot be verified at load time are kept
+
+#if E_INTERP_CHECKED
+#define E_POP()				e_stack_pop(&vm->stack)
+#define E_PUSH(...)			e_stack_push(&vm->stack, (__VA_ARGS__))
+#define E_LOCAL(i)			e_frame_local(vm, (i))
+#define E_UNVERIFIED(c)		(c)
+#define E_GUARD_RESULT(n)	do { } while(0)
+#else
+#define E_POP()				((e_stack_status_ret) { .status = E_STATUS_OK, .val = vm->stack.entries[--vm->stack.top] })
+#define E_PUSH(...)			(vm->stack.entries[vm->stack.top++] = (__VA_ARGS__), (e_stack_status_ret) { .status = E_STATUS_OK })
+#define E_LOCAL(i)			(E_LOCALS(vm) + (uint32_t)(i))
+#define E_UNVERIFIED(c)		0
+/* External functions are verified to return one value, anything else continues checked */
+#define E_GUARD_RESULT(n)	do { if(vm->stack.top != (n) || vm->pupo_is_data != 0) goto deopt; } while(0)
+#endif
+
+e_vm_status
+E_INTERP_NAME(e_vm* vm, const e_program* prog, uint64_t steps) {
+	const uint64_t budget = steps;
+	const e_dinstr* code = prog->code;
+	const e_dinstr* instr;
+	e_stack_status_ret s1;
+	e_stack_status_ret s2;
+
+#if E_JIT && !E_INTERP_CHECKED
+	e_jit* jit = vm->jit;
+	if(jit != NULL && !e_jit_begin(jit, prog)) jit = NULL;
+#endif
+
+#if E_PROFILE
+	e_profile* prof = vm->profile;
+	if(prof != NULL && !e_profile_begin(prof, prog)) prof = NULL;
+	if(prof != NULL && prof->paused_at != 0) {
+		prof->paused += E_PROFILE_CYCLES() - prof->paused_at;
+		prof->paused_at = 0;
+	}
+#endif
+
+#if E_THREADED_DISPATCH
+	static void* const dispatch_table[256] = {
+		[0 ... 255] = &&op_invalid,
+		[E_OP_NOP] = &&op_E_OP_NOP,
+		[E_OP_PUSHG] = &&op_E_OP_PUSHG,
+		[E_OP_POPG] = &&op_E_OP_POPG,
+		[E_OP_PUSHL] = &&op_E_OP_PUSHL,
+		[E_OP_POPL] = &&op_E_OP_POPL,
+		[E_OP_PUSH] = &&op_E_OP_PUSH,
+		[E_OP_PUSHS] = &&op_E_OP_PUSHS,
+		[E_OP_DATA] = &&op_E_OP_DATA,
+		[E_OP_PUSHA] = &&op_E_OP_PUSHA,
+		[E_OP_PUSHAS] = &&op_E_OP_PUSHAS,
+		[E_OP_EQ] = &&op_E_OP_EQ,
+		[E_OP_LT] = &&op_E_OP_LT,
+		[E_OP_GT] = &&op_E_OP_GT,
+		[E_OP_LTEQ] = &&op_E_OP_LTEQ,
+		[E_OP_GTEQ] = &&op_E_OP_GTEQ,
+		[E_OP_NOTEQ] = &&op_E_OP_NOTEQ,
+		[E_OP_ADD] = &&op_E_OP_ADD,
+		[E_OP_NEG] = &&op_E_OP_NEG,
+		[E_OP_SUB] = &&op_E_OP_SUB,
+		[E_OP_MUL] = &&op_E_OP_MUL,
+		[E_OP_DIV] = &&op_E_OP_DIV,
+		[E_OP_AND] = &&op_E_OP_AND,
+		[E_OP_OR] = &&op_E_OP_OR,
+		[E_OP_NOT] = &&op_E_OP_NOT,
+		[E_OP_CONCAT] = &&op_E_OP_CONCAT,
+		[E_OP_MOD] = &&op_E_OP_MOD,
+		[E_OP_JZ] = &&op_E_OP_JZ,
+		[E_OP_JMP] = &&op_E_OP_JMP,
+		[E_OP_JFS] = &&op_E_OP_JFS,
+		[E_OP_JMPFUN] = &&op_E_OP_JMPFUN,
+		[E_OP_CALL] = &&op_E_OP_CALL,
+		[E_OP_PRINT] = &&op_E_OP_PRINT,
+		[E_OP_ARGTYPE] = &&op_E_OP_ARGTYPE,
+		[E_OP_LEN] = &&op_E_OP_LEN,
+		[E_OP_ARRAY] = &&op_E_OP_ARRAY,
+		[E_OP_HALT] = &&op_E_OP_HALT,
+		[E_OP_ADD_NUM_NUM] = &&op_E_OP_ADD_NUM_NUM,
+		[E_OP_SUB_NUM_NUM] = &&op_E_OP_SUB_NUM_NUM,
+		[E_OP_MUL_NUM_NUM] = &&op_E_OP_MUL_NUM_NUM,
+		[E_OP_DIV_NUM_NUM] = &&op_E_OP_DIV_NUM_NUM,
+		[E_OP_EQ_NUM_NUM] = &&op_E_OP_EQ_NUM_NUM,
+		[E_OP_LT_NUM_NUM] = &&op_E_OP_LT_NUM_NUM,
+		[E_OP_GT_NUM_NUM] = &&op_E_OP_GT_NUM_NUM,
+		[E_OP_LTEQ_NUM_NUM] = &&op_E_OP_LTEQ_NUM_NUM,
+		[E_OP_GTEQ_NUM_NUM] = &&op_E_OP_GTEQ_NUM_NUM,
+		[E_OP_NOTEQ_NUM_NUM] = &&op_E_OP_NOTEQ_NUM_NUM,
+		[E_OP_EQ_STR_STR] = &&op_E_OP_EQ_STR_STR,
+		[E_OP_NOTEQ_STR_STR] = &&op_E_OP_NOTEQ_STR_STR,
+		[E_OP_POPG_ADDK] = &&op_E_OP_POPG_ADDK,
+		[E_OP_POPG_SUBK] = &&op_E_OP_POPG_SUBK,
+		[E_OP_POPL_ADDK] = &&op_E_OP_POPL_ADDK,
+		[E_OP_POPL_SUBK] = &&op_E_OP_POPL_SUBK,
+		[E_OP_EQ_JZ] = &&op_E_OP_EQ_JZ,
+		[E_OP_LT_JZ] = &&op_E_OP_LT_JZ,
+		[E_OP_GT_JZ] = &&op_E_OP_GT_JZ,
+		[E_OP_LTEQ_JZ] = &&op_E_OP_LTEQ_JZ,
+		[E_OP_GTEQ_JZ] = &&op_E_OP_GTEQ_JZ,
+		[E_OP_NOTEQ_JZ] = &&op_E_OP_NOTEQ_JZ,
+		[E_OP_PUSHA_POPG] = &&op_E_OP_PUSHA_POPG,
+		[E_OP_PUSHA_POPL] = &&op_E_OP_PUSHA_POPL,
+		[E_OP_CALLI] = &&op_E_OP_CALLI,
+		[E_OP_REG] = &&op_E_OP_REG,
+	};
+#else
+	uint8_t opcode;
+#endif
+
+	if(vm->ip > prog->count) goto error;
+
+	for(;;) {
+		E_SWITCH() {
+		E_CASE(E_OP_NOP)
+			E_NEXT();
+		E_CASE(E_OP_PUSHG)
+			// Add value of pop([s-1]) to global symbol stack at index u32(op1)
+			if(vm->pupo_is_data) {
+				// Pop the data into an array
+				uint32_t arr_len = vm->pupo_is_data;
+				vm->pupo_is_data = 0;
+				if(E_UNVERIFIED(!(instr->d_op >= 0 && instr->d_op < vm->config.globals) || vm->stack.top < arr_len)) goto error;
+
+				vm->stack.top -= arr_len;
+				if(!e_array_store(vm, &vm->globals[(uint32_t)instr->d_op], &vm->stack.entries[vm->stack.top], arr_len)) {
+					e_fail("Cannot allocate array");
+					goto error;
+				}
+			} else {
+					e_stack_status_ret s_peek = e_varstack_peek_index(vm->globals, instr->d_op);
+					if(s_peek.val.argtype == E_ARRAY && vm->pupo_arr_index >= 0) {
+						/* Array access based on index, otherwise the whole array is replaced */
+						e_stack_status_ret s_value = E_POP();
+						if(s_value.status == E_STATUS_OK) {
+							if(!e_change_value_in_arr(vm, s_peek.val, vm->pupo_arr_index, s_value.val)) {
+								e_value_release(s_value.val);
+							}
+						} else {
+							e_fail("Array out of bounds");
+							goto error;
+						}
+						vm->pupo_arr_index = -1;
+					} else {
+						s1 = E_POP();
+						if(s1.status == E_STATUS_OK) {
+#if E_DEBUG
+						snprintf(dbg_s, E_MAX_STRLEN, "Storing value %f to global stack [%d] (type: %d)\n", s1.val.val, instr->op1, instr->op2);
+						e_print(dbg_s);
+#endif
+						e_stack_status_ret s = e_varstack_insert_global_at_index(vm->globals, s1.val, instr->d_op);
+						if (s.status != E_STATUS_OK) goto error;
+					} else goto error;
+				}
+			}
+			E_NEXT();
+		E_CASE(E_OP_POPG)
+			// Find value [index] in global stack
+			{
+				e_stack_status_ret s = e_varstack_peek_index(vm->globals, instr->d_op);
+				if(s.status == E_STATUS_OK) {
+#if E_DEBUG
+					snprintf(dbg_s, E_MAX_STRLEN, "Loading global from index %d -> %f\n", instr->op1, s.val.val);
+					e_print(dbg_s);
+#endif
+					if(s.val.argtype == E_ARRAY) {
+						/* Array access based on index */
+						if(vm->pupo_arr_index >= 0) {
+							e_value v;
+							if(e_find_value_in_arr(vm, s.val, vm->pupo_arr_index, &v)) {
+								e_value_retain(v);
+								e_stack_status_ret s_push = E_PUSH(v);
+								if(s_push.status == E_STATUS_NESIZE) {
+									e_fail("Stack overflow");
+									goto error;
+								}
+							} else {
+								/* Out of bounds */
+								e_fail("Array out of bounds");
+								goto error;
+							}
+							vm->pupo_arr_index = -1;
+						} else {
+							/* Array pass-by-value? */
+							e_stack_status_ret s_push = E_PUSH(s.val);
+							if(s_push.status == E_STATUS_NESIZE) {
+								e_fail("Stack overflow");
+								goto error;
+							}
+						}
+					} else {
+						// Push this value onto the vm->stack
+						e_value_retain(s.val);
+						e_stack_status_ret s_push = E_PUSH(s.val);
+						if(s_push.status == E_STATUS_NESIZE) {
+							e_fail("Stack overflow");
+							goto error;
+						}
+					}
+				} else goto error;
+			}
+			E_NEXT();
+		E_CASE(E_OP_PUSHL)
+			// Add value of pop([s-1]) to locals symbol stack at index u32(op1)
+			if(vm->pupo_is_data) {
+				// Pop the data into an array
+				uint32_t arr_len = vm->pupo_is_data;
+				e_value* slot = E_LOCAL(instr->d_op);
+				vm->pupo_is_data = 0;
+				if(E_UNVERIFIED(slot == NULL || vm->stack.top < arr_len)) goto error;
+
+				vm->stack.top -= arr_len;
+				if(!e_array_store(vm, slot, &vm->stack.entries[vm->stack.top], arr_len)) {
+					e_fail("Cannot allocate array");
+					goto error;
+				}
+			} else {
+				e_value* slot = E_LOCAL(instr->d_op);
+				if(E_UNVERIFIED(slot == NULL)) goto error;
+
+				if(slot->argtype == E_ARRAY && vm->pupo_arr_index >= 0) {
+					/* Array access based on index, otherwise the whole array is replaced */
+					e_stack_status_ret s_value = E_POP();
+					if(s_value.status == E_STATUS_OK) {
+						if(!e_change_value_in_arr(vm, *slot, vm->pupo_arr_index, s_value.val)) {
+							e_value_release(s_value.val);
+						}
+					} else {
+						e_fail("Array out of bounds");
+						goto error;
+					}
+					vm->pupo_arr_index = -1;
+				} else {
+					s1 = E_POP();
+					if (s1.status == E_STATUS_OK) {
+#if E_DEBUG
+						if(instr->op2 == E_ARGT_STRING) {
+							snprintf(dbg_s, E_MAX_STRLEN, "Storing value %s to local stack [%d] (type: %d)\n", s1.val.sval->sval, instr->op1, instr->op2);
+							e_print(dbg_s);
+						} else if(instr->op2 == E_ARGT_NUMBER) {
+							snprintf(dbg_s, E_MAX_STRLEN, "Storing value %f to local stack [%d] (type: %d)\n", s1.val.val, instr->op1, instr->op2);
+							e_print(dbg_s);
+						}
+#endif
+						e_value_release(*slot);
+						*slot = s1.val;
+					} else goto error;
+				}
+			}
+			E_NEXT();
+		E_CASE(E_OP_POPL)
+			// Find value [index] in local stack
+			{
+				const e_value* slot = E_LOCAL(instr->d_op);
+				if(slot != NULL) {
+					e_stack_status_ret s = { .status = E_STATUS_OK, .val = *slot };
+#if E_DEBUG
+					snprintf(dbg_s, E_MAX_STRLEN, "Loading local from index %d -> %f\n", instr->op1, s.val.val);
+					e_print(dbg_s);
+#endif
+					if(s.val.argtype == E_ARRAY) {
+						/* Array access based on index */
+						if(vm->pupo_arr_index >= 0) {
+							e_value v;
+							if(e_find_value_in_arr(vm, s.val, vm->pupo_arr_index, &v)) {
+								e_value_retain(v);
+								e_stack_status_ret s_push = E_PUSH(v);
+								if(s_push.status == E_STATUS_NESIZE) {
+									e_fail("Stack overflow");
+									goto error;
+								}
+							} else {
+								/* Out of bounds */
+								e_fail("Array out of bounds");
+								goto error;
+							}
+							vm->pupo_arr_index = -1;
+						} else {
+							/* Array pass-by-value? */
+							e_stack_status_ret s_push = E_PUSH(s.val);
+							if(s_push.status == E_STATUS_NESIZE) {
+								e_fail("Stack overflow");
+								goto error;
+							}
+						}
+					} else {
+						// Push this value onto the vm->stack
+						e_value_retain(s.val);
+						e_stack_status_ret s_push = E_PUSH(s.val);
+						if(s_push.status == E_STATUS_NESIZE) {
+							e_fail("Stack overflow");
+							goto error;
+						}
+					}
+				} else goto error;
+			}
+			E_NEXT();
+		E_CASE(E_OP_PUSHA)
+			vm->pupo_arr_index = instr->d_op;
+			E_NEXT();
+		E_CASE(E_OP_PUSHAS)
+			{
+				s1 = E_POP();
+				if(s1.status == E_STATUS_OK) {
+					vm->pupo_arr_index = s1.val.val;
+					e_value_release(s1.val);
+				} else goto error;
+			}
+			E_NEXT();
+		E_CASE(E_OP_PUSH)
+			// Push (u32(operand 1 | operand 2)) onto stack
+			{
+				e_stack_status_ret s_push = E_PUSH(e_create_number(instr->d_op));
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			}
+			E_NEXT();
+		E_CASE(E_OP_PUSHS)
+			// Push string literal (decoded by e_program_load) onto stack
+			{
+				e_value_retain(vm->prog->literals[instr->target]);
+				e_stack_status_ret s_push = E_PUSH(vm->prog->literals[instr->target]);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			}
+			E_NEXT();
+		E_CASE(E_OP_DATA)
+			vm->pupo_is_data = instr->d_op;
+			E_NEXT();
+		E_CASE(E_OP_EQ)
+			// PUSH (s[-1] == s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_EQ, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(e_value_equals(s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_NOTEQ)
+			// PUSH (s[-1] != s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_NOTEQ, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(!e_value_equals(s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_LT)
+			// PUSH (s[-1] < s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_LT, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(e_value_compare(E_OP_LT, s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_GT)
+			// PUSH (s[-1] > s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_GT, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(e_value_compare(E_OP_GT, s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_LTEQ)
+			// PUSH (s[-1] <= s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_LTEQ, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(e_value_compare(E_OP_LTEQ, s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_GTEQ)
+			// PUSH (s[-1] >= s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_GTEQ, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(e_value_compare(E_OP_GTEQ, s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_ADD)
+			// PUSH (s[-1] + s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_ADD, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(e_value_arith(E_OP_ADD, s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_NEG)
+			s1 = E_POP();
+			if(s1.status == E_STATUS_OK) {
+				e_stack_status_ret s_push = E_PUSH(e_create_number(s1.val.argtype == E_NUMBER ? -s1.val.val : e_value_arith(E_OP_NEG, s1.val, s1.val)));
+				e_value_release(s1.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else goto error;
+			E_NEXT();
+		E_CASE(E_OP_SUB)
+			// PUSH (s[-1] - s[-2])
+			// PUSH (s[-1] + s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_SUB, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(e_value_arith(E_OP_SUB, s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_MUL)
+			// PUSH (s[-1] * s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_MUL, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(e_value_arith(E_OP_MUL, s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_DIV)
+			// PUSH (s[-1] / s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				E_QUICKEN_TYPES(E_OP_DIV, s2.val, s1.val);
+				e_stack_status_ret s_push = E_PUSH(e_create_number(e_value_arith(E_OP_DIV, s2.val, s1.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_MOD)
+			// PUSH (s[-1] % s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				e_stack_status_ret s_push = E_PUSH(e_create_number((uint8_t)((uint32_t)s2.val.val % (uint32_t)s1.val.val)));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_AND)
+			// PUSH (s[-1] && s[-2])
+			// PUSH (s[-1] + s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				e_stack_status_ret s_push = E_PUSH(e_create_number((uint8_t)s2.val.val && s1.val.val));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_OR)
+			// PUSH (s[-1] || s[-2])
+			// PUSH (s[-1] + s[-2])
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				e_stack_status_ret s_push = E_PUSH(e_create_number((uint8_t)s2.val.val || s1.val.val));
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_NOT)
+			// PUSH !s[-1]
+			s1 = E_POP();
+			if(s1.status == E_STATUS_OK) {
+				e_stack_status_ret s_push = E_PUSH(e_create_number(!s1.val.val));
+				e_value_release(s1.val);
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else goto error;
+			E_NEXT();
+		E_CASE(E_OP_CONCAT)
+			// Concatenate two strings (cast if number type) s[-1] and s[-2]
+			s2 = E_POP();
+			s1 = E_POP();
+			if(s1.status == E_STATUS_OK && s2.status == E_STATUS_OK) {
+				uint32_t m1 = e_value_str_size(s1.val);
+				uint32_t m2 = e_value_str_size(s2.val);
+				e_str_type* str = NULL;
+				if(m1 == UINT32_MAX || m2 == UINT32_MAX) {
+					e_fail("Unsupported argtype");
+				} else if((uint64_t)m1 + m2 < UINT32_MAX) {
+					// Build the result directly in the string heap, numbers are formatted in place
+					str = e_str_alloc(&vm->strings, m1 + m2);
+				}
+				if(str == NULL) {
+					e_value_release(s1.val);
+					e_value_release(s2.val);
+					goto error;
+				}
+				uint32_t len = e_value_str_write(vm, s1.val, str->sval);
+				len += e_value_str_write(vm, s2.val, str->sval + len);
+				e_str_truncate(str, len);
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+
+				e_stack_status_ret s_push = E_PUSH((e_value) { .sval = str, .argtype = E_STRING });
+				if(s_push.status == E_STATUS_NESIZE) {
+					e_fail("Stack overflow");
+					goto error;
+				}
+			} else E_OPERANDS_ERROR();
+			E_NEXT();
+		E_CASE(E_OP_JZ)
+			// POP s[-1]
+			// if(s[-1] == 0) then perform_jump()
+			s1 = E_POP();
+			if(s1.status == E_STATUS_OK) {
+				e_value_release(s1.val);
+				if(s1.val.val == 0) {
+#if E_DEBUG
+					snprintf(dbg_s, E_MAX_STRLEN, "is zero, perform jump to address [%f]\n", instr->d_op);
+					e_print(dbg_s);
+#endif
+					// Perform jump
+					if(E_UNVERIFIED(instr->target == E_TARGET_INVALID)) goto error;
+					vm->ip = instr->target;
+				}
+			} else goto error;
+			E_NEXT();
+		E_CASE(E_OP_JMP)
+			// perform_jump()
+#if E_DEBUG
+			snprintf(dbg_s, E_MAX_STRLEN, "perform jump to address [%f]\n", instr->d_op);
+			e_print(dbg_s);
+#endif
+			if(E_UNVERIFIED(instr->target == E_TARGET_INVALID)) goto error;
+			vm->ip = instr->target;
+			E_NEXT();
+		E_CASE(E_OP_JFS)
+			{
+				// Get callframe
+				if(E_UNVERIFIED(vm->cfcnt == 0)) goto error;
+				e_callframe* callframe = &vm->callframes[vm->cfcnt - 1];
+
+				// Close callframe, slots above the top frame are kept empty
+				e_value* slots = &vm->frame_slots[callframe->base];
+				for(uint32_t i = 0; i < callframe->size; i++) {
+					e_value_release(slots[i]);
+				}
+				memset(slots, 0, sizeof(e_value) * callframe->size);
+				E_PROFILE_RETURN();
+				vm->cfcnt -= 1;
+
+				// Return addr
+				vm->ip = callframe->retAddr;
+			}
+			E_NEXT();
+		E_CASE(E_OP_JMPFUN)
+			// Create CallFrame
+			{
+#if !E_INTERP_CHECKED
+				/* Only the called function's own stack use is verified, not how deep it recurses */
+				if(vm->stack.top - 1 + instr->depth >= vm->stack.size) {
+					vm->ip--;
+					steps++;
+					goto deopt;
+				}
+#endif
+				s1 = E_POP();
+				if(s1.status == E_STATUS_OK) {
+					// Return address is a byte address, resolve it to an instruction index
+					uint32_t ret_index = vm->ip;
+					if(E_UNVERIFIED(ret_index >= vm->prog->count || vm->prog->code[ret_index].addr != s1.val.val)) {
+						ret_index = e_program_index_of(vm->prog, s1.val.val);
+						if(ret_index == E_TARGET_INVALID) goto error;
+					}
+
+					// Push a frame on top of the caller's, reserving only the slots the function uses
+					if(vm->cfcnt + 1 >= vm->config.callframes) {
+						e_fail("Cannot create another call frame");
+						goto error;
+					}
+					const e_callframe* caller = &vm->callframes[vm->cfcnt - (vm->cfcnt > 0)];
+					vm->callframes[vm->cfcnt] = (e_callframe) {
+						.retAddr = ret_index,
+						.base = vm->cfcnt > 0 ? caller->base + caller->size : 0,
+						.size = 0
+					};
+					if(!e_frame_reserve(vm, vm->cfcnt, instr->nlocals)) {
+						e_fail("Cannot create another call frame");
+						goto error;
+					}
+					vm->cfcnt++;
+				} else goto error;
+
+				if(E_UNVERIFIED(instr->target == E_TARGET_INVALID)) goto error;
+				vm->ip = instr->target;
+				E_PROFILE_CALL(instr->target);
+			}
+			E_NEXT();
+		E_CASE(E_OP_CALL)
+			// External function / subroutine call
+			s1 = E_POP();
+
+			if(s1.status == E_STATUS_OK && s1.val.argtype == E_STRING) {
+				const char* name = (const char*)s1.val.sval->sval;
+				uint32_t argsbefore = vm->stack.top;
+				int32_t tmp_stat = e_api_call_sub(vm, name, instr->d_op);
+				if(tmp_stat == -1) {
+					char tmp[E_MAX_STRLEN + 30];
+					snprintf(tmp, E_MAX_STRLEN + 30, "Unknown function / subroutine %s", name);
+					e_fail(tmp);
+					e_value_release(s1.val);
+					goto error;
+				}
+				if((uint32_t)tmp_stat == E_API_CALL_RETURN_PENDING) {
+					// The name is kept until e_vm_complete
+					vm->pending = (e_pending_call) { .name = s1.val, .argsbefore = argsbefore, .arglen = instr->d_op };
+					goto wait;
+				}
+				uint8_t ok = e_vm_call_return(vm, name, tmp_stat, argsbefore, instr->d_op);
+				e_value_release(s1.val);
+				if(!ok) goto error;
+				E_GUARD_RESULT(argsbefore - (uint32_t)instr->d_op + 1);
+			} else if(s1.status == E_STATUS_OK) {
+				e_value_release(s1.val);
+			}
+			E_NEXT();
+		E_CASE(E_OP_CALLI)
+			// PUSHS [name], CALL [arglen] resolved to a registry index (see e_program_link)
+			if(prog->registry != vm->registry) E_REDISPATCH(E_OP_PUSHS);
+			{
+				e_value lit = prog->literals[instr->target];
+				const char* name = (const char*)lit.sval->sval;
+				instr = &code[vm->ip++];
+				uint32_t argsbefore = vm->stack.top;
+				int32_t tmp_stat = e_registry_call(vm->registry, instr->target, vm, instr->d_op);
+				if((uint32_t)tmp_stat == E_API_CALL_RETURN_PENDING) {
+					vm->pending = (e_pending_call) { .name = lit, .argsbefore = argsbefore, .arglen = instr->d_op };
+					goto wait;
+				}
+				if(!e_vm_call_return(vm, name, tmp_stat, argsbefore, instr->d_op)) goto error;
+				E_GUARD_RESULT(argsbefore - (uint32_t)instr->d_op + 1);
+			}
+			E_NEXT();
+		E_CASE(E_OP_PRINT)
+			e_builtin_print(vm, 1);
+			E_NEXT();
+		E_CASE(E_OP_ARGTYPE)
+			{
+				uint32_t r = e_builtin_argtype(vm, 1);
+				if(r == 0) {
+					e_fail("Builtin function ARGTYPE failed");
+					goto error;
+				}
+			}
+			E_NEXT();
+		E_CASE(E_OP_LEN)
+			{
+				uint32_t r = e_builtin_len(vm, 1);
+				if(r == 0) {
+					e_fail("Builtin function LEN failed");
+					goto error;
+				}
+			}
+			E_NEXT();
+		E_CASE(E_OP_ARRAY)
+			{
+				uint32_t r = e_builtin_array(vm, 1);
+				if(r == 0) {
+					e_fail("Builtin function ARRAY failed");
+					goto error;
+				}
+			}
+			E_NEXT();
+		/* Quickened instructions (see E_QUICKEN), the generic instruction runs if the operand types changed */
+		E_CASE(E_OP_ADD_NUM_NUM)
+			E_QUICK_GUARD(E_OP_ADD, E_NUMBERS);
+			E_QUICK_NUM(+);
+			E_NEXT();
+		E_CASE(E_OP_SUB_NUM_NUM)
+			E_QUICK_GUARD(E_OP_SUB, E_NUMBERS);
+			E_QUICK_NUM(-);
+			E_NEXT();
+		E_CASE(E_OP_MUL_NUM_NUM)
+			E_QUICK_GUARD(E_OP_MUL, E_NUMBERS);
+			E_QUICK_NUM(*);
+			E_NEXT();
+		E_CASE(E_OP_DIV_NUM_NUM)
+			E_QUICK_GUARD(E_OP_DIV, E_NUMBERS);
+			E_QUICK_NUM(/);
+			E_NEXT();
+		E_CASE(E_OP_EQ_NUM_NUM)
+			E_QUICK_GUARD(E_OP_EQ, E_NUMBERS);
+			E_QUICK_NUM(==);
+			E_NEXT();
+		E_CASE(E_OP_NOTEQ_NUM_NUM)
+			E_QUICK_GUARD(E_OP_NOTEQ, E_NUMBERS);
+			E_QUICK_NUM(!=);
+			E_NEXT();
+		E_CASE(E_OP_LT_NUM_NUM)
+			E_QUICK_GUARD(E_OP_LT, E_NUMBERS);
+			E_QUICK_NUM(<);
+			E_NEXT();
+		E_CASE(E_OP_GT_NUM_NUM)
+			E_QUICK_GUARD(E_OP_GT, E_NUMBERS);
+			E_QUICK_NUM(>);
+			E_NEXT();
+		E_CASE(E_OP_LTEQ_NUM_NUM)
+			E_QUICK_GUARD(E_OP_LTEQ, E_NUMBERS);
+			E_QUICK_NUM(<=);
+			E_NEXT();
+		E_CASE(E_OP_GTEQ_NUM_NUM)
+			E_QUICK_GUARD(E_OP_GTEQ, E_NUMBERS);
+			E_QUICK_NUM(>=);
+			E_NEXT();
+		E_CASE(E_OP_EQ_STR_STR)
+		E_CASE(E_OP_NOTEQ_STR_STR)
+			E_QUICK_GUARD(instr->OP == E_OP_EQ_STR_STR ? E_OP_EQ : E_OP_NOTEQ, E_STRINGS);
+			{
+				e_value* e = &vm->stack.entries[--vm->stack.top];
+				uint8_t c = e_value_equals(e[-1], e[0]);
+				e_value_release(e[0]);
+				e_value_release(e[-1]);
+				e[-1] = e_create_number(instr->OP == E_OP_EQ_STR_STR ? c : !c);
+			}
+			E_NEXT();
+		/* Superinstructions (see e_program_fuse), the fused sequence stays in the program
+		   after its head, so a failed guard simply re-dispatches the head's original opcode */
+		E_CASE(E_OP_POPG_ADDK)
+			// POPG [index], PUSH [k], ADD
+			{
+				const e_value* v = &vm->globals[(uint32_t)instr->d_op];
+				if(v->argtype != E_NUMBER || vm->stack.top + 2 >= vm->stack.size) E_REDISPATCH(E_OP_POPG);
+				vm->stack.entries[vm->stack.top++] = e_create_number(v->val + instr[1].d_op);
+				vm->ip += 2;
+			}
+			E_NEXT();
+		E_CASE(E_OP_POPG_SUBK)
+			// POPG [index], PUSH [k], SUB
+			{
+				const e_value* v = &vm->globals[(uint32_t)instr->d_op];
+				if(v->argtype != E_NUMBER || vm->stack.top + 2 >= vm->stack.size) E_REDISPATCH(E_OP_POPG);
+				vm->stack.entries[vm->stack.top++] = e_create_number(v->val - instr[1].d_op);
+				vm->ip += 2;
+			}
+			E_NEXT();
+		E_CASE(E_OP_POPL_ADDK)
+			// POPL [index], PUSH [k], ADD
+			{
+				const e_value* v = E_LOCALS(vm) + (uint32_t)instr->d_op;
+				if(E_UNVERIFIED(instr->d_op >= E_LOCALS_SIZE(vm)) || v->argtype != E_NUMBER || vm->stack.top + 2 >= vm->stack.size) E_REDISPATCH(E_OP_POPL);
+				vm->stack.entries[vm->stack.top++] = e_create_number(v->val + instr[1].d_op);
+				vm->ip += 2;
+			}
+			E_NEXT();
+		E_CASE(E_OP_POPL_SUBK)
+			// POPL [index], PUSH [k], SUB
+			{
+				const e_value* v = E_LOCALS(vm) + (uint32_t)instr->d_op;
+				if(E_UNVERIFIED(instr->d_op >= E_LOCALS_SIZE(vm)) || v->argtype != E_NUMBER || vm->stack.top + 2 >= vm->stack.size) E_REDISPATCH(E_OP_POPL);
+				vm->stack.entries[vm->stack.top++] = e_create_number(v->val - instr[1].d_op);
+				vm->ip += 2;
+			}
+			E_NEXT();
+		E_CASE(E_OP_EQ_JZ)
+			// EQ, JZ [addr]
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status != E_STATUS_OK || s2.status != E_STATUS_OK) E_OPERANDS_ERROR();
+			{
+				uint8_t c = e_value_equals(s2.val, s1.val);
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				E_BRANCH_UNLESS(c);
+			}
+			E_NEXT();
+		E_CASE(E_OP_NOTEQ_JZ)
+			// NOTEQ, JZ [addr]
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status != E_STATUS_OK || s2.status != E_STATUS_OK) E_OPERANDS_ERROR();
+			{
+				uint8_t c = !e_value_equals(s2.val, s1.val);
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				E_BRANCH_UNLESS(c);
+			}
+			E_NEXT();
+		E_CASE(E_OP_LT_JZ)
+			// LT, JZ [addr]
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status != E_STATUS_OK || s2.status != E_STATUS_OK) E_OPERANDS_ERROR();
+			{
+				uint8_t c = E_NUMBERS(s2.val, s1.val) ? s2.val.val < s1.val.val : e_value_compare(E_OP_LT, s2.val, s1.val);
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				E_BRANCH_UNLESS(c);
+			}
+			E_NEXT();
+		E_CASE(E_OP_GT_JZ)
+			// GT, JZ [addr]
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status != E_STATUS_OK || s2.status != E_STATUS_OK) E_OPERANDS_ERROR();
+			{
+				uint8_t c = E_NUMBERS(s2.val, s1.val) ? s2.val.val > s1.val.val : e_value_compare(E_OP_GT, s2.val, s1.val);
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				E_BRANCH_UNLESS(c);
+			}
+			E_NEXT();
+		E_CASE(E_OP_LTEQ_JZ)
+			// LTEQ, JZ [addr]
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status != E_STATUS_OK || s2.status != E_STATUS_OK) E_OPERANDS_ERROR();
+			{
+				uint8_t c = E_NUMBERS(s2.val, s1.val) ? s2.val.val <= s1.val.val : e_value_compare(E_OP_LTEQ, s2.val, s1.val);
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				E_BRANCH_UNLESS(c);
+			}
+			E_NEXT();
+		E_CASE(E_OP_GTEQ_JZ)
+			// GTEQ, JZ [addr]
+			s1 = E_POP();
+			s2 = E_POP();
+			if(s1.status != E_STATUS_OK || s2.status != E_STATUS_OK) E_OPERANDS_ERROR();
+			{
+				uint8_t c = E_NUMBERS(s2.val, s1.val) ? s2.val.val >= s1.val.val : e_value_compare(E_OP_GTEQ, s2.val, s1.val);
+				e_value_release(s1.val);
+				e_value_release(s2.val);
+				E_BRANCH_UNLESS(c);
+			}
+			E_NEXT();
+		E_CASE(E_OP_PUSHA_POPG)
+			// PUSHA [index], POPG [index]
+			{
+				const e_value* arr = &vm->globals[(uint32_t)instr[1].d_op];
+				e_value v;
+				if(arr->argtype != E_ARRAY || !(instr->d_op >= 0 && instr->d_op <= INT32_MAX)
+				   || !e_find_value_in_arr(vm, *arr, instr->d_op, &v)
+				   || vm->stack.top + 1 >= vm->stack.size) E_REDISPATCH(E_OP_PUSHA);
+				e_value_retain(v);
+				vm->stack.entries[vm->stack.top++] = v;
+				vm->ip += 1;
+			}
+			E_NEXT();
+		E_CASE(E_OP_PUSHA_POPL)
+			// PUSHA [index], POPL [index]
+			{
+				const e_value* arr = E_LOCALS(vm) + (uint32_t)instr[1].d_op;
+				e_value v;
+				if(E_UNVERIFIED(instr[1].d_op >= E_LOCALS_SIZE(vm)) || arr->argtype != E_ARRAY || !(instr->d_op >= 0 && instr->d_op <= INT32_MAX)
+				   || !e_find_value_in_arr(vm, *arr, instr->d_op, &v)
+				   || vm->stack.top + 1 >= vm->stack.size) E_REDISPATCH(E_OP_PUSHA);
+				e_value_retain(v);
+				vm->stack.entries[vm->stack.top++] = v;
+				vm->ip += 1;
+			}
+			E_NEXT();
+		E_CASE(E_OP_REG)
+			// Register group [index] (see e_program_translate)
+			{
+				const e_rgroup* g = &prog->rgroups[instr->target];
+#if E_INTERP_CHECKED
+				E_REDISPATCH(g->op);
+#else
+				/* A group runs as a whole, it needs the steps of all its instructions and no pending array access */
+				if(steps < g->steps - 1 || vm->pupo_arr_index >= 0 || vm->pupo_is_data) E_REDISPATCH(g->op);
+#if E_JIT
+				if(jit != NULL) {
+					/* Hot loop headers and function entries run as native code, from this group on */
+					e_jit_group* jg = &jit->groups[instr->target];
+					if(jg->fn == NULL && jg->candidate && ++jg->count == jit->hot) e_jit_compile(jit, prog, instr->target);
+					if(jg->fn != NULL) {
+						steps++;
+						vm->ip = jg->fn(vm, E_LOCALS(vm), &steps);
+						E_NEXT();
+					}
+				}
+#endif
+				steps -= g->steps - 1;
+
+				e_value* const base[4] = { prog->rconsts, vm->globals, E_LOCALS(vm), &vm->stack.entries[vm->stack.top] };
+				vm->ip = g->end;
+				vm->stack.top += g->delta;
+				for(const e_rinstr* r = &prog->rcode[g->first], * const end = r + g->count; r < end; r++) {
+					const e_value* a = base[r->a.kind] + r->a.index;
+					const e_value* b = base[r->b.kind] + r->b.index;
+					e_value x;
+					uint8_t c;
+					switch(r->op) {
+						case E_OP_MOV:
+							x = *a;
+							if(r->a.kind != E_REG_TEMP) e_value_retain(x);
+							break;
+						case E_OP_ADD: x = e_create_number(E_NUMBERS(*a, *b) ? a->val + b->val : e_value_arith(r->op, *a, *b)); break;
+						case E_OP_SUB: x = e_create_number(E_NUMBERS(*a, *b) ? a->val - b->val : e_value_arith(r->op, *a, *b)); break;
+						case E_OP_MUL: x = e_create_number(E_NUMBERS(*a, *b) ? a->val * b->val : e_value_arith(r->op, *a, *b)); break;
+						case E_OP_DIV: x = e_create_number(E_NUMBERS(*a, *b) ? a->val / b->val : e_value_arith(r->op, *a, *b)); break;
+						case E_OP_EQ: x = e_create_number(e_value_equals(*a, *b)); break;
+						case E_OP_NOTEQ: x = e_create_number(!e_value_equals(*a, *b)); break;
+						case E_OP_LT: x = e_create_number(E_NUMBERS(*a, *b) ? a->val < b->val : e_value_compare(r->op, *a, *b)); break;
+						case E_OP_GT: x = e_create_number(E_NUMBERS(*a, *b) ? a->val > b->val : e_value_compare(r->op, *a, *b)); break;
+						case E_OP_LTEQ: x = e_create_number(E_NUMBERS(*a, *b) ? a->val <= b->val : e_value_compare(r->op, *a, *b)); break;
+						case E_OP_GTEQ: x = e_create_number(E_NUMBERS(*a, *b) ? a->val >= b->val : e_value_compare(r->op, *a, *b)); break;
+						case E_OP_NEG: x = e_create_number(a->argtype == E_NUMBER ? -a->val : e_value_arith(r->op, *a, *a)); break;
+						case E_OP_NOT: x = e_create_number(!a->val); break;
+						case E_OP_JMP:
+							vm->ip = r->target;
+							continue;
+						default:
+							/* Branches end the group */
+							switch(r->op) {
+								case E_OP_EQ_JZ: c = e_value_equals(*a, *b); break;
+								case E_OP_NOTEQ_JZ: c = !e_value_equals(*a, *b); break;
+								case E_OP_LT_JZ: c = E_NUMBERS(*a, *b) ? a->val < b->val : e_value_compare(E_OP_LT, *a, *b); break;
+								case E_OP_GT_JZ: c = E_NUMBERS(*a, *b) ? a->val > b->val : e_value_compare(E_OP_GT, *a, *b); break;
+								case E_OP_LTEQ_JZ: c = E_NUMBERS(*a, *b) ? a->val <= b->val : e_value_compare(E_OP_LTEQ, *a, *b); break;
+								case E_OP_GTEQ_JZ: c = E_NUMBERS(*a, *b) ? a->val >= b->val : e_value_compare(E_OP_GTEQ, *a, *b); break;
+								default: c = a->val != 0; break;
+							}
+							if(r->a.kind == E_REG_TEMP) e_value_release(*a);
+							if(r->b.kind == E_REG_TEMP) e_value_release(*b);
+							if(!c) vm->ip = r->target;
+							continue;
+					}
+					if(r->op != E_OP_MOV) {
+						if(r->a.kind == E_REG_TEMP) e_value_release(*a);
+						if(r->b.kind == E_REG_TEMP) e_value_release(*b);
+					}
+					e_value* dst = base[r->dst.kind] + r->dst.index;
+					if(r->dst.kind != E_REG_TEMP) e_value_release(*dst);
+					*dst = x;
+				}
+#endif
+			}
+			E_NEXT();
+		E_CASE(E_OP_HALT)
+			// End of program (sentinel appended by e_program_load)
+			vm->ip = prog->count;
+			E_PROFILE_PAUSE();
+			vm->executed += budget - steps;
+			vm->status = E_VM_STATUS_OK;
+			return E_VM_STATUS_OK;
+		E_DEFAULT
+			goto error;
+		}
+	}
+
+	wait:
+		// An external function is pending, the vm continues after e_vm_complete
+		E_PROFILE_PAUSE();
+		vm->executed += budget - steps;
+		vm->status = E_VM_STATUS_WAITING;
+		return E_VM_STATUS_WAITING;
+
+	suspend:
+		// Out of steps, ip, stacks and call frames are kept to continue with the next call
+		E_PROFILE_PAUSE();
+		vm->executed += budget;
+		vm->status = E_VM_STATUS_SUSPENDED;
+		return E_VM_STATUS_SUSPENDED;
+
+#if !E_INTERP_CHECKED
+	deopt:
+		// A guard failed, e_vm_run_steps continues with the checked interpreter
+		E_PROFILE_PAUSE();
+		vm->executed += budget - steps;
+		return E_VM_STATUS_READY;
+#endif
+
+	error:
+		E_PROFILE_PAUSE();
+		vm->executed += budget - steps;
+		e_fail("Invalid instruction or malformed arguments - STOPPED EXECUTION");
+		vm->status = E_VM_STATUS_ERROR;
+		return E_VM_STATUS_ERROR;
+}
+
+#undef E_POP
+#undef E_PUSH
+#undef E_LOCAL
+#undef E_UNVERIFIED
+#undef E_GUARD_RESULT
+#undef E_INTERP_CHECKED
+#undef E_INTERP_NAME
@@ -0,0 +1,629 @@
+//
+// es_vm
+//
+// Baseline JIT: hot register groups (see e_program_translate) of verified programs are compiled to x86-64,
+// a region starts at a loop header or JMPFUN target and follows the groups it jumps or falls through to.
+// Anything else (calls, arrays, strings operations, ...) leaves the region and runs in the interpreter.
+//
+
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <stddef.h>
+#include "vm.h"
+#include "vm_builtins.h"
+
+#if defined(E_JIT) && E_JIT && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define E_JIT_X64 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define E_JIT_X64 0
+#endif
+
+#define E_JIT_BLOCK_SIZE	((size_t)65536)
+
+void
+e_jit_init(e_jit* jit) {
+	*jit = (e_jit) { .hot = E_JIT_HOT };
+}
+
+void
+e_vm_set_jit(e_vm* vm, e_jit* jit) {
+	/* Without E_JIT the vm ignores the jit, only unchecked runs of verified programs use it */
+	if(vm == NULL) return;
+	vm->jit = jit;
+}
+
+uint8_t
+e_jit_supported(void) {
+	return E_JIT_X64;
+}
+
+#if E_JIT_X64
+
+// Registers
+enum {
+	E_X_RAX = 0, E_X_RCX = 1, E_X_RDX = 2, E_X_RBX = 3, E_X_RSP = 4, E_X_RBP = 5, E_X_RSI = 6, E_X_RDI = 7,
+	E_X_R12 = 12, E_X_R13 = 13, E_X_R14 = 14, E_X_R15 = 15
+};
+
+/* Condition codes of jcc / setcc */
+enum {
+	E_X_CC_B = 0x2, E_X_CC_AE = 0x3, E_X_CC_E = 0x4, E_X_CC_NE = 0x5, E_X_CC_A = 0x7, E_X_CC_P = 0xA, E_X_CC_NP = 0xB,
+	E_X_CC_ALWAYS = 0xFF
+};
+
+/* While a region runs:
+     rbx  vm->globals        rbp  prog->rconsts       r12  steps left
+     r13  stack top at the start of the current group (temporaries)
+     r14  locals of the current call frame            r15  vm
+     [rsp] scratch, [rsp + 8] steps pointer */
+static const uint8_t e_jit_base[4] = {
+	[E_REG_CONST] = E_X_RBP,
+	[E_REG_GLOBAL] = E_X_RBX,
+	[E_REG_LOCAL] = E_X_R14,
+	[E_REG_TEMP] = E_X_R13
+};
+
+/* The generated code relies on the value layout */
+typedef char e_jit_value_layout[(sizeof(e_value) == 16 && offsetof(e_value, argtype) == 8 && sizeof(((e_value*)0)->argtype) == 4) ? 1 : -1];
+
+#define E_JIT_TYPE	8
+
+typedef struct {
+	uint32_t at;        /* Offset of the rel32 */
+	uint32_t group;     /* Jump target */
+} e_jit_patch;
+
+typedef struct {
+	uint8_t* buf;
+	uint32_t len;
+	uint32_t cap;
+	uint8_t ok;
+
+	const e_program* prog;
+	uint32_t region[E_JIT_MAX_GROUPS];      /* Groups in emission order */
+	uint32_t label[E_JIT_MAX_GROUPS];       /* Code offset of region[i] */
+	uint32_t rcount;
+	uint32_t current;                       /* Group being emitted */
+	e_jit_patch patches[E_JIT_MAX_GROUPS * 2];
+	uint32_t pcount;
+	uint32_t epilogue;
+} e_jit_asm;
+
+static void e_jit_emit(e_jit_asm* a, const uint8_t* bytes, uint32_t n);
+static void e_jit_u32(e_jit_asm* a, uint32_t v);
+static void e_jit_u64(e_jit_asm* a, uint64_t v);
+static void e_jit_mem(e_jit_asm* a, uint8_t prefix, uint8_t w, uint8_t op0, uint8_t op1, uint8_t reg, uint8_t base, int32_t disp);
+static void e_jit_call(e_jit_asm* a, const void* fn, e_reg arg0, const e_reg* arg1);
+static void e_jit_if_string(e_jit_asm* a, e_reg r, const void* fn);
+static void e_jit_exit(e_jit_asm* a, uint32_t ip);
+static void e_jit_jump(e_jit_asm* a, uint8_t cc, uint32_t ip);
+static uint32_t e_jit_region_add(e_jit_asm* a, uint32_t ip);
+static void e_jit_compare(e_jit_asm* a, uint8_t op, const e_rinstr* r);
+static uint32_t e_jit_guard(e_jit_asm* a, e_reg r, uint32_t* slow, uint32_t n);
+static uint32_t e_jit_slow(e_jit_asm* a, const uint32_t* slow, uint32_t n, const void* fn, uint8_t op, e_reg ra, e_reg rb);
+static void e_jit_rel32(e_jit_asm* a, uint32_t at);
+static void e_jit_group_code(e_jit_asm* a, uint32_t group);
+static void e_jit_prologue(e_jit_asm* a);
+static void e_jit_epilogue(e_jit_asm* a);
+static uint8_t* e_jit_place(e_jit* jit, const uint8_t* code, uint32_t len);
+static void e_jit_retain(const e_value* v);
+static void e_jit_release(const e_value* v);
+static double e_jit_arith(uint32_t op, const e_value* a, const e_value* b);
+static uint8_t e_jit_compare_values(uint32_t op, const e_value* a, const e_value* b);
+
+#define E_JIT_EMIT(a, ...)	e_jit_emit((a), (const uint8_t[]) { __VA_ARGS__ }, sizeof((const uint8_t[]) { __VA_ARGS__ }))
+
+// Helpers called by the native code
+void
+e_jit_retain(const e_value* v) {
+	e_value_retain(*v);
+}
+
+void
+e_jit_release(const e_value* v) {
+	e_value_release(*v);
+}
+
+double
+e_jit_arith(uint32_t op, const e_value* a, const e_value* b) {
+	return e_value_arith((uint8_t)op, *a, *b);
+}
+
+uint8_t
+e_jit_compare_values(uint32_t op, const e_value* a, const e_value* b) {
+	return e_value_compare((uint8_t)op, *a, *b);
+}
+
+// Jit state
+void
+e_jit_free(e_jit* jit) {
+	if(jit == NULL) return;
+	for(e_jit_block* b = jit->blocks; b != NULL; ) {
+		e_jit_block* next = b->next;
+		munmap(b, b->size);
+		b = next;
+	}
+	E_FREE(jit->groups);
+	uint32_t hot = jit->hot;
+	*jit = (e_jit) { .hot = hot };
+}
+
+uint8_t
+e_jit_begin(e_jit* jit, const e_program* prog) {
+	/* Called by the vm before it runs prog, another program drops the compiled code */
+	if(jit->prog == prog && jit->code == prog->code && jit->gcount == prog->rgcount) return 1;
+
+	e_jit_free(jit);
+	if(prog->rgcount == 0) return 0;
+	jit->groups = E_MALLOC(sizeof(e_jit_group) * prog->rgcount);
+	if(jit->groups == NULL) {
+		e_fail("Cannot allocate the jit");
+		return 0;
+	}
+	memset(jit->groups, 0, sizeof(e_jit_group) * prog->rgcount);
+	jit->gcount = prog->rgcount;
+	jit->prog = prog;
+	jit->code = prog->code;
+	if(jit->hot == 0) jit->hot = 1;
+
+	/* Candidates: targets of backward jumps and of JMPFUN */
+	for(uint32_t i = 0; i < prog->count; i++) {
+		const e_dinstr* d = &prog->code[i];
+		uint8_t loop = (d->OP == E_OP_JMP || d->OP == E_OP_JZ) && d->target <= i;
+		if(!loop && d->OP != E_OP_JMPFUN) continue;
+		if(d->target < prog->count && prog->code[d->target].OP == E_OP_REG) {
+			jit->groups[prog->code[d->target].target].candidate = 1;
+		}
+	}
+	return 1;
+}
+
+e_jit_fn
+e_jit_compile(e_jit* jit, const e_program* prog, uint32_t group) {
+	if(jit == NULL || group >= jit->gcount || prog != jit->prog) return NULL;
+
+	e_jit_asm* a = E_MALLOC(sizeof(e_jit_asm));
+	if(a == NULL) return NULL;
+	*a = (e_jit_asm) { .ok = 1, .prog = prog };
+
+	/* Exits jump back to the epilogue, the region is entered after it */
+	e_jit_epilogue(a);
+	uint32_t entry = a->len;
+	e_jit_prologue(a);
+
+	const e_rgroup* g = &prog->rgroups[group];
+	e_jit_region_add(a, g->end - g->steps);
+	for(uint32_t i = 0; i < a->rcount && a->ok; i++) {
+		a->current = i;
+		a->label[i] = a->len;
+		e_jit_group_code(a, a->region[i]);
+	}
+
+	for(uint32_t p = 0; p < a->pcount && a->ok; p++) {
+		uint32_t to = 0;
+		for(uint32_t i = 0; i < a->rcount; i++) {
+			if(a->region[i] == a->patches[p].group) to = a->label[i];
+		}
+		int32_t rel = (int32_t)to - (int32_t)(a->patches[p].at + 4);
+		memcpy(&a->buf[a->patches[p].at], &rel, 4);
+	}
+
+	uint8_t* code = a->ok ? e_jit_place(jit, a->buf, a->len) : NULL;
+	E_FREE(a->buf);
+	E_FREE(a);
+	if(code == NULL) return NULL;
+
+	/* Object to function pointer, POSIX guarantees the conversion */
+	e_jit_fn fn;
+	uint8_t* start = code + entry;
+	memcpy(&fn, &start, sizeof(fn));
+	jit->groups[group].fn = fn;
+	jit->compiled++;
+	return fn;
+}
+
+uint8_t*
+e_jit_place(e_jit* jit, const uint8_t* code, uint32_t len) {
+	/* Blocks are only writable while code is copied into them */
+	const size_t header = (sizeof(e_jit_block) + 15) & ~(size_t)15;
+	e_jit_block* b = jit->blocks;
+	if(b == NULL || b->size - b->used < len) {
+		long page = sysconf(_SC_PAGESIZE);
+		size_t size = E_JIT_BLOCK_SIZE;
+		while(size < header + len) size *= 2;
+		if(page > 0) size = (size + (size_t)page - 1) & ~((size_t)page - 1);
+
+		void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED) {
+			e_fail("Cannot allocate executable memory");
+			return NULL;
+		}
+		b = mem;
+		*b = (e_jit_block) { .next = jit->blocks, .size = size, .used = header };
+		jit->blocks = b;
+	} else if(mprotect(b, b->size, PROT_READ | PROT_WRITE) != 0) {
+		return NULL;
+	}
+
+	uint8_t* dst = (uint8_t*)b + b->used;
+	memcpy(dst, code, len);
+	b->used = (b->used + len + 15) & ~(size_t)15;
+	if(b->used > b->size) b->used = b->size;
+	if(mprotect(b, b->size, PROT_READ | PROT_EXEC) != 0) {
+		e_fail("Cannot map executable memory");
+		return NULL;
+	}
+	jit->bytes += len;
+	return dst;
+}
+
+// Regions
+uint32_t
+e_jit_region_add(e_jit_asm* a, uint32_t ip) {
+	/* Returns the group's position in the region, E_TARGET_INVALID if ip is no group head or the region is full */
+	if(ip >= a->prog->count || a->prog->code[ip].OP != E_OP_REG) return E_TARGET_INVALID;
+
+	uint32_t group = a->prog->code[ip].target;
+	for(uint32_t i = 0; i < a->rcount; i++) {
+		if(a->region[i] == group) return i;
+	}
+	if(a->rcount == E_JIT_MAX_GROUPS) return E_TARGET_INVALID;
+	a->region[a->rcount] = group;
+	a->label[a->rcount] = E_TARGET_INVALID;
+	return a->rcount++;
+}
+
+void
+e_jit_group_code(e_jit_asm* a, uint32_t group) {
+	const e_rgroup* g = &a->prog->rgroups[group];
+	const int32_t delta = g->delta * (int32_t)sizeof(e_value);
+	uint8_t ended = 0;
+
+	/* The group it falls through to is emitted right after it */
+	if(g->count == 0 || a->prog->rcode[g->first + g->count - 1].op != E_OP_JMP) e_jit_region_add(a, g->end);
+
+	/* The group needs steps for all of its instructions, like in the interpreter */
+	E_JIT_EMIT(a, 0x49, 0x81, 0xFC);                        /* cmp r12, steps */
+	e_jit_u32(a, g->steps);
+	E_JIT_EMIT(a, 0x73, 0x0A);                              /* jae +10 */
+	e_jit_exit(a, g->end - g->steps);
+	E_JIT_EMIT(a, 0x49, 0x81, 0xEC);                        /* sub r12, steps */
+	e_jit_u32(a, g->steps);
+
+	for(uint32_t k = 0; k < g->count && a->ok; k++) {
+		const e_rinstr* r = &a->prog->rcode[g->first + k];
+		const uint8_t ba = e_jit_base[r->a.kind & 3];
+		const uint8_t bb = e_jit_base[r->b.kind & 3];
+		const uint8_t bd = e_jit_base[r->dst.kind & 3];
+		const int32_t da = r->a.index * (int32_t)sizeof(e_value);
+		const int32_t db = r->b.index * (int32_t)sizeof(e_value);
+		const int32_t dd = r->dst.index * (int32_t)sizeof(e_value);
+		uint8_t branch = 0;
+
+		switch(r->op) {
+			case E_OP_MOV:
+				if(r->a.kind == E_REG_GLOBAL || r->a.kind == E_REG_LOCAL) e_jit_if_string(a, r->a, (const void*)&e_jit_retain);
+				if(r->dst.kind != E_REG_TEMP) e_jit_if_string(a, r->dst, (const void*)&e_jit_release);
+				e_jit_mem(a, 0, 0, 0x0F, 0x10, 0, ba, da);      /* movups xmm0, a */
+				e_jit_mem(a, 0, 0, 0x0F, 0x11, 0, bd, dd);      /* movups dst, xmm0 */
+				continue;
+			case E_OP_ADD:
+			case E_OP_SUB:
+			case E_OP_MUL:
+			case E_OP_DIV:
+			case E_OP_NEG: {
+				/* Numbers inline, anything else through e_value_arith */
+				static const uint8_t ops[] = { [E_OP_ADD - E_OP_ADD] = 0x58, [E_OP_SUB - E_OP_ADD] = 0x5C,
+											   [E_OP_MUL - E_OP_ADD] = 0x59, [E_OP_DIV - E_OP_ADD] = 0x5E };
+				uint32_t slow[2];
+				uint32_t n = e_jit_guard(a, r->a, slow, 0);
+				if(r->op == E_OP_NEG) {
+					e_jit_mem(a, 0, 1, 0x8B, 0, E_X_RAX, ba, da);   /* mov rax, a */
+					E_JIT_EMIT(a, 0x48, 0x0F, 0xBA, 0xF8, 0x3F,     /* btc rax, 63 */
+							   0x66, 0x48, 0x0F, 0x6E, 0xC0);       /* movq xmm0, rax */
+				} else {
+					n = e_jit_guard(a, r->b, slow, n);
+					e_jit_mem(a, 0xF2, 0, 0x0F, 0x10, 0, ba, da);   /* movsd xmm0, a */
+					e_jit_mem(a, 0xF2, 0, 0x0F, ops[r->op - E_OP_ADD], 0, bb, db);
+				}
+				e_jit_slow(a, slow, n, (const void*)&e_jit_arith, r->op, r->a, r->op == E_OP_NEG ? r->a : r->b);
+				E_JIT_EMIT(a, 0xF2, 0x0F, 0x11, 0x04, 0x24);        /* movsd [rsp], xmm0 */
+				break;
+			}
+			case E_OP_NOT:
+				e_jit_mem(a, 0xF2, 0, 0x0F, 0x10, 0, ba, da);   /* movsd xmm0, a */
+				E_JIT_EMIT(a, 0x66, 0x0F, 0x57, 0xC9,           /* xorpd xmm1, xmm1 */
+						   0x66, 0x0F, 0x2E, 0xC1,              /* ucomisd xmm0, xmm1 */
+						   0x0F, 0x94, 0xC0,                    /* sete al */
+						   0x0F, 0x9B, 0xC1,                    /* setnp cl */
+						   0x20, 0xC8);                         /* and al, cl */
+				goto number;
+			case E_OP_EQ: case E_OP_NOTEQ: case E_OP_LT: case E_OP_GT: case E_OP_LTEQ: case E_OP_GTEQ:
+				e_jit_compare(a, r->op, r);
+			number:
+				E_JIT_EMIT(a, 0x0F, 0xB6, 0xC0,                 /* movzx eax, al */
+						   0xF2, 0x0F, 0x2A, 0xC0,              /* cvtsi2sd xmm0, eax */
+						   0xF2, 0x0F, 0x11, 0x04, 0x24);       /* movsd [rsp], xmm0 */
+				break;
+			case E_OP_JMP:
+				if(delta != 0) e_jit_mem(a, 0, 1, 0x8D, 0, E_X_R13, E_X_R13, delta);
+				e_jit_jump(a, E_X_CC_ALWAYS, r->target);
+				ended = 1;
+				continue;
+			case E_OP_JZ:
+				e_jit_mem(a, 0xF2, 0, 0x0F, 0x10, 0, ba, da);   /* movsd xmm0, a */
+				E_JIT_EMIT(a, 0x66, 0x0F, 0x57, 0xC9,           /* xorpd xmm1, xmm1 */
+						   0x66, 0x0F, 0x2E, 0xC1,              /* ucomisd xmm0, xmm1 */
+						   0x0F, 0x95, 0xC0,                    /* setne al */
+						   0x0F, 0x9A, 0xC1,                    /* setp cl */
+						   0x08, 0xC8);                         /* or al, cl */
+				branch = 1;
+				break;
+			case E_OP_EQ_JZ: case E_OP_NOTEQ_JZ: case E_OP_LT_JZ: case E_OP_GT_JZ: case E_OP_LTEQ_JZ: case E_OP_GTEQ_JZ:
+				e_jit_compare(a, (uint8_t)(E_OP_EQ + (r->op - E_OP_EQ_JZ)), r);
+				branch = 1;
+				break;
+			default:
+				a->ok = 0;
+				continue;
+		}
+
+		/* Result / condition is in [rsp], temporaries are released after use */
+		if(branch) E_JIT_EMIT(a, 0x88, 0x04, 0x24);             /* mov [rsp], al */
+		if(r->a.kind == E_REG_TEMP) e_jit_if_string(a, r->a, (const void*)&e_jit_release);
+		if(r->b.kind == E_REG_TEMP) e_jit_if_string(a, r->b, (const void*)&e_jit_release);
+
+		if(branch) {
+			if(delta != 0) e_jit_mem(a, 0, 1, 0x8D, 0, E_X_R13, E_X_R13, delta);
+			E_JIT_EMIT(a, 0x80, 0x3C, 0x24, 0x00);              /* cmp byte [rsp], 0 */
+			e_jit_jump(a, E_X_CC_E, r->target);
+			ended = 2;
+			continue;
+		}
+		if(r->dst.kind != E_REG_TEMP) e_jit_if_string(a, r->dst, (const void*)&e_jit_release);
+		E_JIT_EMIT(a, 0x48, 0x8B, 0x04, 0x24);                  /* mov rax, [rsp] */
+		e_jit_mem(a, 0, 1, 0x89, 0, E_X_RAX, bd, dd);              /* mov dst, rax */
+		e_jit_mem(a, 0, 0, 0xC7, 0, 0, bd, dd + E_JIT_TYPE);    /* mov dword dst.argtype, E_NUMBER */
+		e_jit_u32(a, E_NUMBER);
+	}
+
+	/* Fall through to the instruction after the group */
+	if(ended == 1) return;
+	if(ended == 0 && delta != 0) e_jit_mem(a, 0, 1, 0x8D, 0, E_X_R13, E_X_R13, delta);
+	e_jit_jump(a, E_X_CC_ALWAYS, g->end);
+}
+
+void
+e_jit_compare(e_jit_asm* a, uint8_t op, const e_rinstr* r) {
+	/* al = a op b, two numbers inline, anything else through e_value_compare */
+	const uint8_t ba = e_jit_base[r->a.kind & 3];
+	const uint8_t bb = e_jit_base[r->b.kind & 3];
+	const int32_t da = r->a.index * (int32_t)sizeof(e_value);
+	const int32_t db = r->b.index * (int32_t)sizeof(e_value);
+	uint32_t slow[2];
+	uint32_t n = e_jit_guard(a, r->b, slow, e_jit_guard(a, r->a, slow, 0));
+
+	if(op == E_OP_EQ || op == E_OP_NOTEQ) {
+		e_jit_mem(a, 0xF2, 0, 0x0F, 0x10, 0, ba, da);               /* movsd xmm0, a */
+		e_jit_mem(a, 0x66, 0, 0x0F, 0x2E, 0, bb, db);               /* ucomisd xmm0, b */
+		E_JIT_EMIT(a, 0x0F, 0x94, 0xC0,                             /* sete al */
+				   0x0F, 0x9B, 0xC1,                                /* setnp cl */
+				   0x20, 0xC8);                                     /* and al, cl */
+		if(op == E_OP_NOTEQ) E_JIT_EMIT(a, 0x34, 0x01);             /* xor al, 1 */
+	} else {
+		/* Unordered (NaN) compares false: a < b is b above a, a <= b is b above or equal a */
+		uint8_t swap = op == E_OP_LT || op == E_OP_LTEQ;
+		e_jit_mem(a, 0xF2, 0, 0x0F, 0x10, 0, swap ? bb : ba, swap ? db : da);
+		e_jit_mem(a, 0x66, 0, 0x0F, 0x2E, 0, swap ? ba : bb, swap ? da : db);
+		E_JIT_EMIT(a, 0x0F, (uint8_t)(0x90 | (op == E_OP_LT || op == E_OP_GT ? E_X_CC_A : E_X_CC_AE)), 0xC0);
+	}
+	e_jit_slow(a, slow, n, (const void*)&e_jit_compare_values, op, r->a, r->b);
+}
+
+uint32_t
+e_jit_guard(e_jit_asm* a, e_reg r, uint32_t* slow, uint32_t n) {
+	/* Jumps to the slow path unless r is a number, constants always are */
+	if(r.kind == E_REG_CONST) return n;
+	e_jit_mem(a, 0, 0, 0x83, 0, 7, e_jit_base[r.kind & 3], r.index * (int32_t)sizeof(e_value) + E_JIT_TYPE);
+	E_JIT_EMIT(a, E_NUMBER, 0x0F, 0x85, 0, 0, 0, 0);          /* cmp dword r.argtype, E_NUMBER, jne slow */
+	slow[n] = a->len - 4;
+	return n + 1;
+}
+
+uint32_t
+e_jit_slow(e_jit_asm* a, const uint32_t* slow, uint32_t n, const void* fn, uint8_t op, e_reg ra, e_reg rb) {
+	/* After the fast path: jmp done, slow: fn(op, &ra, &rb), done: */
+	if(n == 0) return 0;
+	E_JIT_EMIT(a, 0xE9, 0, 0, 0, 0);
+	uint32_t done = a->len - 4;
+	for(uint32_t i = 0; i < n; i++) {
+		e_jit_rel32(a, slow[i]);
+	}
+	E_JIT_EMIT(a, 0xBF);                                        /* mov edi, op */
+	e_jit_u32(a, op);
+	e_jit_mem(a, 0, 1, 0x8D, 0, E_X_RSI, e_jit_base[ra.kind & 3], ra.index * (int32_t)sizeof(e_value));
+	e_jit_mem(a, 0, 1, 0x8D, 0, E_X_RDX, e_jit_base[rb.kind & 3], rb.index * (int32_t)sizeof(e_value));
+	E_JIT_EMIT(a, 0x48, 0xB8);                                  /* mov rax, fn */
+	e_jit_u64(a, (uint64_t)(uintptr_t)fn);
+	E_JIT_EMIT(a, 0xFF, 0xD0);                                  /* call rax */
+	e_jit_rel32(a, done);
+	return 1;
+}
+
+void
+e_jit_rel32(e_jit_asm* a, uint32_t at) {
+	/* Points the rel32 at `at` to the current position */
+	if(!a->ok) return;
+	int32_t rel = (int32_t)a->len - (int32_t)(at + 4);
+	memcpy(&a->buf[at], &rel, 4);
+}
+
+// Control flow
+void
+e_jit_exit(e_jit_asm* a, uint32_t ip) {
+	/* 10 bytes: mov edx, ip, jmp epilogue */
+	E_JIT_EMIT(a, 0xBA);
+	e_jit_u32(a, ip);
+	E_JIT_EMIT(a, 0xE9);
+	e_jit_u32(a, (uint32_t)((int32_t)a->epilogue - (int32_t)(a->len + 4)));
+}
+
+void
+e_jit_jump(e_jit_asm* a, uint8_t cc, uint32_t ip) {
+	/* Jumps within the region go to the group's code, everything else leaves the region */
+	uint32_t i = e_jit_region_add(a, ip);
+	if(i == E_TARGET_INVALID) {
+		if(cc != E_X_CC_ALWAYS) E_JIT_EMIT(a, (uint8_t)(0x70 | (cc ^ 1)), 0x0A);    /* skip the exit unless cc */
+		e_jit_exit(a, ip);
+		return;
+	}
+	if(cc == E_X_CC_ALWAYS && i == a->current + 1 && a->label[i] == E_TARGET_INVALID) return;     /* emitted next */
+
+	if(cc == E_X_CC_ALWAYS) {
+		E_JIT_EMIT(a, 0xE9);
+	} else {
+		E_JIT_EMIT(a, 0x0F, (uint8_t)(0x80 | cc));
+	}
+	if(a->label[i] != E_TARGET_INVALID) {
+		e_jit_u32(a, (uint32_t)((int32_t)a->label[i] - (int32_t)(a->len + 4)));
+	} else if(a->pcount < sizeof(a->patches) / sizeof(a->patches[0])) {
+		a->patches[a->pcount++] = (e_jit_patch) { .at = a->len, .group = a->region[i] };
+		e_jit_u32(a, 0);
+	} else {
+		a->ok = 0;
+	}
+}
+
+void
+e_jit_prologue(e_jit_asm* a) {
+	/* uint32_t fn(e_vm* vm (rdi), e_value* locals (rsi), uint64_t* steps (rdx)) */
+	E_JIT_EMIT(a, 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,    /* push rbx, rbp, r12 - r15 */
+			   0x48, 0x83, 0xEC, 0x18,                                          /* sub rsp, 24 */
+			   0x49, 0x89, 0xFF,                                                /* mov r15, rdi */
+			   0x49, 0x89, 0xF6,                                                /* mov r14, rsi */
+			   0x48, 0x89, 0x54, 0x24, 0x08,                                    /* mov [rsp + 8], rdx */
+			   0x4C, 0x8B, 0x22);                                               /* mov r12, [rdx] */
+	e_jit_mem(a, 0, 1, 0x8B, 0, E_X_RBX, E_X_R15, (int32_t)offsetof(e_vm, globals));             /* mov rbx, vm->globals */
+	E_JIT_EMIT(a, 0x48, 0xBD);                                                  /* mov rbp, rconsts */
+	e_jit_u64(a, (uint64_t)(uintptr_t)a->prog->rconsts);
+	e_jit_mem(a, 0, 1, 0x8B, 0, E_X_R13, E_X_R15, (int32_t)offsetof(e_vm, stack.entries));       /* mov r13, vm->stack.entries */
+	e_jit_mem(a, 0, 0, 0x8B, 0, E_X_RAX, E_X_R15, (int32_t)offsetof(e_vm, stack.top));
+	E_JIT_EMIT(a, 0x48, 0xC1, 0xE0, 0x04,                                       /* shl rax, 4 */
+			   0x49, 0x01, 0xC5);                                               /* add r13, rax */
+}
+
+void
+e_jit_epilogue(e_jit_asm* a) {
+	/* Exits: edx is the instruction index, steps and the stack top are written back */
+	a->epilogue = a->len;
+	E_JIT_EMIT(a, 0x48, 0x8B, 0x4C, 0x24, 0x08,                                 /* mov rcx, [rsp + 8] */
+			   0x4C, 0x89, 0x21);                                               /* mov [rcx], r12 */
+	e_jit_mem(a, 0, 1, 0x8B, 0, E_X_RCX, E_X_R15, (int32_t)offsetof(e_vm, stack.entries));       /* mov rcx, vm->stack.entries */
+	E_JIT_EMIT(a, 0x4C, 0x89, 0xE8,                                             /* mov rax, r13 */
+			   0x48, 0x29, 0xC8,                                                /* sub rax, rcx */
+			   0x48, 0xC1, 0xE8, 0x04);                                         /* shr rax, 4 */
+	e_jit_mem(a, 0, 0, 0x89, 0, E_X_RAX, E_X_R15, (int32_t)offsetof(e_vm, stack.top));
+	E_JIT_EMIT(a, 0x89, 0xD0,                                                   /* mov eax, edx */
+			   0x48, 0x83, 0xC4, 0x18,                                          /* add rsp, 24 */
+			   0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B,      /* pop r15 - r12, rbp, rbx */
+			   0xC3);                                                           /* ret */
+}
+
+// Encoding
+void
+e_jit_emit(e_jit_asm* a, const uint8_t* bytes, uint32_t n) {
+	if(!a->ok) return;
+	if(a->len + n > a->cap) {
+		uint32_t cap = a->cap ? a->cap * 2 : 4096;
+		while(cap < a->len + n) cap *= 2;
+		uint8_t* buf = E_REALLOC(a->buf, cap);
+		if(buf == NULL) {
+			a->ok = 0;
+			return;
+		}
+		a->buf = buf;
+		a->cap = cap;
+	}
+	memcpy(&a->buf[a->len], bytes, n);
+	a->len += n;
+}
+
+void
+e_jit_u32(e_jit_asm* a, uint32_t v) {
+	uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+	e_jit_emit(a, b, 4);
+}
+
+void
+e_jit_u64(e_jit_asm* a, uint64_t v) {
+	e_jit_u32(a, (uint32_t)v);
+	e_jit_u32(a, (uint32_t)(v >> 32));
+}
+
+void
+e_jit_mem(e_jit_asm* a, uint8_t prefix, uint8_t w, uint8_t op0, uint8_t op1, uint8_t reg, uint8_t base, int32_t disp) {
+	/* [prefix] [REX] op0 [op1] ModRM(reg, [base + disp32]) [SIB], op1 == 0 for one byte opcodes */
+	uint8_t rex = (uint8_t)(0x40 | (w ? 8 : 0) | (reg >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0));
+	uint8_t b[9];
+	uint32_t n = 0;
+	if(prefix) b[n++] = prefix;
+	if(rex != 0x40) b[n++] = rex;
+	b[n++] = op0;
+	if(op1) b[n++] = op1;
+	b[n++] = (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7));
+	if((base & 7) == E_X_RSP) b[n++] = 0x24;
+	e_jit_emit(a, b, n);
+	e_jit_u32(a, (uint32_t)disp);
+}
+
+void
+e_jit_call(e_jit_asm* a, const void* fn, e_reg arg0, const e_reg* arg1) {
+	/* fn(&arg0, &arg1), the stack is 16 byte aligned after the prologue */
+	e_jit_mem(a, 0, 1, 0x8D, 0, E_X_RDI, e_jit_base[arg0.kind & 3], arg0.index * (int32_t)sizeof(e_value));
+	if(arg1 != NULL) {
+		e_jit_mem(a, 0, 1, 0x8D, 0, E_X_RSI, e_jit_base[arg1->kind & 3], arg1->index * (int32_t)sizeof(e_value));
+	}
+	E_JIT_EMIT(a, 0x48, 0xB8);                                  /* mov rax, fn */
+	e_jit_u64(a, (uint64_t)(uintptr_t)fn);
+	E_JIT_EMIT(a, 0xFF, 0xD0);                                  /* call rax */
+}
+
+void
+e_jit_if_string(e_jit_asm* a, e_reg r, const void* fn) {
+	/* if(r.argtype == E_STRING) fn(&r) */
+	e_jit_mem(a, 0, 0, 0x83, 0, 7, e_jit_base[r.kind & 3], r.index * (int32_t)sizeof(e_value) + E_JIT_TYPE);
+	E_JIT_EMIT(a, E_STRING, 0x75, 0x00);                        /* jne skip */
+	uint32_t skip = a->len - 1;
+	e_jit_call(a, fn, r, NULL);
+	if(a->ok) a->buf[skip] = (uint8_t)(a->len - skip - 1);
+}
+
+#else
+
+void
+e_jit_free(e_jit* jit) {
+	if(jit == NULL) return;
+	E_FREE(jit->groups);
+	uint32_t hot = jit->hot;
+	*jit = (e_jit) { .hot = hot };
+}
+
+uint8_t
+e_jit_begin(e_jit* jit, const e_program* prog) {
+	(void)jit;
+	(void)prog;
+	return 0;
+}
+
+e_jit_fn
+e_jit_compile(e_jit* jit, const e_program* prog, uint32_t group) {
+	(void)jit;
+	(void)prog;
+	(void)group;
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,80 @@
+//
+// es_vm
+//
+
+#include <stdio.h>
+#include "vm.h"
+#include "vm_builtins.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define E_USE_MMAP 1
+#else
+#define E_USE_MMAP 0
+#endif
+
+#if E_USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+e_vm_status
+e_program_load_file(e_program* prog, const char* path) {
+	if(prog == NULL || path == NULL) return E_VM_STATUS_ERROR;
+
+#if E_USE_MMAP
+	/* Map the compiled script read-only and decode it in place */
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		e_fail("Cannot open script file");
+		return E_VM_STATUS_ERROR;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > UINT32_MAX) {
+		close(fd);
+		e_fail("Invalid script file size");
+		return E_VM_STATUS_ERROR;
+	}
+
+	void* bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(bytes == MAP_FAILED) {
+		e_fail("Cannot map script file");
+		return E_VM_STATUS_ERROR;
+	}
+
+	e_vm_status s = e_program_load_buffer(prog, (const uint8_t*)bytes, (uint32_t)st.st_size);
+	munmap(bytes, st.st_size);
+	return s;
+#else
+	FILE* f = fopen(path, "rb");
+	if(f == NULL) {
+		e_fail("Cannot open script file");
+		return E_VM_STATUS_ERROR;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if(size <= 0) {
+		fclose(f);
+		e_fail("Invalid script file size");
+		return E_VM_STATUS_ERROR;
+	}
+
+	uint8_t* bytes = E_MALLOC(size);
+	if(bytes == NULL || fread(bytes, 1, size, f) != (size_t)size) {
+		E_FREE(bytes);
+		fclose(f);
+		e_fail("Cannot read script file");
+		return E_VM_STATUS_ERROR;
+	}
+	fclose(f);
+
+	e_vm_status s = e_program_load_buffer(prog, bytes, (uint32_t)size);
+	E_FREE(bytes);
+	return s;
+#endif
+}
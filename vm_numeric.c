@@ -0,0 +1,146 @@
+//
+// es_vm
+//
+
+#include <math.h>
+#include "vm.h"
+
+// Numeric kernels over the numeric column of an array (see e_api_get_numbers), two numbers per SSE2 vector
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define E_NUMERIC_SSE2 1
+#include <emmintrin.h>
+#else
+#define E_NUMERIC_SSE2 0
+#endif
+
+double
+e_numeric_sum(const double* x, uint32_t len) {
+	/* Summed in four interleaved partial sums, so the result may differ in the last bits from a sequential loop */
+	uint32_t i = 0;
+#if E_NUMERIC_SSE2
+	__m128d s0 = _mm_setzero_pd();
+	__m128d s1 = _mm_setzero_pd();
+	for(; i + 4 <= len; i += 4) {
+		s0 = _mm_add_pd(s0, _mm_loadu_pd(x + i));
+		s1 = _mm_add_pd(s1, _mm_loadu_pd(x + i + 2));
+	}
+	s0 = _mm_add_pd(s0, s1);
+	double sum = _mm_cvtsd_f64(_mm_add_sd(s0, _mm_unpackhi_pd(s0, s0)));
+#else
+	double s[4] = { 0, 0, 0, 0 };
+	for(; i + 4 <= len; i += 4) {
+		s[0] += x[i];
+		s[1] += x[i + 1];
+		s[2] += x[i + 2];
+		s[3] += x[i + 3];
+	}
+	double sum = (s[0] + s[2]) + (s[1] + s[3]);
+#endif
+	for(; i < len; i++) sum += x[i];
+	return sum;
+}
+
+double
+e_numeric_min(const double* x, uint32_t len) {
+	/* NaN if there are no elements or one of them is NaN */
+	uint32_t i = 0;
+	double m = INFINITY;
+	uint8_t nan = len == 0;
+#if E_NUMERIC_SSE2
+	__m128d vm = _mm_set1_pd(INFINITY);
+	__m128d vn = _mm_setzero_pd();
+	for(; i + 2 <= len; i += 2) {
+		__m128d v = _mm_loadu_pd(x + i);
+		vm = _mm_min_pd(v, vm);
+		vn = _mm_or_pd(vn, _mm_cmpunord_pd(v, v));
+	}
+	vm = _mm_min_sd(vm, _mm_unpackhi_pd(vm, vm));
+	m = _mm_cvtsd_f64(vm);
+	nan |= _mm_movemask_pd(vn) != 0;
+#endif
+	for(; i < len; i++) {
+		nan |= x[i] != x[i];
+		m = x[i] < m ? x[i] : m;
+	}
+	return nan ? NAN : m;
+}
+
+double
+e_numeric_max(const double* x, uint32_t len) {
+	/* NaN if there are no elements or one of them is NaN */
+	uint32_t i = 0;
+	double m = -INFINITY;
+	uint8_t nan = len == 0;
+#if E_NUMERIC_SSE2
+	__m128d vm = _mm_set1_pd(-INFINITY);
+	__m128d vn = _mm_setzero_pd();
+	for(; i + 2 <= len; i += 2) {
+		__m128d v = _mm_loadu_pd(x + i);
+		vm = _mm_max_pd(v, vm);
+		vn = _mm_or_pd(vn, _mm_cmpunord_pd(v, v));
+	}
+	vm = _mm_max_sd(vm, _mm_unpackhi_pd(vm, vm));
+	m = _mm_cvtsd_f64(vm);
+	nan |= _mm_movemask_pd(vn) != 0;
+#endif
+	for(; i < len; i++) {
+		nan |= x[i] != x[i];
+		m = x[i] > m ? x[i] : m;
+	}
+	return nan ? NAN : m;
+}
+
+double
+e_numeric_dot(const double* x, const double* y, uint32_t len) {
+	uint32_t i = 0;
+#if E_NUMERIC_SSE2
+	__m128d s0 = _mm_setzero_pd();
+	__m128d s1 = _mm_setzero_pd();
+	for(; i + 4 <= len; i += 4) {
+		s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+		s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+	}
+	s0 = _mm_add_pd(s0, s1);
+	double sum = _mm_cvtsd_f64(_mm_add_sd(s0, _mm_unpackhi_pd(s0, s0)));
+#else
+	double s[4] = { 0, 0, 0, 0 };
+	for(; i + 4 <= len; i += 4) {
+		s[0] += x[i] * y[i];
+		s[1] += x[i + 1] * y[i + 1];
+		s[2] += x[i + 2] * y[i + 2];
+		s[3] += x[i + 3] * y[i + 3];
+	}
+	double sum = (s[0] + s[2]) + (s[1] + s[3]);
+#endif
+	for(; i < len; i++) sum += x[i] * y[i];
+	return sum;
+}
+
+void
+e_numeric_scale(double* x, uint32_t len, double k) {
+	uint32_t i = 0;
+#if E_NUMERIC_SSE2
+	__m128d vk = _mm_set1_pd(k);
+	for(; i + 2 <= len; i += 2) {
+		_mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), vk));
+	}
+#endif
+	for(; i < len; i++) x[i] *= k;
+}
+
+void
+e_numeric_clamp(double* x, uint32_t len, double lo, double hi) {
+	/* NaN elements stay NaN */
+	uint32_t i = 0;
+#if E_NUMERIC_SSE2
+	__m128d vlo = _mm_set1_pd(lo);
+	__m128d vhi = _mm_set1_pd(hi);
+	for(; i + 2 <= len; i += 2) {
+		_mm_storeu_pd(x + i, _mm_min_pd(vhi, _mm_max_pd(vlo, _mm_loadu_pd(x + i))));
+	}
+#endif
+	for(; i < len; i++) {
+		double v = lo > x[i] ? lo : x[i];
+		x[i] = hi < v ? hi : v;
+	}
+}
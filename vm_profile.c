@@ -0,0 +1,187 @@
+//
+// es_vm
+//
+
+#include <string.h>
+#include "vm.h"
+#include "vm_builtins.h"
+
+static const char* const e_opcode_names[256] = {
+	[E_OP_NOP] = "NOP",
+	[E_OP_PUSHG] = "PUSHG",
+	[E_OP_POPG] = "POPG",
+	[E_OP_PUSHL] = "PUSHL",
+	[E_OP_POPL] = "POPL",
+	[E_OP_PUSH] = "PUSH",
+	[E_OP_PUSHS] = "PUSHS",
+	[E_OP_DATA] = "DATA",
+	[E_OP_PUSHA] = "PUSHA",
+	[E_OP_PUSHAS] = "PUSHAS",
+	[E_OP_EQ] = "EQ",
+	[E_OP_LT] = "LT",
+	[E_OP_GT] = "GT",
+	[E_OP_LTEQ] = "LTEQ",
+	[E_OP_GTEQ] = "GTEQ",
+	[E_OP_NOTEQ] = "NOTEQ",
+	[E_OP_ADD] = "ADD",
+	[E_OP_NEG] = "NEG",
+	[E_OP_SUB] = "SUB",
+	[E_OP_MUL] = "MUL",
+	[E_OP_DIV] = "DIV",
+	[E_OP_AND] = "AND",
+	[E_OP_OR] = "OR",
+	[E_OP_NOT] = "NOT",
+	[E_OP_CONCAT] = "CONCAT",
+	[E_OP_MOD] = "MOD",
+	[E_OP_JZ] = "JZ",
+	[E_OP_JMP] = "JMP",
+	[E_OP_JFS] = "JFS",
+	[E_OP_JMPFUN] = "JMPFUN",
+	[E_OP_CALL] = "CALL",
+	[E_OP_PRINT] = "PRINT",
+	[E_OP_ARGTYPE] = "ARGTYPE",
+	[E_OP_LEN] = "LEN",
+	[E_OP_ARRAY] = "ARRAY",
+	[E_OP_HALT] = "HALT",
+	[E_OP_ADD_NUM_NUM] = "ADD_NUM_NUM",
+	[E_OP_SUB_NUM_NUM] = "SUB_NUM_NUM",
+	[E_OP_MUL_NUM_NUM] = "MUL_NUM_NUM",
+	[E_OP_DIV_NUM_NUM] = "DIV_NUM_NUM",
+	[E_OP_EQ_NUM_NUM] = "EQ_NUM_NUM",
+	[E_OP_LT_NUM_NUM] = "LT_NUM_NUM",
+	[E_OP_GT_NUM_NUM] = "GT_NUM_NUM",
+	[E_OP_LTEQ_NUM_NUM] = "LTEQ_NUM_NUM",
+	[E_OP_GTEQ_NUM_NUM] = "GTEQ_NUM_NUM",
+	[E_OP_NOTEQ_NUM_NUM] = "NOTEQ_NUM_NUM",
+	[E_OP_EQ_STR_STR] = "EQ_STR_STR",
+	[E_OP_NOTEQ_STR_STR] = "NOTEQ_STR_STR",
+	[E_OP_POPG_ADDK] = "POPG_ADDK",
+	[E_OP_POPG_SUBK] = "POPG_SUBK",
+	[E_OP_POPL_ADDK] = "POPL_ADDK",
+	[E_OP_POPL_SUBK] = "POPL_SUBK",
+	[E_OP_EQ_JZ] = "EQ_JZ",
+	[E_OP_LT_JZ] = "LT_JZ",
+	[E_OP_GT_JZ] = "GT_JZ",
+	[E_OP_LTEQ_JZ] = "LTEQ_JZ",
+	[E_OP_GTEQ_JZ] = "GTEQ_JZ",
+	[E_OP_NOTEQ_JZ] = "NOTEQ_JZ",
+	[E_OP_PUSHA_POPG] = "PUSHA_POPG",
+	[E_OP_PUSHA_POPL] = "PUSHA_POPL",
+	[E_OP_CALLI] = "CALLI",
+	[E_OP_REG] = "REG",
+	[E_OP_MOV] = "MOV",
+};
+
+static void e_profile_frames_clear(e_profile* prof);
+
+const char*
+e_opcode_name(uint8_t op) {
+	return e_opcode_names[op] != NULL ? e_opcode_names[op] : "INVALID";
+}
+
+void
+e_profile_init(e_profile* prof) {
+	if(prof == NULL) return;
+	memset(prof, 0, sizeof(e_profile));
+	prof->period = E_PROFILE_PERIOD;
+	prof->countdown = E_PROFILE_PERIOD;
+	prof->sample_op = E_PROFILE_NO_SAMPLE;
+	e_profile_frames_clear(prof);
+}
+
+void
+e_profile_clear(e_profile* prof) {
+	/* Resets all counters, the profile stays attached to its program */
+	if(prof == NULL) return;
+	memset(prof->ops, 0, sizeof(prof->ops));
+	if(prof->ips != NULL) {
+		memset(prof->ips, 0, sizeof(e_profile_ip) * prof->ip_count);
+	}
+	prof->cycles = 0;
+	prof->sample_op = E_PROFILE_NO_SAMPLE;
+	e_profile_frames_clear(prof);
+}
+
+void
+e_profile_free(e_profile* prof) {
+	if(prof == NULL) return;
+	E_FREE(prof->ips);
+	e_profile_init(prof);
+}
+
+void
+e_profile_frames_clear(e_profile* prof) {
+	for(uint32_t i = 0; i < E_MAX_CALLFRAMES; i++) {
+		prof->frames[i].target = E_TARGET_INVALID;
+	}
+}
+
+uint8_t
+e_profile_begin(e_profile* prof, const e_program* prog) {
+	/* Called by the vm before it runs prog, another program starts a new profile */
+	if(prof->period < 2) prof->period = 2;
+	prof->countdown = prof->period;
+	prof->sample_op = E_PROFILE_NO_SAMPLE;
+	if(prof->prog == prog && prof->code == prog->code && prof->ip_count == prog->count + 1) return 1;
+
+	e_profile_ip* ips = E_REALLOC(prof->ips, sizeof(e_profile_ip) * (prog->count + 1));
+	if(ips == NULL) {
+		e_fail("Cannot allocate the profile");
+		return 0;
+	}
+	prof->ips = ips;
+	prof->ip_count = prog->count + 1;
+	prof->prog = prog;
+	prof->code = prog->code;
+	e_profile_clear(prof);
+	return 1;
+}
+
+uint8_t
+e_profile_dump(const e_profile* prof, FILE* f) {
+	/* JSON, opcodes / instructions / functions that were never hit are left out */
+	if(prof == NULL || f == NULL) return 0;
+
+	fprintf(f, "{\"cycles\":%llu,\"ops\":[", (unsigned long long)prof->cycles);
+	const char* sep = "";
+	for(uint32_t op = 0; op < 256; op++) {
+		const e_profile_op* o = &prof->ops[op];
+		if(o->count == 0) continue;
+		fprintf(f, "%s{\"op\":%u,\"name\":\"%s\",\"count\":%llu,\"cycles\":%llu}", sep, op, e_opcode_name((uint8_t)op),
+				(unsigned long long)o->count, (unsigned long long)o->cycles);
+		sep = ",";
+	}
+
+	/* Instructions are reported with their byte address */
+	fprintf(f, "],\"ips\":[");
+	sep = "";
+	for(uint32_t i = 0; i < prof->ip_count; i++) {
+		const e_profile_ip* p = &prof->ips[i];
+		if(p->hits == 0) continue;
+		fprintf(f, "%s{\"ip\":%u,\"addr\":%u,\"op\":\"%s\",\"hits\":%llu}", sep, i, prof->prog->code[i].addr,
+				e_opcode_name(prof->prog->code[i].OP), (unsigned long long)p->hits);
+		sep = ",";
+	}
+
+	fprintf(f, "],\"functions\":[");
+	sep = "";
+	for(uint32_t i = 0; i < prof->ip_count; i++) {
+		const e_profile_ip* p = &prof->ips[i];
+		if(p->calls == 0) continue;
+		fprintf(f, "%s{\"ip\":%u,\"addr\":%u,\"calls\":%llu,\"cycles\":%llu}", sep, i, prof->prog->code[i].addr,
+				(unsigned long long)p->calls, (unsigned long long)p->cycles);
+		sep = ",";
+	}
+	fprintf(f, "]}\n");
+	return ferror(f) == 0;
+}
+
+void
+e_vm_set_profile(e_vm* vm, e_profile* prof) {
+	/* Without E_PROFILE the vm ignores the profile */
+	if(vm == NULL) return;
+	vm->profile = prof;
+	if(prof != NULL) {
+		e_profile_frames_clear(prof);
+	}
+}
@@ -0,0 +1,106 @@
+//
+// es_vm
+//
+
+#include <string.h>
+#include "vm.h"
+#include "vm_builtins.h"
+
+// Atomics, without the GCC / Clang builtins registration is not thread safe
+#if defined(__GNUC__)
+#define E_ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define E_ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define E_LOCK(p)				while(__atomic_test_and_set((p), __ATOMIC_ACQUIRE))
+#define E_UNLOCK(p)				__atomic_clear((p), __ATOMIC_RELEASE)
+#else
+#define E_ATOMIC_LOAD(p)		(*(p))
+#define E_ATOMIC_STORE(p, v)	(*(p) = (v))
+#define E_LOCK(p)				do { } while(0)
+#define E_UNLOCK(p)				do { } while(0)
+#endif
+
+// Used by vms that were not given a registry (see e_api_register_sub)
+e_registry e_default_registry;
+
+void
+e_registry_init(e_registry* reg) {
+	if(reg == NULL) return;
+	memset(reg, 0, sizeof(e_registry));
+}
+
+uint8_t
+e_registry_add(e_registry* reg, const char* identifier, uint32_t (*fptr)(e_vm*, uint32_t)) {
+	if(reg == NULL || identifier == NULL || fptr == NULL) return 0;
+	if(strlen(identifier) >= E_MAX_EXTIDENTIFIERS_STRLEN) {
+		e_fail("Subroutine identifier too long");
+		return 0;
+	}
+
+	E_LOCK(&reg->lock);
+
+	/* Registering an identifier again replaces its function */
+	uint32_t count = reg->count;
+	for(uint32_t i = 0; i < count; i++) {
+		if(strcmp(reg->entries[i].identifier, identifier) == 0) {
+			E_ATOMIC_STORE(&reg->entries[i].fptr, fptr);
+			E_UNLOCK(&reg->lock);
+			return 1;
+		}
+	}
+
+	if(count >= E_MAX_EXTIDENTIFIERS) {
+		E_UNLOCK(&reg->lock);
+		e_fail("Cannot register another subroutine");
+		return 0;
+	}
+
+	/* Fill the entry first, then publish it, readers never see a partial entry */
+	strcpy(reg->entries[count].identifier, identifier);
+	reg->entries[count].fptr = fptr;
+	E_ATOMIC_STORE(&reg->count, count + 1);
+
+	E_UNLOCK(&reg->lock);
+	return 1;
+}
+
+const e_external_mapping*
+e_registry_find(const e_registry* reg, const char* identifier) {
+	if(reg == NULL) return NULL;
+
+	uint32_t count = E_ATOMIC_LOAD(&reg->count);
+	for(uint32_t i = 0; i < count; i++) {
+		if(strcmp(reg->entries[i].identifier, identifier) == 0) {
+			return &reg->entries[i];
+		}
+	}
+	return NULL;
+}
+
+int32_t
+e_registry_call(const e_registry* reg, uint32_t index, e_vm* vm, uint32_t arglen) {
+	/* Index as resolved by e_program_link, entries never move */
+	uint32_t (*fptr)(e_vm*, uint32_t) = E_ATOMIC_LOAD(&reg->entries[index].fptr);
+	return fptr(vm, arglen);
+}
+
+void
+e_vm_set_registry(e_vm* vm, e_registry* reg) {
+	if(vm == NULL) return;
+	vm->registry = reg != NULL ? reg : &e_default_registry;
+}
+
+// C-API
+void
+e_api_register_sub(const char* identifier, uint32_t (*fptr)(e_vm*, uint32_t)) {
+	e_registry_add(&e_default_registry, identifier, fptr);
+}
+
+int32_t
+e_api_call_sub(e_vm* vm, const char* identifier, uint32_t arglen) {
+	const e_external_mapping* m = e_registry_find(vm->registry, identifier);
+	if(m == NULL) return -1;
+
+	// Call external function through fp
+	uint32_t (*fptr)(e_vm*, uint32_t) = E_ATOMIC_LOAD(&m->fptr);
+	return fptr(vm, arglen);
+}
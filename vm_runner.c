@@ -0,0 +1,349 @@
+//
+// es_vm
+//
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include "vm.h"
+#include "vm_builtins.h"
+#include "vm_runner.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define E_USE_PTHREADS 1
+#else
+#define E_USE_PTHREADS 0
+#endif
+
+#if E_USE_PTHREADS && defined(__GNUC__)
+#include <pthread.h>
+#include <unistd.h>
+
+#define E_ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define E_ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define E_ATOMIC_ADD(p, v)		__atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+
+// Worker, owns a vm and a job queue that idle workers steal from
+typedef struct {
+	e_runner* runner;
+	uint32_t index;
+	pthread_t thread;
+	pthread_mutex_t lock;       /* Protects head, tail and sleeping */
+	pthread_cond_t wake;
+	e_job* head;
+	e_job* tail;
+	uint32_t sleeping;
+	e_vm* vm;
+} e_worker;
+
+struct e_runner {
+	e_worker* workers;
+	uint32_t count;
+	uint32_t started;           /* Number of running worker threads */
+	e_registry* registry;
+	uint32_t next;              /* Round robin submission */
+	uint32_t stop;
+	uint32_t waiters;           /* Threads blocked in e_runner_wait */
+	pthread_mutex_t done_lock;
+	pthread_cond_t done;
+};
+
+static void* e_worker_main(void* arg);
+static e_job* e_worker_pop(e_worker* w);
+static e_job* e_worker_steal(e_worker* w);
+static void e_worker_run(e_worker* w, e_job* job);
+static void e_worker_wake(e_worker* w);
+
+e_runner*
+e_runner_create(uint32_t workers, e_registry* reg) {
+	if(workers == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		workers = n > 0 ? (uint32_t)n : 1;
+	}
+	if(workers > E_RUNNER_MAX_WORKERS) workers = E_RUNNER_MAX_WORKERS;
+
+	e_runner* runner = E_MALLOC(sizeof(e_runner));
+	if(runner == NULL) return NULL;
+	memset(runner, 0, sizeof(e_runner));
+	runner->registry = reg != NULL ? reg : &e_default_registry;
+	pthread_mutex_init(&runner->done_lock, NULL);
+	pthread_cond_init(&runner->done, NULL);
+
+	runner->workers = E_MALLOC(sizeof(e_worker) * workers);
+	if(runner->workers == NULL) goto error;
+	memset(runner->workers, 0, sizeof(e_worker) * workers);
+
+	for(uint32_t i = 0; i < workers; i++) {
+		e_worker* w = &runner->workers[i];
+		w->runner = runner;
+		w->index = i;
+		w->vm = E_MALLOC(sizeof(e_vm));
+		if(w->vm == NULL) goto error;
+		e_vm_init(w->vm);
+		e_vm_set_registry(w->vm, runner->registry);
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->wake, NULL);
+		runner->count++;
+	}
+
+	/* Start the threads once all workers exist, they steal from each other right away */
+	for(uint32_t i = 0; i < runner->count; i++) {
+		if(pthread_create(&runner->workers[i].thread, NULL, e_worker_main, &runner->workers[i]) != 0) goto error;
+		runner->started++;
+	}
+	return runner;
+
+	error:
+		e_fail("Cannot create script runner");
+		e_runner_destroy(runner);
+		return NULL;
+}
+
+void
+e_runner_destroy(e_runner* runner) {
+	if(runner == NULL) return;
+
+	/* Workers finish their queued jobs before they exit */
+	E_ATOMIC_STORE(&runner->stop, 1);
+	for(uint32_t i = 0; i < runner->started; i++) {
+		e_worker_wake(&runner->workers[i]);
+	}
+	for(uint32_t i = 0; i < runner->started; i++) {
+		pthread_join(runner->workers[i].thread, NULL);
+	}
+	for(uint32_t i = 0; i < runner->count; i++) {
+		e_worker* w = &runner->workers[i];
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->wake);
+		e_vm_destroy(w->vm);
+		E_FREE(w->vm);
+	}
+
+	pthread_mutex_destroy(&runner->done_lock);
+	pthread_cond_destroy(&runner->done);
+	E_FREE(runner->workers);
+	E_FREE(runner);
+}
+
+e_vm_status
+e_runner_prepare(e_runner* runner, e_program* prog, const uint8_t* bytes, uint32_t blen) {
+	/* A prepared program is only read while running, so all workers can share it: it is not quickened */
+	if(runner == NULL || e_program_load_buffer(prog, bytes, blen) != E_VM_STATUS_OK) {
+		return E_VM_STATUS_ERROR;
+	}
+	prog->shared = 1;
+	e_program_fuse(prog);
+	if(e_program_link(prog, runner->registry) != E_VM_STATUS_OK) {
+		e_program_free(prog);
+		return E_VM_STATUS_ERROR;
+	}
+	return E_VM_STATUS_OK;
+}
+
+uint8_t
+e_runner_submit(e_runner* runner, e_job* job) {
+	if(runner == NULL || job == NULL || runner->started == 0) return 0;
+
+	job->status = E_VM_STATUS_READY;
+	job->next = NULL;
+	E_ATOMIC_STORE(&job->finished, 0);
+
+	e_worker* w = &runner->workers[E_ATOMIC_ADD(&runner->next, 1) % runner->count];
+	pthread_mutex_lock(&w->lock);
+	if(w->tail != NULL) {
+		w->tail->next = job;
+	} else {
+		w->head = job;
+	}
+	w->tail = job;
+	uint32_t owner_sleeping = w->sleeping;
+	if(owner_sleeping) pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+
+	/* The owner is busy, wake an idle worker to steal the job */
+	if(!owner_sleeping) {
+		for(uint32_t i = 1; i < runner->count; i++) {
+			e_worker* o = &runner->workers[(w->index + i) % runner->count];
+			if(E_ATOMIC_LOAD(&o->sleeping)) {
+				e_worker_wake(o);
+				break;
+			}
+		}
+	}
+	return 1;
+}
+
+e_vm_status
+e_runner_wait(e_runner* runner, e_job* job) {
+	E_ATOMIC_ADD(&runner->waiters, 1);
+	pthread_mutex_lock(&runner->done_lock);
+	while(!E_ATOMIC_LOAD(&job->finished)) {
+		pthread_cond_wait(&runner->done, &runner->done_lock);
+	}
+	pthread_mutex_unlock(&runner->done_lock);
+	E_ATOMIC_ADD(&runner->waiters, -1);
+	return job->status;
+}
+
+uint8_t
+e_job_finished(const e_job* job) {
+	return E_ATOMIC_LOAD(&job->finished) != 0;
+}
+
+// Workers
+void*
+e_worker_main(void* arg) {
+	e_worker* w = arg;
+	for(;;) {
+		e_job* job = e_worker_pop(w);
+		if(job == NULL) job = e_worker_steal(w);
+		if(job != NULL) {
+			e_worker_run(w, job);
+			continue;
+		}
+
+		pthread_mutex_lock(&w->lock);
+		if(w->head == NULL) {
+			if(E_ATOMIC_LOAD(&w->runner->stop)) {
+				pthread_mutex_unlock(&w->lock);
+				break;
+			}
+			E_ATOMIC_STORE(&w->sleeping, 1);
+			pthread_cond_wait(&w->wake, &w->lock);
+			E_ATOMIC_STORE(&w->sleeping, 0);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+e_job*
+e_worker_pop(e_worker* w) {
+	pthread_mutex_lock(&w->lock);
+	e_job* job = w->head;
+	if(job != NULL) {
+		w->head = job->next;
+		if(w->head == NULL) w->tail = NULL;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return job;
+}
+
+e_job*
+e_worker_steal(e_worker* w) {
+	/* Take the oldest job of another worker, a busy victim is skipped instead of waited for */
+	e_runner* runner = w->runner;
+	for(uint32_t i = 1; i < runner->count; i++) {
+		e_worker* victim = &runner->workers[(w->index + i) % runner->count];
+		if(pthread_mutex_trylock(&victim->lock) != 0) continue;
+
+		e_job* job = victim->head;
+		if(job != NULL) {
+			victim->head = job->next;
+			if(victim->head == NULL) victim->tail = NULL;
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if(job != NULL) return job;
+	}
+	return NULL;
+}
+
+void
+e_worker_run(e_worker* w, e_job* job) {
+	e_vm* vm = w->vm;
+	e_vm_reset(vm);
+
+	/* Inputs are copied, strings are allocated from the worker's own heap. Without storage the run fails below */
+	uint32_t nglobals = e_vm_alloc(vm) ? vm->config.globals : 0;
+	for(uint32_t i = 0; i < job->in_count && i < nglobals; i++) {
+		e_value v = job->in[i];
+		if(v.argtype == E_NUMBER) {
+			vm->globals[i] = v;
+		} else if(v.argtype == E_STRING) {
+			vm->globals[i] = e_api_create_string(vm, (const char*)v.sval->sval, v.sval->slen);
+		}
+	}
+
+	if(job->prog != NULL) {
+		job->status = e_vm_run(vm, job->prog);
+	} else {
+		job->status = e_vm_parse_buffer(vm, job->bytes, job->blen);
+	}
+
+	/* Results must outlive the vm's next job, strings are copied out of its heap */
+	for(uint32_t i = 0; i < job->out_count; i++) {
+		e_value v = i < nglobals ? vm->globals[i] : (e_value) { .val = 0 };
+		if(v.argtype == E_STRING) {
+			v = e_api_create_string(NULL, (const char*)v.sval->sval, v.sval->slen);
+		} else if(v.argtype != E_NUMBER) {
+			v = (e_value) { .val = 0 };
+		}
+		job->out[i] = v;
+	}
+
+	if(job->done != NULL) {
+		job->done(job, vm);
+	}
+
+	/* The job belongs to the caller as soon as it is finished, it must not be touched after this */
+	e_runner* runner = w->runner;
+	E_ATOMIC_STORE(&job->finished, 1);
+	if(E_ATOMIC_LOAD(&runner->waiters) > 0) {
+		pthread_mutex_lock(&runner->done_lock);
+		pthread_cond_broadcast(&runner->done);
+		pthread_mutex_unlock(&runner->done_lock);
+	}
+}
+
+void
+e_worker_wake(e_worker* w) {
+	pthread_mutex_lock(&w->lock);
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+}
+
+#else
+
+e_runner*
+e_runner_create(uint32_t workers, e_registry* reg) {
+	(void)workers;
+	(void)reg;
+	e_fail("Script runner requires POSIX threads");
+	return NULL;
+}
+
+void
+e_runner_destroy(e_runner* runner) {
+	(void)runner;
+}
+
+e_vm_status
+e_runner_prepare(e_runner* runner, e_program* prog, const uint8_t* bytes, uint32_t blen) {
+	(void)runner;
+	(void)prog;
+	(void)bytes;
+	(void)blen;
+	return E_VM_STATUS_ERROR;
+}
+
+uint8_t
+e_runner_submit(e_runner* runner, e_job* job) {
+	(void)runner;
+	(void)job;
+	return 0;
+}
+
+e_vm_status
+e_runner_wait(e_runner* runner, e_job* job) {
+	(void)runner;
+	(void)job;
+	return E_VM_STATUS_ERROR;
+}
+
+uint8_t
+e_job_finished(const e_job* job) {
+	(void)job;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,49 @@
+//
+// es_vm
+//
+
+#ifndef ES_VM_VM_RUNNER_H
+#define ES_VM_VM_RUNNER_H
+
+#include "vm.h"
+
+#define E_RUNNER_MAX_WORKERS	((uint32_t)256)
+
+typedef struct e_job e_job;
+
+// Job, owned by the caller and must stay valid until it is finished
+struct e_job {
+	/* Script, either a prepared program (see e_runner_prepare) or a byte code image */
+	const e_program* prog;
+	const uint8_t* bytes;
+	uint32_t blen;
+
+	/* Globals [0..in_count) are set from in before the run (numbers and strings) */
+	const e_value* in;
+	uint32_t in_count;
+
+	/* Globals [0..out_count) are copied to out after the run, release them with e_value_release */
+	e_value* out;
+	uint32_t out_count;
+
+	/* Called on the worker thread after the run, vm still holds the script's results */
+	void (*done)(e_job* job, e_vm* vm);
+	void* user;
+
+	/* Set by the runner */
+	e_vm_status status;
+	uint32_t finished;
+	e_job* next;
+};
+
+// Pool of worker threads, each running jobs on its own vm
+typedef struct e_runner e_runner;
+
+e_runner* e_runner_create(uint32_t workers, e_registry* reg);
+void e_runner_destroy(e_runner* runner);
+e_vm_status e_runner_prepare(e_runner* runner, e_program* prog, const uint8_t* bytes, uint32_t blen);
+uint8_t e_runner_submit(e_runner* runner, e_job* job);
+e_vm_status e_runner_wait(e_runner* runner, e_job* job);
+uint8_t e_job_finished(const e_job* job);
+
+#endif //ES_VM_VM_RUNNER_H
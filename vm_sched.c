@@ -0,0 +1,88 @@
+//
+// es_vm
+//
+
+#include <string.h>
+#include "vm.h"
+#include "vm_builtins.h"
+#include "vm_sched.h"
+
+void
+e_sched_init(e_sched* sched, uint64_t slice) {
+	if(sched == NULL) return;
+	memset(sched, 0, sizeof(e_sched));
+	sched->slice = slice > 0 ? slice : E_SCHED_SLICE_STEPS;
+}
+
+void
+e_sched_free(e_sched* sched) {
+	if(sched == NULL) return;
+	E_FREE(sched->tasks);
+	sched->tasks = NULL;
+	sched->count = 0;
+	sched->cap = 0;
+}
+
+uint8_t
+e_sched_add(e_sched* sched, e_vm* vm, const e_program* prog, void* user) {
+	if(sched == NULL || vm == NULL || prog == NULL) return 0;
+
+	if(sched->count == sched->cap) {
+		uint32_t cap = sched->cap > 0 ? sched->cap * 2 : 16;
+		e_sched_task* tasks = E_REALLOC(sched->tasks, sizeof(e_sched_task) * cap);
+		if(tasks == NULL) {
+			e_fail("Cannot schedule another vm");
+			return 0;
+		}
+		sched->tasks = tasks;
+		sched->cap = cap;
+	}
+	sched->tasks[sched->count++] = (e_sched_task) { .vm = vm, .prog = prog, .user = user };
+	return 1;
+}
+
+uint32_t
+e_sched_step(e_sched* sched) {
+	/* One turn over all vms, returns the number of runnable vms left */
+	uint32_t runnable = 0;
+	uint32_t i = 0;
+	while(i < sched->count) {
+		e_sched_task* task = &sched->tasks[i];
+		e_vm_status s = task->vm->status;
+		if(s == E_VM_STATUS_WAITING) {
+			i++;
+			continue;
+		}
+		/* A failed completion (see e_vm_complete) ends the vm without running it */
+		if(s != E_VM_STATUS_ERROR) {
+			s = e_vm_run_steps(task->vm, task->prog, sched->slice);
+		}
+
+		if(s == E_VM_STATUS_SUSPENDED || s == E_VM_STATUS_WAITING) {
+			if(s == E_VM_STATUS_SUSPENDED) runnable++;
+			i++;
+			continue;
+		}
+
+		/* Finished, the last task takes its place */
+		e_sched_task t = *task;
+		sched->tasks[i] = sched->tasks[--sched->count];
+		if(sched->done != NULL) {
+			sched->done(sched, &t, s);
+		}
+	}
+	return runnable;
+}
+
+uint32_t
+e_sched_run(e_sched* sched) {
+	/* Runs until all vms finished, returns the number of vms left waiting when there is no idle callback */
+	if(sched == NULL) return 0;
+
+	while(sched->count > 0) {
+		if(e_sched_step(sched) > 0) continue;
+		if(sched->idle == NULL) break;
+		sched->idle(sched);
+	}
+	return sched->count;
+}
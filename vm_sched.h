@@ -0,0 +1,41 @@
+//
+// es_vm
+//
+
+#ifndef ES_VM_VM_SCHED_H
+#define ES_VM_VM_SCHED_H
+
+#include "vm.h"
+
+#define E_SCHED_SLICE_STEPS	((uint64_t)10000)
+
+typedef struct e_sched e_sched;
+
+// Vm run by a scheduler
+typedef struct {
+	e_vm* vm;
+	const e_program* prog;
+	void* user;
+} e_sched_task;
+
+// Runs many vms on one thread, a vm waiting for a pending external function is skipped until it is completed
+struct e_sched {
+	e_sched_task* tasks;
+	uint32_t count;
+	uint32_t cap;
+	uint64_t slice;             /* Steps per vm and turn */
+
+	/* Called when a vm finished (E_VM_STATUS_OK or E_VM_STATUS_ERROR), it is no longer scheduled */
+	void (*done)(e_sched* sched, e_sched_task* task, e_vm_status status);
+	/* Called by e_sched_run when all vms are waiting, completes pending calls (i.e. polls sockets) */
+	void (*idle)(e_sched* sched);
+	void* user;
+};
+
+void e_sched_init(e_sched* sched, uint64_t slice);
+void e_sched_free(e_sched* sched);
+uint8_t e_sched_add(e_sched* sched, e_vm* vm, const e_program* prog, void* user);
+uint32_t e_sched_step(e_sched* sched);
+uint32_t e_sched_run(e_sched* sched);
+
+#endif //ES_VM_VM_SCHED_H
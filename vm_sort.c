@@ -0,0 +1,306 @@
+//
+// es_vm
+//
+
+#include <string.h>
+#include "vm.h"
+
+// In place sorting of values: numbers (numeric columns or values that are all numbers) are radix sorted on order
+// preserving integer keys, everything else is compared (strings lexicographically by bytes, mixed values by type
+// first: numbers, strings, arrays)
+#define E_SORT_SMALL		((uint32_t)16)	/* Ranges up to this length are insertion sorted */
+#define E_SORT_RADIX_MIN	((uint32_t)64)	/* Fewer numbers are insertion sorted on their keys */
+
+typedef int32_t (*e_sort_cmp)(const e_value* a, const e_value* b);
+
+static uint64_t e_sort_key(double d);
+static double e_sort_unkey(uint64_t k);
+static void e_sort_keys_insertion(uint64_t* keys, uint32_t len);
+static uint64_t* e_sort_keys_radix(uint64_t* keys, uint64_t* tmp, uint32_t len);
+static uint64_t* e_sort_keys(uint64_t* keys, uint32_t len);
+static uint8_t e_sort_value_numbers(e_value* items, uint32_t len, uint64_t flip);
+static int32_t e_sort_cmp_strings(const e_value* a, const e_value* b);
+static int32_t e_sort_cmp_values(const e_value* a, const e_value* b);
+static void e_sort_insertion(e_value* items, uint32_t len, e_sort_cmp cmp, int32_t dir);
+static void e_sort_sift(e_value* items, uint32_t root, uint32_t len, e_sort_cmp cmp, int32_t dir);
+static void e_sort_heap(e_value* items, uint32_t len, e_sort_cmp cmp, int32_t dir);
+static void e_sort_intro(e_value* items, uint32_t len, uint32_t depth, e_sort_cmp cmp, int32_t dir);
+static uint8_t e_sort_merge(e_value* items, uint32_t len, e_sort_cmp cmp, int32_t dir);
+
+#define E_SORT_SWAP(a, b)	do { e_value t_ = (a); (a) = (b); (b) = t_; } while(0)
+
+uint64_t
+e_sort_key(double d) {
+	/* Negative values are inverted, the others get the sign bit, so the keys order like the values (-0 before 0, NaN last) */
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+	if(d != d) return UINT64_MAX;
+	return u ^ ((uint64_t)((int64_t)u >> 63) | ((uint64_t)1 << 63));
+}
+
+double
+e_sort_unkey(uint64_t k) {
+	uint64_t u = k ^ ((uint64_t)((int64_t)~k >> 63) | ((uint64_t)1 << 63));
+	double d;
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+void
+e_sort_keys_insertion(uint64_t* keys, uint32_t len) {
+	for(uint32_t i = 1; i < len; i++) {
+		uint64_t k = keys[i];
+		uint32_t j = i;
+		while(j > 0 && keys[j - 1] > k) {
+			keys[j] = keys[j - 1];
+			j--;
+		}
+		keys[j] = k;
+	}
+}
+
+uint64_t*
+e_sort_keys_radix(uint64_t* keys, uint64_t* tmp, uint32_t len) {
+	/* LSD radix sort by bytes, the counts of all bytes are taken in one pass and bytes that are equal
+	   in all keys (i.e. the exponent bytes of small integers) are skipped. Returns the sorted buffer */
+	uint32_t counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for(uint32_t i = 0; i < len; i++) {
+		uint64_t k = keys[i];
+		for(uint32_t b = 0; b < 8; b++) counts[b][(k >> (b * 8)) & 0xFF]++;
+	}
+
+	uint64_t* src = keys;
+	uint64_t* dst = tmp;
+	for(uint32_t b = 0; b < 8; b++) {
+		uint32_t* c = counts[b];
+		uint32_t shift = b * 8;
+		if(c[(src[0] >> shift) & 0xFF] == len) continue;
+
+		uint32_t sum = 0;
+		for(uint32_t j = 0; j < 256; j++) {
+			uint32_t n = c[j];
+			c[j] = sum;
+			sum += n;
+		}
+		for(uint32_t i = 0; i < len; i++) {
+			uint64_t k = src[i];
+			dst[c[(k >> shift) & 0xFF]++] = k;
+		}
+		uint64_t* t = src;
+		src = dst;
+		dst = t;
+	}
+	return src;
+}
+
+uint64_t*
+e_sort_keys(uint64_t* keys, uint32_t len) {
+	/* More than E_SORT_RADIX_MIN keys need room for len more behind them. Returns the sorted buffer */
+	if(len <= E_SORT_RADIX_MIN) {
+		e_sort_keys_insertion(keys, len);
+		return keys;
+	}
+	return e_sort_keys_radix(keys, keys + len, len);
+}
+
+uint8_t
+e_sort_value_numbers(e_value* items, uint32_t len, uint64_t flip) {
+	/* Equal keys are equal numbers, so the result is stable either way. Returns 0 if the keys cannot be allocated */
+	uint64_t small[E_SORT_RADIX_MIN];
+	uint64_t* keys = len <= E_SORT_RADIX_MIN ? small : E_MALLOC(sizeof(uint64_t) * 2 * (size_t)len);
+	if(keys == NULL) return 0;
+
+	for(uint32_t i = 0; i < len; i++) {
+		keys[i] = e_sort_key(items[i].val) ^ flip;
+	}
+	uint64_t* sorted = e_sort_keys(keys, len);
+	for(uint32_t i = 0; i < len; i++) {
+		items[i] = e_create_number(e_sort_unkey(sorted[i] ^ flip));
+	}
+
+	if(keys != small) E_FREE(keys);
+	return 1;
+}
+
+int32_t
+e_sort_cmp_strings(const e_value* a, const e_value* b) {
+	const e_str_type* x = a->sval;
+	const e_str_type* y = b->sval;
+	int c = memcmp(x->sval, y->sval, x->slen < y->slen ? x->slen : y->slen);
+	if(c != 0) return c;
+	return (x->slen > y->slen) - (x->slen < y->slen);
+}
+
+int32_t
+e_sort_cmp_values(const e_value* a, const e_value* b) {
+	if(a->argtype != b->argtype) return a->argtype < b->argtype ? -1 : 1;
+	switch(a->argtype) {
+		case E_NUMBER:
+			{
+				uint64_t x = e_sort_key(a->val);
+				uint64_t y = e_sort_key(b->val);
+				return (x > y) - (x < y);
+			}
+		case E_STRING:
+			return e_sort_cmp_strings(a, b);
+		case E_ARRAY:
+			return (a->aval.aptr > b->aval.aptr) - (a->aval.aptr < b->aval.aptr);
+		default:
+			return 0;
+	}
+}
+
+void
+e_sort_insertion(e_value* items, uint32_t len, e_sort_cmp cmp, int32_t dir) {
+	/* Stable, elements only move past greater ones */
+	for(uint32_t i = 1; i < len; i++) {
+		e_value v = items[i];
+		uint32_t j = i;
+		while(j > 0 && cmp(&items[j - 1], &v) * dir > 0) {
+			items[j] = items[j - 1];
+			j--;
+		}
+		items[j] = v;
+	}
+}
+
+void
+e_sort_sift(e_value* items, uint32_t root, uint32_t len, e_sort_cmp cmp, int32_t dir) {
+	for(;;) {
+		uint32_t child = root * 2 + 1;
+		if(child >= len) return;
+		if(child + 1 < len && cmp(&items[child], &items[child + 1]) * dir < 0) child++;
+		if(cmp(&items[root], &items[child]) * dir >= 0) return;
+		E_SORT_SWAP(items[root], items[child]);
+		root = child;
+	}
+}
+
+void
+e_sort_heap(e_value* items, uint32_t len, e_sort_cmp cmp, int32_t dir) {
+	for(uint32_t i = len / 2; i > 0; i--) {
+		e_sort_sift(items, i - 1, len, cmp, dir);
+	}
+	for(uint32_t n = len - 1; n > 0; n--) {
+		E_SORT_SWAP(items[0], items[n]);
+		e_sort_sift(items, 0, n, cmp, dir);
+	}
+}
+
+void
+e_sort_intro(e_value* items, uint32_t len, uint32_t depth, e_sort_cmp cmp, int32_t dir) {
+	/* Quicksort with a median of three pivot, ranges that partition badly too often are heap sorted */
+	while(len > E_SORT_SMALL) {
+		if(depth == 0) {
+			e_sort_heap(items, len, cmp, dir);
+			return;
+		}
+		depth--;
+
+		uint32_t mid = len / 2;
+		if(cmp(&items[mid], &items[0]) * dir < 0) E_SORT_SWAP(items[mid], items[0]);
+		if(cmp(&items[len - 1], &items[0]) * dir < 0) E_SORT_SWAP(items[len - 1], items[0]);
+		if(cmp(&items[len - 1], &items[mid]) * dir < 0) E_SORT_SWAP(items[len - 1], items[mid]);
+
+		/* The first and the last element bound both scans */
+		e_value pivot = items[mid];
+		uint32_t i = 0;
+		uint32_t j = len - 1;
+		for(;;) {
+			do i++; while(cmp(&items[i], &pivot) * dir < 0);
+			do j--; while(cmp(&pivot, &items[j]) * dir < 0);
+			if(i >= j) break;
+			E_SORT_SWAP(items[i], items[j]);
+		}
+
+		/* Recurse into the smaller part, so the depth of the recursion stays logarithmic */
+		if(i < len - i) {
+			e_sort_intro(items, i, depth, cmp, dir);
+			items += i;
+			len -= i;
+		} else {
+			e_sort_intro(items + i, len - i, depth, cmp, dir);
+			len = i;
+		}
+	}
+	e_sort_insertion(items, len, cmp, dir);
+}
+
+uint8_t
+e_sort_merge(e_value* items, uint32_t len, e_sort_cmp cmp, int32_t dir) {
+	/* Bottom up merge sort of insertion sorted runs, returns 0 if the buffer cannot be allocated */
+	e_value* tmp = E_MALLOC(sizeof(e_value) * (size_t)len);
+	if(tmp == NULL) return 0;
+
+	for(uint32_t i = 0; i < len; i += E_SORT_SMALL) {
+		e_sort_insertion(items + i, len - i < E_SORT_SMALL ? len - i : E_SORT_SMALL, cmp, dir);
+	}
+
+	e_value* src = items;
+	e_value* dst = tmp;
+	for(uint64_t w = E_SORT_SMALL; w < len; w *= 2) {
+		for(uint64_t lo = 0; lo < len; lo += 2 * w) {
+			uint32_t mid = (uint32_t)(lo + w < len ? lo + w : len);
+			uint32_t hi = (uint32_t)(lo + 2 * w < len ? lo + 2 * w : len);
+			uint32_t a = (uint32_t)lo, b = mid, o = (uint32_t)lo;
+			/* Ties take the left element */
+			while(a < mid && b < hi) {
+				dst[o++] = cmp(&src[b], &src[a]) * dir < 0 ? src[b++] : src[a++];
+			}
+			while(a < mid) dst[o++] = src[a++];
+			while(b < hi) dst[o++] = src[b++];
+		}
+		e_value* t = src;
+		src = dst;
+		dst = t;
+	}
+	if(src != items) memcpy(items, src, sizeof(e_value) * len);
+
+	E_FREE(tmp);
+	return 1;
+}
+
+uint8_t
+e_sort_values(e_value* items, uint32_t len, uint32_t flags) {
+	/* Descending is the exact reverse of ascending. Only a stable sort of strings or mixed values
+	   needs memory, it returns 0 if that cannot be allocated and leaves the values unchanged */
+	if(len < 2) return 1;
+	int32_t dir = (flags & E_SORT_DESCENDING) ? -1 : 1;
+
+	uint8_t numbers = 1;
+	uint8_t strings = 1;
+	for(uint32_t i = 0; i < len; i++) {
+		numbers &= items[i].argtype == E_NUMBER;
+		strings &= items[i].argtype == E_STRING;
+	}
+	if(numbers && e_sort_value_numbers(items, len, dir < 0 ? UINT64_MAX : 0)) return 1;
+
+	e_sort_cmp cmp = strings ? &e_sort_cmp_strings : &e_sort_cmp_values;
+	if((flags & E_SORT_STABLE) && !numbers) return e_sort_merge(items, len, cmp, dir);
+
+	uint32_t depth = 0;
+	for(uint32_t n = len; n > 1; n >>= 1) depth += 2;
+	e_sort_intro(items, len, depth, cmp, dir);
+	return 1;
+}
+
+uint8_t
+e_sort_numbers(double* nums, uint32_t len, uint32_t flags) {
+	/* Sorts a numeric column like e_sort_values, returns 0 if more than E_SORT_RADIX_MIN keys cannot be allocated */
+	uint64_t flip = (flags & E_SORT_DESCENDING) ? UINT64_MAX : 0;
+	uint64_t small[E_SORT_RADIX_MIN];
+	uint64_t* keys = len <= E_SORT_RADIX_MIN ? small : E_MALLOC(sizeof(uint64_t) * 2 * (size_t)len);
+	if(keys == NULL) return 0;
+
+	for(uint32_t i = 0; i < len; i++) {
+		keys[i] = e_sort_key(nums[i]) ^ flip;
+	}
+	uint64_t* sorted = e_sort_keys(keys, len);
+	for(uint32_t i = 0; i < len; i++) {
+		nums[i] = e_sort_unkey(sorted[i] ^ flip);
+	}
+
+	if(keys != small) E_FREE(keys);
+	return 1;
+}
@@ -0,0 +1,122 @@
+//
+// es_vm
+//
+
+#include <string.h>
+#include "vm.h"
+
+/* Block sizes (header included) of the cached size classes */
+static const uint32_t e_str_class_size[E_STR_HEAP_CLASSES] = { 32, 64, 128, 256 };
+
+static int32_t e_str_class(uint32_t slen);
+
+int32_t
+e_str_class(uint32_t slen) {
+	uint32_t size = sizeof(e_str_type) + slen + 1;
+	for(uint32_t c = 0; c < E_STR_HEAP_CLASSES; c++) {
+		if(size <= e_str_class_size[c]) return c;
+	}
+	return -1;
+}
+
+void
+e_str_heap_init(e_str_heap* heap) {
+	if(heap == NULL) return;
+	*heap = (e_str_heap) { 0 };
+}
+
+void
+e_str_heap_clear(e_str_heap* heap) {
+	if(heap == NULL) return;
+	for(uint32_t c = 0; c < E_STR_HEAP_CLASSES; c++) {
+		e_str_type* s = heap->free_list[c];
+		while(s != NULL) {
+			e_str_type* next = s->next;
+			E_FREE(s);
+			s = next;
+		}
+		heap->free_list[c] = NULL;
+		heap->free_count[c] = 0;
+	}
+}
+
+e_str_type*
+e_str_alloc(e_str_heap* heap, uint32_t slen) {
+	if(slen >= UINT32_MAX - sizeof(e_str_type)) return NULL;
+
+	int32_t c = heap != NULL ? e_str_class(slen) : -1;
+	e_str_type* s;
+
+	if(c >= 0 && heap->free_list[c] != NULL) {
+		s = heap->free_list[c];
+		heap->free_list[c] = s->next;
+		heap->free_count[c]--;
+	} else {
+		s = E_MALLOC(c >= 0 ? e_str_class_size[c] : sizeof(e_str_type) + slen + 1);
+		if(s == NULL) return NULL;
+	}
+
+	s->refs = 1;
+	s->slen = slen;
+	s->heap = heap;
+	s->sval[slen] = 0;
+	if(heap != NULL) {
+		heap->live++;
+		heap->bytes += slen;
+	}
+	return s;
+}
+
+void
+e_str_free(e_str_type* str) {
+	e_str_heap* heap = str->heap;
+	if(heap == NULL) {
+		E_FREE(str);
+		return;
+	}
+
+	heap->live--;
+	heap->bytes -= str->slen;
+
+	int32_t c = e_str_class(str->slen);
+	if(c >= 0 && heap->free_count[c] < E_STR_HEAP_MAX_FREE) {
+		str->next = heap->free_list[c];
+		heap->free_list[c] = str;
+		heap->free_count[c]++;
+	} else {
+		E_FREE(str);
+	}
+}
+
+void
+e_str_truncate(e_str_type* str, uint32_t slen) {
+	/* Shortens a string that was allocated for an upper bound, the block keeps its size */
+	if(slen >= str->slen) return;
+	if(str->heap != NULL) str->heap->bytes -= str->slen - slen;
+	str->slen = slen;
+	str->sval[slen] = 0;
+}
+
+e_value
+e_create_string(const char* str) {
+	uint32_t slen = strlen(str);
+
+	e_str_type* new_str = e_str_alloc(NULL, slen);
+	if(new_str == NULL) {
+		return (e_value) { 0 };
+	}
+	memcpy(new_str->sval, str, slen);
+
+	return (e_value) { .sval = new_str, .argtype = E_STRING };
+}
+
+e_value
+e_api_create_string(e_vm* vm, const char* str, uint32_t slen) {
+	e_str_type* new_str = e_str_alloc(vm != NULL ? &vm->strings : NULL, slen);
+	if(new_str == NULL) {
+		return (e_value) { 0 };
+	}
+	memcpy(new_str->sval, str, slen);
+
+	return (e_value) { .sval = new_str, .argtype = E_STRING };
+}